@@ -0,0 +1,146 @@
+#include "blob_log.h"
+#include "wal_record.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static void put_u32(string &out, uint32_t value)
+{
+  for (int shift = 24; shift >= 0; shift -= 8)
+  {
+    out.push_back(static_cast<char>((value >> shift) & 0xff));
+  }
+}
+
+static uint32_t get_u32(const char *p)
+{
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++)
+  {
+    value = (value << 8) | static_cast<unsigned char>(p[i]);
+  }
+  return value;
+}
+
+blob_log::~blob_log()
+{
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+}
+
+shared_ptr<blob_log> blob_log_open(uint32_t id, const string &path)
+{
+  auto log = make_shared<blob_log>(id, path);
+  log->fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+  struct stat st;
+  if (log->fd < 0 || fstat(log->fd, &st) != 0)
+  {
+    cerr << "Failed to open blob log " << path << ": " << strerror(errno) << endl;
+    return nullptr;
+  }
+  log->size = st.st_size;
+  return log;
+}
+
+shared_ptr<blob_log> blob_log_create(uint32_t id, const string &path)
+{
+  return make_shared<blob_log>(id, path);
+}
+
+/**
+ * @brief Writes the pending records at the end of the file.
+ *
+ * @return false if the file could not be created or written.
+ */
+static bool write_pending(blob_log &log)
+{
+  if (log.fd < 0 && !log.failed)
+  {
+    // A file left behind by a log that was never installed is reused
+    log.fd = open(log.path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    log.failed = log.fd < 0;
+  }
+  uint64_t offset = log.size - log.pending.size();
+  size_t written = 0;
+  while (!log.failed && written < log.pending.size())
+  {
+    ssize_t n = pwrite(log.fd, log.pending.data() + written, log.pending.size() - written, offset + written);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    log.failed = n < 0;
+    written += max<ssize_t>(n, 0);
+  }
+  if (log.failed)
+  {
+    cerr << "Failed to write blob log " << log.path << ": " << strerror(errno) << endl;
+  }
+  log.pending.clear();
+  return !log.failed;
+}
+
+uint64_t blob_log_append(blob_log &log, string_view value)
+{
+  uint64_t offset = log.size;
+  put_u32(log.pending, value.size());
+  put_u32(log.pending, crc32c(0, value.data(), value.size()));
+  log.pending.append(value.data(), value.size());
+  log.size += BLOB_RECORD_HEADER_SIZE + value.size();
+  if (log.pending.size() >= BLOB_LOG_BUFFER_SIZE)
+  {
+    write_pending(log);
+  }
+  return offset;
+}
+
+bool blob_log_sync(blob_log &log)
+{
+  if (!log.pending.empty())
+  {
+    write_pending(log);
+  }
+  // An empty new log has no file and needs none
+  return !log.failed && (log.fd < 0 || fdatasync(log.fd) == 0);
+}
+
+bool blob_log_read(const blob_log &log, uint64_t offset, uint32_t length, string &value)
+{
+  value.resize(BLOB_RECORD_HEADER_SIZE + length);
+  size_t done = 0;
+  while (log.fd >= 0 && done < value.size())
+  {
+    ssize_t n = pread(log.fd, value.data() + done, value.size() - done, offset + done);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      break;
+    }
+    done += n;
+  }
+  if (done < value.size() || get_u32(value.data()) != length ||
+      get_u32(value.data() + 4) != crc32c(0, value.data() + BLOB_RECORD_HEADER_SIZE, length))
+  {
+    cerr << "Blob at " << offset << " is missing or damaged: " << log.path << endl;
+    return false;
+  }
+  value.erase(0, BLOB_RECORD_HEADER_SIZE);
+  return true;
+}
+
+bool blob_log_gc_due(const blob_log &log)
+{
+  return log.size >= BLOB_GC_MIN_BYTES &&
+         (log.size - log.live_bytes) * 100 > log.size * BLOB_GC_GARBAGE_PERCENT;
+}
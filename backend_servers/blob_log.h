@@ -0,0 +1,64 @@
+#ifndef BLOB_LOG_H
+#define BLOB_LOG_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// u32 length and u32 CRC32C of the value, ahead of its bytes
+#define BLOB_RECORD_HEADER_SIZE 8
+// Appended records are written out once this many bytes are pending
+#define BLOB_LOG_BUFFER_SIZE (1024 * 1024)
+// A log is rewritten once it is at least this large and more than
+// BLOB_GC_GARBAGE_PERCENT of it is no longer referenced
+#define BLOB_GC_MIN_BYTES (8 * 1024 * 1024)
+#define BLOB_GC_GARBAGE_PERCENT 50
+
+/**
+ * @brief Append-only file holding a tablet's large values.
+ *
+ * Checkpoints store a value of at least LARGE_VALUE_SIZE bytes here once and
+ * keep only its offset and length, so rewriting a tablet's checkpoint costs
+ * its small cells and pointers rather than all its stored bytes. Records
+ * are never changed: a value that is overwritten or deleted stays in the
+ * log as garbage until a checkpoint copies the live values into a fresh log
+ * (see checkpoint_tablet) and the old one is deleted.
+ *
+ * Only the checkpoint thread appends; records are only read once a
+ * checkpoint referencing them has been installed, after blob_log_sync, so
+ * reads need no lock.
+ */
+struct blob_log
+{
+  uint32_t id;           // Part of the file name; ids only increase
+  std::string path;
+  int fd = -1;           // Opened on the first append for a new log
+  std::string pending;   // Appended records not yet written
+  uint64_t size = 0;     // Bytes in the file plus pending bytes
+  uint64_t live_bytes = 0; // Bytes the installed checkpoint references
+  bool failed = false;   // A write failed; offsets past it may be garbage
+
+  blob_log(uint32_t id, const std::string &path) : id(id), path(path) {}
+  ~blob_log();
+};
+
+// Opens a log a checkpoint refers to; returns nullptr if it is missing.
+std::shared_ptr<blob_log> blob_log_open(uint32_t id, const std::string &path);
+
+// A new, empty log; its file is created, or truncated, on the first append.
+std::shared_ptr<blob_log> blob_log_create(uint32_t id, const std::string &path);
+
+// Appends a value; returns the offset of its record.
+uint64_t blob_log_append(blob_log &log, std::string_view value);
+
+// Writes out and syncs every appended record; false on any I/O error.
+bool blob_log_sync(blob_log &log);
+
+// Reads and checks one record; false if it is missing or damaged.
+bool blob_log_read(const blob_log &log, uint64_t offset, uint32_t length, std::string &value);
+
+// Whether enough of the log is garbage to rewrite it.
+bool blob_log_gc_due(const blob_log &log);
+
+#endif // BLOB_LOG_H
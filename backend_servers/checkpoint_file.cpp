@@ -0,0 +1,602 @@
+#include "checkpoint_file.h"
+#include "wal_record.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static void put_uint(string &out, uint64_t value, int width)
+{
+  for (int shift = (width - 1) * 8; shift >= 0; shift -= 8)
+  {
+    out.push_back(static_cast<char>((value >> shift) & 0xff));
+  }
+}
+
+static uint64_t get_uint(const char *p, int width)
+{
+  uint64_t value = 0;
+  for (int i = 0; i < width; i++)
+  {
+    value = (value << 8) | static_cast<unsigned char>(p[i]);
+  }
+  return value;
+}
+
+static void put_varint(string &out, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+static void put_bytes(string &out, string_view bytes)
+{
+  put_varint(out, bytes.size());
+  out.append(bytes.data(), bytes.size());
+}
+
+/**
+ * @brief Cursor over a bounds-checked region of a mapped checkpoint.
+ *
+ * Any read past the end sets ok to false and returns empty values, so a
+ * damaged block ends decoding instead of reading out of bounds.
+ */
+struct byte_reader
+{
+  const char *p;
+  const char *end;
+  bool ok = true;
+
+  uint64_t varint()
+  {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+      if (p == end)
+      {
+        break;
+      }
+      unsigned char byte = *p++;
+      value |= uint64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+      {
+        return value;
+      }
+    }
+    ok = false;
+    return 0;
+  }
+
+  string_view bytes(uint64_t length)
+  {
+    if (!ok || uint64_t(end - p) < length)
+    {
+      ok = false;
+      return string_view();
+    }
+    string_view view(p, length);
+    p += length;
+    return view;
+  }
+};
+
+checkpoint_file::~checkpoint_file()
+{
+  if (data != nullptr)
+  {
+    munmap(const_cast<char *>(data), size);
+  }
+}
+
+/**
+ * @brief Maps a checkpoint file and decodes its footer and block index.
+ *
+ * @param path The checkpoint file.
+ * @return The mapped file, or nullptr if it is not a valid sorted checkpoint.
+ */
+shared_ptr<checkpoint_file> open_checkpoint_file(const string &path)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < CHECKPOINT_FOOTER_SIZE_V1)
+  {
+    close(fd);
+    return nullptr;
+  }
+  void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after the descriptor is closed
+  close(fd);
+  if (mapped == MAP_FAILED)
+  {
+    cerr << "Failed to map checkpoint " << path << ": " << strerror(errno) << endl;
+    return nullptr;
+  }
+
+  auto file = make_shared<checkpoint_file>();
+  file->path = path;
+  file->data = static_cast<const char *>(mapped);
+  file->size = st.st_size;
+
+  const size_t magic_length = strlen(CHECKPOINT_MAGIC);
+  const char *magic = file->data + file->size - magic_length;
+  size_t footer_size;
+  if (memcmp(magic, CHECKPOINT_MAGIC, magic_length) == 0)
+  {
+    footer_size = CHECKPOINT_FOOTER_SIZE;
+  }
+  else if (memcmp(magic, CHECKPOINT_MAGIC_V2, magic_length) == 0)
+  {
+    footer_size = CHECKPOINT_FOOTER_SIZE_V2;
+  }
+  else if (memcmp(magic, CHECKPOINT_MAGIC_V1, magic_length) == 0)
+  {
+    footer_size = CHECKPOINT_FOOTER_SIZE_V1;
+    file->inline_values = true;
+  }
+  else
+  {
+    return nullptr;
+  }
+  if (file->size < footer_size)
+  {
+    return nullptr;
+  }
+  const char *footer = file->data + file->size - footer_size;
+  uint64_t index_offset = get_uint(footer, 8);
+  uint64_t index_length = get_uint(footer + 8, 4);
+  uint32_t index_crc = get_uint(footer + 12, 4);
+  file->row_count = get_uint(footer + 16, 8);
+  if (!file->inline_values)
+  {
+    file->blob_log_id = get_uint(footer + 24, 4);
+    file->blob_bytes = get_uint(footer + 28, 8);
+  }
+  if (footer_size == CHECKPOINT_FOOTER_SIZE)
+  {
+    file->last_lsn = get_uint(footer + 36, 8);
+  }
+  if (index_offset + index_length > file->size - footer_size ||
+      crc32c(0, file->data + index_offset, index_length) != index_crc)
+  {
+    cerr << "Checkpoint index is damaged: " << path << endl;
+    return nullptr;
+  }
+
+  byte_reader in{file->data + index_offset, file->data + index_offset + index_length};
+  while (in.ok && in.p < in.end)
+  {
+    checkpoint_block block;
+    block.first_key = string(in.bytes(in.varint()));
+    string_view fixed = in.bytes(16);
+    if (!in.ok)
+    {
+      break;
+    }
+    block.offset = get_uint(fixed.data(), 8);
+    block.length = get_uint(fixed.data() + 8, 4);
+    block.crc = get_uint(fixed.data() + 12, 4);
+    if (block.offset + block.length > index_offset)
+    {
+      in.ok = false;
+      break;
+    }
+    file->index.push_back(move(block));
+  }
+  if (!in.ok)
+  {
+    cerr << "Checkpoint index is damaged: " << path << endl;
+    return nullptr;
+  }
+  madvise(mapped, file->size, MADV_RANDOM);
+  return file;
+}
+
+/**
+ * @brief Decodes the rows of one block in order.
+ *
+ * @param file The mapped checkpoint.
+ * @param block The block to decode; its checksum is verified first.
+ * @param visit Called with each row key and a reader positioned at its
+ * columns; returns false to stop. It must consume the columns it is given
+ * through read_columns or skip_columns.
+ * @return false if the block is damaged.
+ */
+static bool decode_block(const checkpoint_file &file, const checkpoint_block &block,
+                         const function<bool(const string &rowkey, byte_reader &in)> &visit)
+{
+  const char *start = file.data + block.offset;
+  if (crc32c(0, start, block.length) != block.crc)
+  {
+    cerr << "Checkpoint block at " << block.offset << " is damaged: " << file.path << endl;
+    return false;
+  }
+  byte_reader in{start, start + block.length};
+  string rowkey;
+  while (in.ok && in.p < in.end)
+  {
+    uint64_t shared = in.varint();
+    string_view suffix = in.bytes(in.varint());
+    if (!in.ok || shared > rowkey.size())
+    {
+      return false;
+    }
+    rowkey.resize(shared);
+    rowkey.append(suffix.data(), suffix.size());
+    if (!visit(rowkey, in))
+    {
+      break;
+    }
+  }
+  return in.ok;
+}
+
+/**
+ * @brief Reads one value, fetching it from the blob log if it is out of line.
+ *
+ * A value read from the blob log remembers where it came from, so the next
+ * checkpoint can refer to the same record instead of appending it again.
+ *
+ * @param file The checkpoint the value belongs to.
+ * @param in The reader, positioned at the value.
+ * @param values The slab the value is copied into.
+ * @return The value; on a damaged value in.ok is cleared.
+ */
+static cell_value read_value(const checkpoint_file &file, byte_reader &in, value_slab *values)
+{
+  if (file.inline_values)
+  {
+    return make_cell_value(values, in.bytes(in.varint()));
+  }
+  uint64_t tag = in.varint();
+  if (!(tag & 1))
+  {
+    return make_cell_value(values, in.bytes(tag >> 1));
+  }
+  uint64_t offset = in.varint();
+  // Reused by every read of this thread, so a large value costs no allocation
+  thread_local string blob;
+  if (!in.ok || file.blobs == nullptr || !blob_log_read(*file.blobs, offset, tag >> 1, blob))
+  {
+    in.ok = false;
+    return nullptr;
+  }
+  cell_value value = make_cell_value(values, blob);
+  if (cell_location *location = value.location())
+  {
+    location->log = file.blob_log_id;
+    location->offset = offset;
+  }
+  return value;
+}
+
+static void read_columns(const checkpoint_file &file, byte_reader &in, tablet_row &row, value_slab *values)
+{
+  uint64_t columns = in.varint();
+  for (uint64_t i = 0; i < columns && in.ok; i++)
+  {
+    string_view column = in.bytes(in.varint());
+    cell_value value = read_value(file, in, values);
+    // Columns were written in order, so each one lands at the end
+    row[column] = move(value);
+  }
+}
+
+// Steps over a row's columns; returns the blob log bytes they refer to.
+static uint64_t skip_columns(const checkpoint_file &file, byte_reader &in)
+{
+  uint64_t blob_bytes = 0;
+  uint64_t columns = in.varint();
+  for (uint64_t i = 0; i < columns && in.ok; i++)
+  {
+    in.bytes(in.varint());
+    if (file.inline_values)
+    {
+      in.bytes(in.varint());
+      continue;
+    }
+    uint64_t tag = in.varint();
+    if (tag & 1)
+    {
+      in.varint();
+      blob_bytes += BLOB_RECORD_HEADER_SIZE + (tag >> 1);
+    }
+    else
+    {
+      in.bytes(tag >> 1);
+    }
+  }
+  return blob_bytes;
+}
+
+/**
+ * @brief Finds a row with a binary search of the index and a scan of one block.
+ *
+ * @param file The mapped checkpoint.
+ * @param rowkey The row to find.
+ * @param row Receives the row's columns if it is found.
+ * @param values The slab the row's values are copied into.
+ * @return true if the checkpoint holds the row.
+ */
+bool checkpoint_find_row(const checkpoint_file &file, string_view rowkey, tablet_row &row, value_slab *values)
+{
+  // The last block whose first key is not after rowkey
+  auto it = upper_bound(file.index.begin(), file.index.end(), rowkey,
+                        [](string_view key, const checkpoint_block &block)
+                        { return key < block.first_key; });
+  if (it == file.index.begin())
+  {
+    return false;
+  }
+  --it;
+
+  bool found = false;
+  decode_block(file, *it, [&](const string &key, byte_reader &in)
+               {
+                 if (key < rowkey)
+                 {
+                   skip_columns(file, in);
+                   return true;
+                 }
+                 if (key == rowkey)
+                 {
+                   read_columns(file, in, row, values);
+                   found = in.ok;
+                 }
+                 return false; });
+  return found;
+}
+
+void checkpoint_for_each_row(const checkpoint_file &file,
+                             const function<void(const string &rowkey, const tablet_row &row)> &visit)
+{
+  for (const checkpoint_block &block : file.index)
+  {
+    decode_block(file, block, [&](const string &key, byte_reader &in)
+                 {
+                   // Visited rows are dropped straight away, so their values
+                   // stay on the heap rather than fragmenting the slab
+                   tablet_row row;
+                   read_columns(file, in, row, nullptr);
+                   if (in.ok)
+                   {
+                     visit(key, row);
+                   }
+                   return in.ok; });
+  }
+}
+
+void checkpoint_for_each_encoded_row(const checkpoint_file &file,
+                                     const function<void(const string &rowkey, const encoded_row &row)> &visit)
+{
+  for (const checkpoint_block &block : file.index)
+  {
+    decode_block(file, block, [&](const string &key, byte_reader &in)
+                 {
+                   const char *start = in.p;
+                   uint64_t blob_bytes = skip_columns(file, in);
+                   if (in.ok)
+                   {
+                     visit(key, encoded_row{string_view(start, in.p - start), blob_bytes});
+                   }
+                   return in.ok; });
+  }
+}
+
+/**
+ * @brief Tells whether a checkpoint's rows can be copied as they are.
+ *
+ * They can if they are in the current format and point into the same blob
+ * log, or into none.
+ */
+bool checkpoint_can_copy(const checkpoint_file &file, const blob_log *blobs)
+{
+  if (file.inline_values)
+  {
+    return false;
+  }
+  return file.blob_log_id == 0 || (blobs != nullptr && file.blob_log_id == blobs->id);
+}
+
+/**
+ * @brief Visits the rows from start onwards in rowkey order.
+ *
+ * Only the block that may hold start is searched for it; the scan then
+ * decodes whole blocks until visit asks it to stop.
+ *
+ * @param file The mapped checkpoint.
+ * @param start The first row to visit, if present.
+ * @param visit Called with each row key and row; returns false to stop.
+ */
+void checkpoint_scan(const checkpoint_file &file, string_view start,
+                     const function<bool(const string &rowkey, const tablet_row &row)> &visit)
+{
+  auto it = upper_bound(file.index.begin(), file.index.end(), start,
+                        [](string_view key, const checkpoint_block &block)
+                        { return key < block.first_key; });
+  if (it != file.index.begin())
+  {
+    --it;
+  }
+  bool more = true;
+  for (; more && it != file.index.end(); ++it)
+  {
+    decode_block(file, *it, [&](const string &key, byte_reader &in)
+                 {
+                   if (key < start)
+                   {
+                     skip_columns(file, in);
+                     return true;
+                   }
+                   tablet_row row;
+                   read_columns(file, in, row, nullptr);
+                   more = in.ok && visit(key, row);
+                   return more; });
+  }
+}
+
+static bool write_out(checkpoint_writer &writer, const string &bytes)
+{
+  size_t written = 0;
+  while (!writer.failed && written < bytes.size())
+  {
+    ssize_t n = write(writer.fd, bytes.data() + written, bytes.size() - written);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    writer.failed = n < 0;
+    written += max<ssize_t>(n, 0);
+  }
+  writer.offset += bytes.size();
+  return !writer.failed;
+}
+
+static void flush_block(checkpoint_writer &writer)
+{
+  if (writer.block.empty())
+  {
+    return;
+  }
+  put_bytes(writer.index, writer.block_first_key);
+  put_uint(writer.index, writer.offset, 8);
+  put_uint(writer.index, writer.block.size(), 4);
+  put_uint(writer.index, crc32c(0, writer.block.data(), writer.block.size()), 4);
+  write_out(writer, writer.block);
+  writer.block.clear();
+}
+
+bool checkpoint_writer_open(checkpoint_writer &writer, const string &path, blob_log *blobs)
+{
+  writer.blobs = blobs;
+  writer.fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (writer.fd < 0)
+  {
+    cerr << "Failed to open file: " << path << endl;
+    return false;
+  }
+  return true;
+}
+
+// Starts a row: its key, prefix-compressed against the previous one
+static void add_rowkey(checkpoint_writer &writer, const string &rowkey)
+{
+  size_t shared = 0;
+  if (writer.block.empty())
+  {
+    writer.block_first_key = rowkey;
+  }
+  else
+  {
+    size_t limit = min(rowkey.size(), writer.last_key.size());
+    while (shared < limit && rowkey[shared] == writer.last_key[shared])
+    {
+      shared++;
+    }
+  }
+  put_varint(writer.block, shared);
+  put_bytes(writer.block, string_view(rowkey).substr(shared));
+  writer.last_key = rowkey;
+  writer.row_count++;
+}
+
+// Ends a row, closing the block if it is full
+static void end_row(checkpoint_writer &writer)
+{
+  if (writer.block.size() >= CHECKPOINT_BLOCK_SIZE)
+  {
+    flush_block(writer);
+  }
+}
+
+/**
+ * @brief Appends a value, storing it in the blob log if it is large.
+ *
+ * A value already in the writer's blob log is only referred to again.
+ */
+static void add_value(checkpoint_writer &writer, const cell_value &value)
+{
+  string_view bytes = *value;
+  cell_location *location = value.location();
+  if (writer.blobs == nullptr || location == nullptr)
+  {
+    put_varint(writer.block, bytes.size() << 1);
+    writer.block.append(bytes.data(), bytes.size());
+    return;
+  }
+  if (location->log != writer.blobs->id)
+  {
+    location->offset = blob_log_append(*writer.blobs, bytes);
+    location->log = writer.blobs->id;
+  }
+  put_varint(writer.block, (bytes.size() << 1) | 1);
+  put_varint(writer.block, location->offset);
+  writer.blob_bytes += BLOB_RECORD_HEADER_SIZE + bytes.size();
+}
+
+/**
+ * @brief Appends a row; rows must arrive in strictly increasing key order.
+ */
+void checkpoint_writer_add(checkpoint_writer &writer, const string &rowkey, const tablet_row &row)
+{
+  add_rowkey(writer, rowkey);
+  put_varint(writer.block, row.size());
+  for (const auto &[column, value] : row)
+  {
+    put_bytes(writer.block, *column);
+    add_value(writer, value);
+  }
+  end_row(writer);
+}
+
+/**
+ * @brief Appends a row copied from a checkpoint for which
+ * checkpoint_can_copy holds, in the same key order as checkpoint_writer_add.
+ */
+void checkpoint_writer_add_encoded(checkpoint_writer &writer, const string &rowkey, const encoded_row &row)
+{
+  add_rowkey(writer, rowkey);
+  writer.block.append(row.columns.data(), row.columns.size());
+  writer.blob_bytes += row.blob_bytes;
+  end_row(writer);
+}
+
+bool checkpoint_writer_finish(checkpoint_writer &writer)
+{
+  flush_block(writer);
+  // The checkpoint may only point at values that are on disk
+  if (writer.blobs != nullptr && !blob_log_sync(*writer.blobs))
+  {
+    writer.failed = true;
+  }
+  uint64_t index_offset = writer.offset;
+  string footer;
+  put_uint(footer, index_offset, 8);
+  put_uint(footer, writer.index.size(), 4);
+  put_uint(footer, crc32c(0, writer.index.data(), writer.index.size()), 4);
+  put_uint(footer, writer.row_count, 8);
+  put_uint(footer, writer.blob_bytes > 0 ? writer.blobs->id : 0, 4);
+  put_uint(footer, writer.blob_bytes, 8);
+  put_uint(footer, writer.last_lsn, 8);
+  footer += CHECKPOINT_MAGIC;
+  write_out(writer, writer.index);
+  write_out(writer, footer);
+
+  bool ok = !writer.failed && fsync(writer.fd) == 0;
+  close(writer.fd);
+  writer.fd = -1;
+  return ok;
+}
@@ -0,0 +1,136 @@
+#ifndef CHECKPOINT_FILE_H
+#define CHECKPOINT_FILE_H
+
+#include "blob_log.h"
+#include "tablet_row.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Target size of one data block before a new one is started
+#define CHECKPOINT_BLOCK_SIZE (16 * 1024)
+// u64 index offset, u32 index length, u32 index crc, u64 row count, u32 blob
+// log id, u64 referenced blob bytes, u64 last LSN, magic
+#define CHECKPOINT_FOOTER_SIZE 52
+// Ends every sorted checkpoint; the newline keeps line-based transfers intact
+#define CHECKPOINT_MAGIC "TBLCKP3\n"
+// Checkpoints from older servers: no last LSN, and before that no blob log
+// fields, every value inline
+#define CHECKPOINT_FOOTER_SIZE_V2 44
+#define CHECKPOINT_MAGIC_V2 "TBLCKP2\n"
+#define CHECKPOINT_FOOTER_SIZE_V1 32
+#define CHECKPOINT_MAGIC_V1 "TBLCKP1\n"
+
+/**
+ * Immutable, sorted checkpoint of one tablet:
+ *
+ *   data blocks  Rows in rowkey order. Each row is a varint count of bytes
+ *                shared with the previous rowkey of the block, the varint
+ *                length and bytes of the rest of the key, a varint column
+ *                count and each column as its varint-length-prefixed name
+ *                and its value. A value is a varint of its length shifted
+ *                left by one; if the low bit is clear its bytes follow,
+ *                otherwise a varint offset of its record in the blob log.
+ *                The first row of a block shares nothing.
+ *   index        Per block: varint-length-prefixed first rowkey, then u64
+ *                offset, u32 length and u32 CRC32C of the block.
+ *   footer       CHECKPOINT_FOOTER_SIZE bytes, fixed integers big-endian.
+ *                The blob log id is 0 if no value is out of line. The last
+ *                LSN is that of the newest log record the rows include.
+ *
+ * The file is mapped read-only; only the index is decoded up front, and a
+ * row is decoded from its block when it is first asked for.
+ */
+struct checkpoint_block
+{
+  std::string first_key;
+  uint64_t offset;
+  uint32_t length;
+  uint32_t crc;
+};
+
+struct checkpoint_file
+{
+  std::string path;
+  const char *data = nullptr;
+  size_t size = 0;
+  uint64_t row_count = 0;
+  std::vector<checkpoint_block> index;
+  bool inline_values = false; // Written by an older server
+  uint32_t blob_log_id = 0;
+  uint64_t blob_bytes = 0;
+  uint64_t last_lsn = 0; // 0 if written by an older server
+  // The log the out-of-line values are read from; set by the caller
+  std::shared_ptr<blob_log> blobs;
+
+  ~checkpoint_file();
+};
+
+// A row's columns as a checkpoint stores them, to be copied without
+// decoding into a checkpoint that uses the same blob log
+struct encoded_row
+{
+  std::string_view columns;
+  uint64_t blob_bytes;
+};
+
+// Streams rows, added in rowkey order, into a new checkpoint file.
+struct checkpoint_writer
+{
+  int fd = -1;
+  uint64_t offset = 0;
+  uint64_t row_count = 0;
+  std::string block;
+  std::string block_first_key;
+  std::string last_key;
+  std::string index;
+  // Receives the large values of added rows; may be null to keep every
+  // value inline
+  blob_log *blobs = nullptr;
+  uint64_t blob_bytes = 0;
+  uint64_t last_lsn = 0; // Set by the caller before finishing
+  bool failed = false;
+};
+
+// Maps a sorted checkpoint. Returns nullptr if the file is not one, e.g. a
+// text checkpoint from an older server, or if its index is damaged.
+std::shared_ptr<checkpoint_file> open_checkpoint_file(const std::string &path);
+
+// Decodes one row, copying its values into values; false if the checkpoint
+// does not hold it.
+bool checkpoint_find_row(const checkpoint_file &file, std::string_view rowkey,
+                         tablet_row &row, value_slab *values);
+
+// Visits every row in rowkey order.
+void checkpoint_for_each_row(
+    const checkpoint_file &file,
+    const std::function<void(const std::string &rowkey, const tablet_row &row)> &visit);
+
+// Visits every row in rowkey order without decoding it.
+void checkpoint_for_each_encoded_row(
+    const checkpoint_file &file,
+    const std::function<void(const std::string &rowkey, const encoded_row &row)> &visit);
+
+// Whether the encoded rows of file can be copied into a writer using blobs.
+bool checkpoint_can_copy(const checkpoint_file &file, const blob_log *blobs);
+
+// Visits the rows from start onwards in rowkey order until visit returns
+// false.
+void checkpoint_scan(
+    const checkpoint_file &file, std::string_view start,
+    const std::function<bool(const std::string &rowkey, const tablet_row &row)> &visit);
+
+bool checkpoint_writer_open(checkpoint_writer &writer, const std::string &path,
+                            blob_log *blobs);
+void checkpoint_writer_add(checkpoint_writer &writer, const std::string &rowkey,
+                           const tablet_row &row);
+void checkpoint_writer_add_encoded(checkpoint_writer &writer, const std::string &rowkey,
+                                   const encoded_row &row);
+// Syncs the blob log, writes the index and footer and syncs the file; false
+// on any I/O error.
+bool checkpoint_writer_finish(checkpoint_writer &writer);
+
+#endif // CHECKPOINT_FILE_H
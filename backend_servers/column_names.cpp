@@ -0,0 +1,43 @@
+#include "column_names.h"
+#include <functional>
+#include <pthread.h>
+#include <unordered_map>
+
+using namespace std;
+
+struct name_shard
+{
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  // Keyed by a view of the interned string, so looking up a name that is
+  // already there builds no string
+  unordered_map<string_view, column_name> names;
+};
+
+static name_shard shards[COLUMN_NAME_SHARDS];
+
+column_name intern_column(string_view name)
+{
+  name_shard &shard = shards[hash<string_view>()(name) % COLUMN_NAME_SHARDS];
+  pthread_mutex_lock(&shard.mutex);
+  auto it = shard.names.find(name);
+  if (it == shard.names.end())
+  {
+    column_name copy = new string(name);
+    it = shard.names.emplace(*copy, copy).first;
+  }
+  column_name interned = it->second;
+  pthread_mutex_unlock(&shard.mutex);
+  return interned;
+}
+
+size_t interned_columns()
+{
+  size_t count = 0;
+  for (name_shard &shard : shards)
+  {
+    pthread_mutex_lock(&shard.mutex);
+    count += shard.names.size();
+    pthread_mutex_unlock(&shard.mutex);
+  }
+  return count;
+}
@@ -0,0 +1,25 @@
+#ifndef COLUMN_NAMES_H
+#define COLUMN_NAMES_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Shards of the column name dictionary, each with its own lock
+#define COLUMN_NAME_SHARDS 16
+
+/**
+ * @brief An interned column name.
+ *
+ * Every row holding a column points at the same string, so a name repeated
+ * across thousands of rows (content_1, sender, ...) is stored once. Interned
+ * names live as long as the process.
+ */
+typedef const std::string *column_name;
+
+// The interned copy of name, added to the dictionary on first use.
+column_name intern_column(std::string_view name);
+// Number of distinct names interned so far.
+size_t interned_columns();
+
+#endif // COLUMN_NAMES_H
@@ -0,0 +1,167 @@
+#include "epoch.h"
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <pthread.h>
+#include <vector>
+
+using namespace std;
+
+// Retires between two reclamation attempts by writers
+#define EPOCH_RECLAIM_INTERVAL 64
+
+/**
+ * @brief A thread's announcement of the epoch it is reading in.
+ *
+ * Each slot has a cache line to itself, so readers entering and leaving
+ * guards never write to a line another thread is writing to.
+ */
+struct alignas(64) epoch_slot
+{
+  // Global epoch when the outermost guard was entered, 0 outside any guard
+  atomic<uint64_t> epoch{0};
+  // Guards the owning thread is inside; only that thread touches it
+  int depth = 0;
+  // False once the owning thread has exited, so another thread may take it
+  atomic<bool> in_use{false};
+};
+
+struct retired_object
+{
+  uint64_t epoch;
+  shared_ptr<const void> object;
+};
+
+static atomic<uint64_t> global_epoch{1};
+
+// Every slot ever handed out; slots are reused, never freed
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<epoch_slot *> slots;
+
+// Retired objects in the order, and so the epoch order, they were retired
+static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+static deque<retired_object> retired;
+static uint64_t retires_since_reclaim = 0;
+
+/**
+ * @brief Owns the calling thread's slot, claimed on the thread's first guard
+ * and given back when the thread exits.
+ */
+struct slot_owner
+{
+  epoch_slot *slot = nullptr;
+
+  slot_owner()
+  {
+    pthread_mutex_lock(&registry_mutex);
+    for (epoch_slot *candidate : slots)
+    {
+      bool free = false;
+      if (candidate->in_use.compare_exchange_strong(free, true))
+      {
+        slot = candidate;
+        break;
+      }
+    }
+    if (slot == nullptr)
+    {
+      slot = new epoch_slot();
+      slot->in_use = true;
+      slots.push_back(slot);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+  }
+
+  ~slot_owner()
+  {
+    slot->epoch.store(0);
+    slot->in_use = false;
+  }
+};
+
+static thread_local slot_owner local_slot;
+
+epoch_guard::epoch_guard()
+{
+  epoch_slot *slot = local_slot.slot;
+  if (slot->depth++ == 0)
+  {
+    // Sequentially consistent, so the announcement is visible to
+    // epoch_reclaim before this thread loads any shared pointer
+    slot->epoch.store(global_epoch.load());
+  }
+}
+
+epoch_guard::~epoch_guard()
+{
+  epoch_slot *slot = local_slot.slot;
+  if (--slot->depth == 0)
+  {
+    slot->epoch.store(0, memory_order_release);
+  }
+}
+
+void epoch_retire(shared_ptr<const void> object)
+{
+  pthread_mutex_lock(&retired_mutex);
+  retired.push_back({global_epoch.load(), move(object)});
+  bool reclaim = ++retires_since_reclaim >= EPOCH_RECLAIM_INTERVAL;
+  if (reclaim)
+  {
+    retires_since_reclaim = 0;
+  }
+  pthread_mutex_unlock(&retired_mutex);
+  if (reclaim)
+  {
+    epoch_reclaim();
+  }
+}
+
+/**
+ * @brief Moves the global epoch on by one if every thread inside a guard
+ * entered it during the current epoch.
+ *
+ * An object retired in epoch e may still be held by readers that announced
+ * e or earlier. Once the epoch has moved on twice past e, all of those
+ * readers have left their guards, so the object can be freed.
+ */
+static void try_advance_epoch()
+{
+  uint64_t current = global_epoch.load();
+  pthread_mutex_lock(&registry_mutex);
+  for (epoch_slot *slot : slots)
+  {
+    uint64_t announced = slot->epoch.load();
+    if (announced != 0 && announced != current)
+    {
+      pthread_mutex_unlock(&registry_mutex);
+      return;
+    }
+  }
+  pthread_mutex_unlock(&registry_mutex);
+  global_epoch.compare_exchange_strong(current, current + 1);
+}
+
+void epoch_reclaim()
+{
+  try_advance_epoch();
+  uint64_t safe_epoch = global_epoch.load();
+
+  vector<shared_ptr<const void>> freed;
+  pthread_mutex_lock(&retired_mutex);
+  while (!retired.empty() && retired.front().epoch + 2 <= safe_epoch)
+  {
+    freed.push_back(move(retired.front().object));
+    retired.pop_front();
+  }
+  pthread_mutex_unlock(&retired_mutex);
+  // Destructors run here, outside the lock
+}
+
+size_t epoch_pending()
+{
+  pthread_mutex_lock(&retired_mutex);
+  size_t pending = retired.size();
+  pthread_mutex_unlock(&retired_mutex);
+  return pending;
+}
@@ -0,0 +1,40 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <cstddef>
+#include <memory>
+
+/**
+ * Epoch-based reclamation for readers that take no locks.
+ *
+ * A reader brackets its accesses to shared objects with an epoch_guard. A
+ * writer that unlinks an object hands its ownership to epoch_retire instead
+ * of freeing it; the object is released only once every reader that could
+ * still hold a pointer to it has left its guard. Readers never wait for
+ * writers, and writers never wait for readers: a slow reader only delays
+ * when retired objects are freed.
+ */
+
+// Marks the calling thread as reading for the guard's lifetime. Guards may
+// be nested; only the outermost one announces the thread.
+struct epoch_guard
+{
+  epoch_guard();
+  ~epoch_guard();
+  epoch_guard(const epoch_guard &) = delete;
+  epoch_guard &operator=(const epoch_guard &) = delete;
+};
+
+// Takes over a reference to an object that readers can no longer reach and
+// drops it once no reader can still be using the object.
+void epoch_retire(std::shared_ptr<const void> object);
+
+// Advances the epoch if every reader has caught up and frees what has become
+// safe to free. Writers call it as retired objects pile up; the checkpoint
+// thread calls it periodically so nothing lingers once writes stop.
+void epoch_reclaim();
+
+// Number of retired objects not yet freed.
+size_t epoch_pending();
+
+#endif // EPOCH_H
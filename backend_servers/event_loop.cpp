@@ -0,0 +1,529 @@
+#include "event_loop.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+extern vector<int> client_fds; // All client file descriptors
+extern bool verbose;           // Verbosity flag for debugging
+
+struct completion
+{
+  shared_ptr<connection> conn;
+  message_result result;
+};
+
+static int epoll_fd = -1;
+static int wake_fd = -1; // eventfd used by workers to wake the loop
+static thread_pool workers;
+static unordered_map<int, shared_ptr<connection>> connections;
+
+// Results handed back from the workers to the event loop thread
+static deque<completion> completions;
+static pthread_mutex_t completions_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+connection::~connection()
+{
+  if (stream_fd >= 0)
+  {
+    close(stream_fd);
+  }
+  close(fd);
+}
+
+/**
+ * @brief Puts a file descriptor into non-blocking mode.
+ *
+ * @param fd The file descriptor to modify.
+ */
+static void set_nonblocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags != -1)
+  {
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  }
+}
+
+/**
+ * @brief Registers interest in writability only while output is pending.
+ *
+ * @param conn The connection whose epoll registration is updated.
+ * @param want_write Whether EPOLLOUT should be armed.
+ */
+static void update_interest(connection &conn, bool want_write)
+{
+  if (conn.closed || conn.want_write == want_write)
+  {
+    return;
+  }
+  epoll_event ev{};
+  ev.events = (conn.read_closed ? 0u : uint32_t(EPOLLIN)) | (want_write ? uint32_t(EPOLLOUT) : 0u);
+  ev.data.fd = conn.fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &ev);
+  conn.want_write = want_write;
+}
+
+/**
+ * @brief Tears down a connection.
+ *
+ * The socket is shut down immediately, but the descriptor itself is only
+ * closed when the last reference goes away, so a worker that still holds the
+ * connection can never write into a recycled descriptor.
+ *
+ * @param conn The connection to close.
+ */
+static void close_connection(shared_ptr<connection> conn)
+{
+  if (conn->closed)
+  {
+    return;
+  }
+  conn->closed = true;
+  handle_connection_closed(*conn);
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+  shutdown(conn->fd, SHUT_RDWR);
+  connections.erase(conn->fd);
+
+  auto it = find(client_fds.begin(), client_fds.end(), conn->fd);
+  if (it != client_fds.end())
+  {
+    client_fds.erase(it);
+  }
+
+  if (verbose)
+  {
+    cout << "[" << conn->fd << "] Connection closed!\n";
+  }
+}
+
+void reply(connection &conn, const string &data)
+{
+  conn.out_buf += data;
+}
+
+/**
+ * @brief Ends the file stream of a connection.
+ *
+ * @param conn The connection.
+ */
+static void finish_stream(connection &conn)
+{
+  if (conn.stream_fd >= 0)
+  {
+    close(conn.stream_fd);
+  }
+  conn.stream_fd = -1;
+}
+
+void stream_file(connection &conn, int fd, off_t length)
+{
+  conn.stream_fd = length > 0 ? dup(fd) : -1;
+  if (length > 0 && conn.stream_fd < 0)
+  {
+    cerr << "Failed to stream file: " << strerror(errno) << endl;
+    reply(conn, "-ERR Failed to open file\r\n");
+    return;
+  }
+  conn.stream_offset = 0;
+  conn.stream_end = length;
+  reply(conn, STREAM_LENGTH_HEADER + to_string(length) + "\r\n");
+}
+
+/**
+ * @brief Sends the next part of the file being streamed.
+ *
+ * The bytes go from the page cache to the socket inside the kernel, so a
+ * checkpoint transfer is bound by the disk and the network rather than by
+ * copies through user space.
+ *
+ * @param conn The connection with an active file stream and no other
+ * pending output.
+ * @return What sendfile() returned; 0 once the whole file has been sent.
+ */
+static ssize_t send_from_stream(connection &conn)
+{
+  if (conn.stream_offset >= conn.stream_end)
+  {
+    finish_stream(conn);
+    return 0;
+  }
+  size_t length = min<off_t>(conn.stream_end - conn.stream_offset, STREAM_CHUNK_SIZE);
+  ssize_t n = sendfile(conn.fd, conn.stream_fd, &conn.stream_offset, length);
+  if (n == 0)
+  {
+    // The file shrank, so the promised length can no longer be delivered
+    errno = EIO;
+    return -1;
+  }
+  return n;
+}
+
+/**
+ * @brief Writes as much pending output as the socket accepts.
+ *
+ * @param conn The connection to flush.
+ * @return false if the connection was closed, true otherwise.
+ */
+static bool flush_output(const shared_ptr<connection> &conn)
+{
+  while (true)
+  {
+    if (conn->out_off == conn->out_buf.size())
+    {
+      conn->out_buf.clear();
+      conn->out_off = 0;
+      if (conn->stream_fd < 0)
+      {
+        break;
+      }
+    }
+
+    ssize_t n = conn->out_off < conn->out_buf.size()
+                    ? send(conn->fd, conn->out_buf.data() + conn->out_off,
+                           conn->out_buf.size() - conn->out_off, MSG_NOSIGNAL)
+                    : send_from_stream(*conn);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        update_interest(*conn, true);
+        return true;
+      }
+      cerr << "[" << conn->fd << "] Error in send(). Exiting" << endl;
+      close_connection(conn);
+      return false;
+    }
+    if (conn->out_off < conn->out_buf.size())
+    {
+      conn->out_off += n;
+    }
+  }
+
+  update_interest(*conn, false);
+  if (conn->close_after_flush)
+  {
+    close_connection(conn);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Reports whether the connection may start processing another frame.
+ *
+ * A plain connection handles one frame at a time and in order. A pipelined
+ * connection keeps up to MAX_IN_FLIGHT_PER_CONNECTION frames on the workers;
+ * each reply carries its request id, so they may complete in any order.
+ *
+ * @param conn The connection to check.
+ */
+static bool can_start_frame(const connection &conn)
+{
+  if (conn.closed || conn.close_after_flush || conn.stream_fd >= 0)
+  {
+    return false;
+  }
+  return conn.pipelined ? conn.in_flight < MAX_IN_FLIGHT_PER_CONNECTION
+                        : conn.in_flight == 0;
+}
+
+/**
+ * @brief Hands complete frames to the server.
+ *
+ * Processing stops when the connection cannot take another frame or while a
+ * file is being streamed.
+ *
+ * @param conn The connection whose buffered input is processed.
+ */
+static void pump_frames(const shared_ptr<connection> &conn)
+{
+  string_view frame;
+  while (can_start_frame(*conn) && read_buffer_peek_frame(conn->in_buf, frame))
+  {
+    handle_frame(conn, frame);
+    read_buffer_consume(conn->in_buf, frame.size());
+  }
+}
+
+/**
+ * @brief Advances a connection's state machine as far as it can go.
+ *
+ * @param conn The connection to service.
+ */
+static void service_connection(const shared_ptr<connection> &conn)
+{
+  string_view frame;
+  while (!conn->closed)
+  {
+    pump_frames(conn);
+    if (!flush_output(conn))
+    {
+      return;
+    }
+    if (conn->in_flight > 0 || conn->want_write || conn->stream_fd >= 0)
+    {
+      return;
+    }
+    // A finished file stream may have unblocked more buffered frames
+    if (!read_buffer_peek_frame(conn->in_buf, frame))
+    {
+      break;
+    }
+  }
+
+  // The client hung up and everything it sent has been answered
+  if (!conn->closed && conn->read_closed)
+  {
+    close_connection(conn);
+  }
+}
+
+/**
+ * @brief Reads everything currently available on the socket.
+ *
+ * Data goes straight into the connection's receive buffer, so a single read
+ * may carry many pipelined frames or a large part of one big frame.
+ *
+ * @param conn The connection to read from.
+ */
+static void read_input(const shared_ptr<connection> &conn)
+{
+  while (true)
+  {
+    ssize_t n = read_buffer_fill(conn->in_buf, conn->fd);
+    if (n > 0)
+    {
+      if (read_buffer_overflowed(conn->in_buf))
+      {
+        cerr << "[" << conn->fd << "] Frame exceeds " << MAX_FRAME_SIZE
+             << " bytes, closing connection" << endl;
+        close_connection(conn);
+        return;
+      }
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      return;
+    }
+    if (n < 0)
+    {
+      close_connection(conn);
+      return;
+    }
+
+    // Connection closed by client: stop polling for input, but still answer
+    // whatever complete frames it sent before hanging up
+    conn->read_closed = true;
+    epoll_event ev{};
+    ev.events = conn->want_write ? uint32_t(EPOLLOUT) : 0u;
+    ev.data.fd = conn->fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    return;
+  }
+}
+
+/**
+ * @brief Accepts every pending connection on the listening socket.
+ *
+ * @param listen_fd The non-blocking listening socket.
+ */
+static void accept_connections(int listen_fd)
+{
+  while (true)
+  {
+    sockaddr_in client_sockaddr;
+    socklen_t client_socklen = sizeof(client_sockaddr);
+    int client_fd = accept4(listen_fd, (struct sockaddr *)&client_sockaddr,
+                            &client_socklen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        cerr << "Failed to accept new connection: " << strerror(errno) << endl;
+      }
+      return;
+    }
+
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    shared_ptr<connection> conn = make_shared<connection>(client_fd);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = client_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0)
+    {
+      cerr << "[" << client_fd << "] epoll_ctl failed: " << strerror(errno) << endl;
+      continue;
+    }
+    connections[client_fd] = conn;
+    client_fds.push_back(client_fd);
+
+    if (verbose)
+    {
+      cout << "[" << client_fd << "] New connection\n";
+    }
+
+    // Send welcome message to client
+    reply(*conn, "WELCOME TO THE SERVER\r\n");
+    service_connection(conn);
+  }
+}
+
+void dispatch_to_worker(const shared_ptr<connection> &conn,
+                        function<message_result()> work)
+{
+  conn->in_flight++;
+  thread_pool_submit(workers, [conn, work]()
+                     {
+    message_result result;
+    try
+    {
+      result = work();
+    }
+    catch (const exception &e)
+    {
+      cerr << "[" << conn->fd << "] Failed to process message: " << e.what() << endl;
+      result = message_result();
+      result.close_connection = true;
+    }
+
+    pthread_mutex_lock(&completions_mutex);
+    completions.push_back({conn, std::move(result)});
+    pthread_mutex_unlock(&completions_mutex);
+
+    uint64_t one = 1;
+    write(wake_fd, &one, sizeof(one)); });
+}
+
+/**
+ * @brief Delivers worker results to their connections.
+ */
+static void drain_completions()
+{
+  uint64_t count;
+  read(wake_fd, &count, sizeof(count));
+
+  deque<completion> ready;
+  pthread_mutex_lock(&completions_mutex);
+  ready.swap(completions);
+  pthread_mutex_unlock(&completions_mutex);
+
+  for (completion &done : ready)
+  {
+    done.conn->in_flight--;
+    if (done.conn->closed)
+    {
+      continue;
+    }
+    if (done.result.apply)
+    {
+      done.result.apply(*done.conn);
+    }
+    reply(*done.conn, done.result.response);
+    if (done.result.close_connection)
+    {
+      done.conn->close_after_flush = true;
+    }
+    service_connection(done.conn);
+  }
+}
+
+void run_event_loop(int listen_fd, int num_workers)
+{
+  set_nonblocking(listen_fd);
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd < 0 || wake_fd < 0)
+  {
+    cerr << "Failed to set up event loop: " << strerror(errno) << endl;
+    return;
+  }
+
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+  ev.data.fd = wake_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+  thread_pool_start(workers, num_workers);
+
+  epoll_event events[MAX_EPOLL_EVENTS];
+  while (true)
+  {
+    int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      cerr << "epoll_wait failed: " << strerror(errno) << endl;
+      break;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+      int fd = events[i].data.fd;
+      if (fd == listen_fd)
+      {
+        accept_connections(listen_fd);
+        continue;
+      }
+      if (fd == wake_fd)
+      {
+        drain_completions();
+        continue;
+      }
+
+      auto it = connections.find(fd);
+      if (it == connections.end())
+      {
+        continue;
+      }
+      shared_ptr<connection> conn = it->second;
+      if (events[i].events & EPOLLERR)
+      {
+        close_connection(conn);
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP))
+      {
+        read_input(conn);
+      }
+      if (!conn->closed)
+      {
+        service_connection(conn);
+      }
+    }
+  }
+}
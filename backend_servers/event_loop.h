@@ -0,0 +1,110 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "../utils/read_buffer.h"
+#include "thread_pool.h"
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#define NUM_WORKER_THREADS 16
+// Frames a pipelined connection may have on the workers at the same time
+#define MAX_IN_FLIGHT_PER_CONNECTION 256
+#define MAX_EPOLL_EVENTS 256
+// Most bytes of a streamed file handed to one sendfile() call
+#define STREAM_CHUNK_SIZE (4 * 1024 * 1024)
+
+// Header of a TABGET/BLOBGET/LOGGET file transfer, followed by the file's
+// size in bytes, "\r\n" and exactly that many bytes
+#define STREAM_LENGTH_HEADER "LEN "
+
+struct tablet_data;
+struct tablet_snapshot;
+
+/**
+ * @brief Per-connection state owned by the event loop.
+ *
+ * Every field is only touched from the event loop thread. Workers never see a
+ * connection directly; they hand their results back through the completion
+ * queue, so no per-connection locking is needed.
+ */
+struct connection
+{
+  int fd;
+  read_buffer in_buf;  // Bytes received but not yet framed
+  std::string out_buf; // Bytes queued for sending
+  size_t out_off = 0;  // How much of out_buf has already been sent
+  bool want_write = false;
+
+  // File currently being streamed to the peer (TABGET/LOGGET), or -1
+  int stream_fd = -1;
+  off_t stream_offset = 0; // Next byte of the file to send
+  off_t stream_end = 0;    // Size of the file when the stream started
+
+  int in_flight = 0;              // Frames currently being processed by workers
+  bool pipelined = false;         // Frames may overlap and complete out of order
+  bool close_after_flush = false; // Close once out_buf drains
+  bool read_closed = false;       // The client has hung up
+  bool closed = false;
+
+  // Peer recovery session state (GET <range> ... quit)
+  std::string sync_tablet;
+  tablet_data *sync_tablet_data = nullptr;   // Entry of sync_tablet in the cache
+  std::shared_ptr<tablet_snapshot> snapshot; // Pinned by GET, null otherwise
+
+  explicit connection(int client_fd) : fd(client_fd) {}
+  ~connection();
+};
+
+/**
+ * @brief Result of processing one F_2_B_Message on a worker.
+ */
+struct message_result
+{
+  std::string response;
+  bool close_connection = false;
+  // Runs on the event loop thread before response is queued, for work that
+  // must change the connection itself
+  std::function<void(connection &)> apply;
+};
+
+enum frame_status
+{
+  FRAME_DONE,       // Handled inline, continue with the next frame
+  FRAME_DISPATCHED  // Handed to a worker, the reply follows on completion
+};
+
+/**
+ * @brief Hook implemented by the server for every complete "\r\n" frame.
+ *
+ * Runs on the event loop thread, so it must never block. Cheap commands reply
+ * inline, anything that may block is handed to dispatch_to_worker. The frame
+ * points into the connection's receive buffer and must be copied if it is
+ * needed after the hook returns.
+ */
+frame_status handle_frame(const std::shared_ptr<connection> &conn,
+                          std::string_view frame);
+
+/**
+ * @brief Hook implemented by the server when a connection goes away.
+ */
+void handle_connection_closed(connection &conn);
+
+// Queues data to be written to the connection.
+void reply(connection &conn, const std::string &data);
+
+// Sends STREAM_LENGTH_HEADER and the first length bytes of an open file
+// with sendfile(), without blocking the loop. The file is read through a
+// duplicate of fd, which may be -1 if length is 0.
+void stream_file(connection &conn, int fd, off_t length);
+
+// Runs work on the worker pool. Results are sent back as they complete, which
+// is request order unless the connection is pipelined.
+void dispatch_to_worker(const std::shared_ptr<connection> &conn,
+                        std::function<message_result()> work);
+
+// Accepts and serves connections on listen_fd forever.
+void run_event_loop(int listen_fd, int num_workers);
+
+#endif // EVENT_LOOP_H
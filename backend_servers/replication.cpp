@@ -0,0 +1,484 @@
+#include "replication.h"
+#include "../utils/read_buffer.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+using steady_time = chrono::steady_clock::time_point;
+
+struct replica_channel;
+
+/**
+ * @brief Progress of one log record across its replicas.
+ *
+ * Shared between the writer waiting on it and the sender threads of every
+ * replica it was queued for, which may finish after the wait has ended.
+ */
+struct replication_round
+{
+  vector<replica_channel *> channels; // Replicas the record was queued for
+  int acked = 0;                      // Replicas that applied it
+  int finished = 0;                   // Replicas that applied it or were lost
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+};
+
+struct queued_record
+{
+  string tablet_name;
+  string record;
+  shared_ptr<replication_round> round;
+  steady_time queued_at;
+};
+
+/**
+ * @brief The long-lived connection to one replica and its queue.
+ *
+ * Only the sender thread touches fd and buf; mutex protects the rest.
+ */
+struct replica_channel
+{
+  sockaddr_in addr;
+  int fd = -1;
+  read_buffer buf;
+  deque<queued_record> queue;
+  size_t in_flight = 0;         // Records of the shipment being delivered
+  steady_time oldest_in_flight; // When the first of them was queued
+  steady_time down_until;       // Writes skip the replica until then
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;   // A record was queued
+  pthread_cond_t drained_cond = PTHREAD_COND_INITIALIZER; // A shipment completed
+};
+
+// Channels by "ip:port", ordered for STATS; peers come from the config
+// file, so they are created once and never freed
+static map<string, replica_channel *> channels;
+static pthread_mutex_t channels_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic<uint64_t> shipments{0};
+static atomic<uint64_t> shipped_bytes{0};
+static atomic<uint64_t> acked_records{0};
+static atomic<uint64_t> lost_records{0};
+static atomic<uint64_t> repairs{0};
+static atomic<uint64_t> resyncs{0};
+
+// Set once at startup, before any record is queued
+static log_source read_log;
+
+bool parse_replication_policy(const string &name, replication_policy &policy)
+{
+  if (name == "sync-all")
+  {
+    policy = REPLICATION_SYNC_ALL;
+  }
+  else if (name == "majority")
+  {
+    policy = REPLICATION_MAJORITY;
+  }
+  else if (name == "async")
+  {
+    policy = REPLICATION_ASYNC;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+int replication_required_acks(replication_policy policy, size_t replicas)
+{
+  switch (policy)
+  {
+  case REPLICATION_MAJORITY:
+    // With the primary's own copy, half the replicas rounded up is a majority
+    return (replicas + 1) / 2;
+  case REPLICATION_ASYNC:
+    return 0;
+  default:
+    return replicas;
+  }
+}
+
+static void put_u32(string &out, uint32_t value)
+{
+  for (int shift = 24; shift >= 0; shift -= 8)
+  {
+    out.push_back(static_cast<char>((value >> shift) & 0xff));
+  }
+}
+
+static uint32_t get_u32(const char *p)
+{
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++)
+  {
+    value = (value << 8) | static_cast<unsigned char>(p[i]);
+  }
+  return value;
+}
+
+string encode_log_shipment(const vector<log_run> &runs)
+{
+  string value;
+  for (const log_run &run : runs)
+  {
+    put_u32(value, run.tablet_name.size());
+    value.append(run.tablet_name);
+    put_u32(value, run.records.size());
+    value.append(run.records);
+  }
+  return value;
+}
+
+bool decode_log_shipment(string_view value, vector<log_run> &runs)
+{
+  runs.clear();
+  while (!value.empty())
+  {
+    log_run run;
+    string_view *fields[] = {&run.tablet_name, &run.records};
+    for (string_view *field : fields)
+    {
+      if (value.size() < 4 || value.size() - 4 < get_u32(value.data()))
+      {
+        return false;
+      }
+      *field = value.substr(4, get_u32(value.data()));
+      value.remove_prefix(4 + field->size());
+    }
+    runs.push_back(run);
+  }
+  return true;
+}
+
+static void finish(replication_round &round, bool acked)
+{
+  (acked ? acked_records : lost_records).fetch_add(1, memory_order_relaxed);
+  pthread_mutex_lock(&round.mutex);
+  round.acked += acked;
+  round.finished++;
+  pthread_cond_broadcast(&round.cond);
+  pthread_mutex_unlock(&round.mutex);
+}
+
+/**
+ * @brief Connects a channel's socket.
+ *
+ * A replica that is stopped may still accept connections, so every call on
+ * the socket gives up after REPLICATION_TIMEOUT_MS; the replica then misses
+ * the shipment like one that cannot be reached.
+ *
+ * @return false if the replica is unreachable.
+ */
+static bool connect_channel(replica_channel &channel)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+  {
+    cerr << "Error in socket creation" << endl;
+    return false;
+  }
+  timeval timeout{REPLICATION_TIMEOUT_MS / 1000, (REPLICATION_TIMEOUT_MS % 1000) * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  if (connect(fd, (struct sockaddr *)&channel.addr, sizeof(channel.addr)) < 0)
+  {
+    close(fd);
+    return false;
+  }
+  // Batches are sent as soon as the previous one is acked
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  channel.buf = read_buffer();
+  // Log records only travel in binary frames
+  if (!negotiate_protocol_v2(fd, channel.buf) || !channel.buf.binary)
+  {
+    close(fd);
+    return false;
+  }
+  channel.fd = fd;
+  return true;
+}
+
+/**
+ * @brief Sends one shipment and reads the replica's reply.
+ *
+ * @return false if the connection failed.
+ */
+static bool ship(replica_channel &channel, const vector<log_run> &runs, F_2_B_Message &reply)
+{
+  F_2_B_Message message{};
+  message.type = F2B_TYPE_LOG_RECORDS;
+  message.isFromPrimary = 1;
+  message.value = encode_log_shipment(runs);
+  string serialized = encode_message_v2(message);
+  shipments.fetch_add(1, memory_order_relaxed);
+  shipped_bytes.fetch_add(serialized.size(), memory_order_relaxed);
+
+  size_t sent = 0;
+  while (sent < serialized.size())
+  {
+    ssize_t n = send(channel.fd, serialized.data() + sent, serialized.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0)
+    {
+      return false;
+    }
+    sent += n;
+  }
+
+  string_view frame;
+  if (!read_frame(channel.fd, channel.buf, frame))
+  {
+    return false;
+  }
+  try
+  {
+    reply = decode_message_v2(frame);
+    return true;
+  }
+  catch (const exception &e)
+  {
+    cerr << "Malformed reply from replica: " << e.what() << endl;
+    return false;
+  }
+}
+
+/**
+ * @brief Ships a run of queued records and waits for the replica's reply.
+ *
+ * Consecutive records of the same tablet travel as one run, which the
+ * replica appends to its log with a single write and applies in order. A
+ * replica that missed earlier records refuses the shipment and names the
+ * tablet (rowkey) and the last LSN it holds (value); those records are
+ * shipped from the log source first, and the shipment is sent once more.
+ * If a checkpoint has dropped them, an empty run for the tablet is sent
+ * instead, and the replica resyncs the tablet from a snapshot.
+ *
+ * @return false if the replica could not be reached or did not apply them.
+ */
+static bool deliver(replica_channel &channel, const vector<queued_record> &records)
+{
+  if (channel.fd < 0 && !connect_channel(channel))
+  {
+    return false;
+  }
+
+  vector<string> run_records;
+  vector<log_run> runs;
+  for (const queued_record &queued : records)
+  {
+    if (runs.empty() || runs.back().tablet_name != queued.tablet_name)
+    {
+      runs.push_back({queued.tablet_name, string_view()});
+      run_records.emplace_back();
+    }
+    run_records.back() += queued.record;
+  }
+  for (size_t i = 0; i < runs.size(); i++)
+  {
+    runs[i].records = run_records[i];
+  }
+
+  // Each run may need one repair of its own
+  F_2_B_Message reply;
+  for (size_t attempt = 0; attempt <= runs.size() && ship(channel, runs, reply); attempt++)
+  {
+    if (reply.status == 0)
+    {
+      return true;
+    }
+    cerr << "Replica on port " << ntohs(channel.addr.sin_port) << " refused log records: "
+         << reply.errorMessage << endl;
+
+    string tablet_name = reply.rowkey;
+    string missing;
+    if (attempt == runs.size() || reply.value.empty() || !read_log)
+    {
+      break;
+    }
+    if (!read_log(tablet_name, strtoull(reply.value.c_str(), NULL, 10), missing))
+    {
+      resyncs.fetch_add(1, memory_order_relaxed);
+      ship(channel, {{tablet_name, string_view()}}, reply);
+      break;
+    }
+    if (missing.empty())
+    {
+      break;
+    }
+    repairs.fetch_add(1, memory_order_relaxed);
+    if (!ship(channel, {{tablet_name, missing}}, reply) || reply.status != 0)
+    {
+      break;
+    }
+  }
+  close(channel.fd);
+  channel.fd = -1;
+  return false;
+}
+
+/**
+ * @brief Body of a channel's sender thread: delivers the queue in order, a
+ * shipment at a time, and acks or fails the records of each shipment.
+ */
+static void *channel_sender(void *arg)
+{
+  replica_channel *channel = static_cast<replica_channel *>(arg);
+  while (true)
+  {
+    pthread_mutex_lock(&channel->mutex);
+    while (channel->queue.empty())
+    {
+      pthread_cond_wait(&channel->queue_cond, &channel->mutex);
+    }
+    vector<queued_record> records;
+    size_t bytes = 0;
+    while (!channel->queue.empty() && records.size() < REPLICATION_BATCH_OPS && bytes < REPLICATION_BATCH_BYTES)
+    {
+      bytes += channel->queue.front().record.size();
+      records.push_back(move(channel->queue.front()));
+      channel->queue.pop_front();
+    }
+    channel->in_flight = records.size();
+    channel->oldest_in_flight = records.front().queued_at;
+    pthread_mutex_unlock(&channel->mutex);
+
+    bool delivered = deliver(*channel, records);
+
+    pthread_mutex_lock(&channel->mutex);
+    if (!delivered)
+    {
+      cerr << "Replica on port " << ntohs(channel->addr.sin_port) << " missed a shipment; skipping it for "
+           << REPLICATION_RETRY_MS << " ms" << endl;
+      // Records queued behind the lost shipment would leave a gap in the
+      // replica's log, so they are dropped with it
+      channel->down_until = chrono::steady_clock::now() + chrono::milliseconds(REPLICATION_RETRY_MS);
+      while (!channel->queue.empty())
+      {
+        records.push_back(move(channel->queue.front()));
+        channel->queue.pop_front();
+      }
+    }
+    channel->in_flight = 0;
+    pthread_cond_broadcast(&channel->drained_cond);
+    pthread_mutex_unlock(&channel->mutex);
+
+    for (const queued_record &queued : records)
+    {
+      finish(*queued.round, delivered);
+    }
+  }
+  return NULL;
+}
+
+static replica_channel &channel_for(const sockaddr_in &addr)
+{
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+  string key = string(ip) + ":" + to_string(ntohs(addr.sin_port));
+
+  pthread_mutex_lock(&channels_mutex);
+  replica_channel *&channel = channels[key];
+  if (channel == nullptr)
+  {
+    channel = new replica_channel();
+    channel->addr = addr;
+    pthread_t sender;
+    pthread_create(&sender, NULL, channel_sender, channel);
+    pthread_detach(sender);
+  }
+  pthread_mutex_unlock(&channels_mutex);
+  return *channel;
+}
+
+shared_ptr<replication_round> replication_enqueue(const vector<sockaddr_in> &replicas,
+                                                  const string &tablet_name, const string &record)
+{
+  auto round = make_shared<replication_round>();
+  steady_time now = chrono::steady_clock::now();
+  for (const sockaddr_in &addr : replicas)
+  {
+    replica_channel &channel = channel_for(addr);
+    round->channels.push_back(&channel);
+    pthread_mutex_lock(&channel.mutex);
+    bool down = now < channel.down_until;
+    if (!down)
+    {
+      channel.queue.push_back({tablet_name, record, round, now});
+      pthread_cond_signal(&channel.queue_cond);
+    }
+    pthread_mutex_unlock(&channel.mutex);
+    if (down)
+    {
+      finish(*round, false);
+    }
+  }
+  return round;
+}
+
+int replication_wait(const shared_ptr<replication_round> &round, int required_acks)
+{
+  pthread_mutex_lock(&round->mutex);
+  while (round->acked < required_acks && round->finished < int(round->channels.size()))
+  {
+    pthread_cond_wait(&round->cond, &round->mutex);
+  }
+  int acked = round->acked;
+  pthread_mutex_unlock(&round->mutex);
+
+  // Back-pressure: a replica too far behind holds up further writes
+  for (replica_channel *channel : round->channels)
+  {
+    pthread_mutex_lock(&channel->mutex);
+    while (channel->queue.size() + channel->in_flight > REPLICATION_MAX_LAG)
+    {
+      pthread_cond_wait(&channel->drained_cond, &channel->mutex);
+    }
+    pthread_mutex_unlock(&channel->mutex);
+  }
+  return acked;
+}
+
+void replication_set_log_source(log_source source)
+{
+  read_log = source;
+}
+
+string replication_stats()
+{
+  ostringstream out;
+  out << "replication_shipments=" << shipments.load()
+      << " replication_shipped_bytes=" << shipped_bytes.load()
+      << " replication_acked=" << acked_records.load()
+      << " replication_lost=" << lost_records.load()
+      << " replication_repairs=" << repairs.load()
+      << " replication_resyncs=" << resyncs.load();
+
+  steady_time now = chrono::steady_clock::now();
+  pthread_mutex_lock(&channels_mutex);
+  for (const auto &[name, channel] : channels)
+  {
+    pthread_mutex_lock(&channel->mutex);
+    size_t lag = channel->queue.size() + channel->in_flight;
+    steady_time oldest = channel->in_flight > 0 ? channel->oldest_in_flight
+                         : lag > 0              ? channel->queue.front().queued_at
+                                                : now;
+    pthread_mutex_unlock(&channel->mutex);
+    out << " replica_" << name << "_lag=" << lag
+        << " replica_" << name << "_lag_ms="
+        << chrono::duration_cast<chrono::milliseconds>(now - oldest).count();
+  }
+  pthread_mutex_unlock(&channels_mutex);
+  return out.str();
+}
@@ -0,0 +1,100 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include "../utils/utils.h"
+#include <functional>
+#include <memory>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Log records a replica may fall behind by before writers to its tablets block
+#define REPLICATION_MAX_LAG 4096
+// Most queued records sent to a replica as one shipment
+#define REPLICATION_BATCH_OPS 256
+// Shipments are also cut once they hold this many record bytes
+#define REPLICATION_BATCH_BYTES (4 * 1024 * 1024)
+// After failing to reach a replica, writes skip it for this long
+#define REPLICATION_RETRY_MS 500
+// Longest a sender waits to connect to a replica, send to it or hear back
+#define REPLICATION_TIMEOUT_MS 5000
+
+/**
+ * @brief How many replicas must hold a write before the client is answered.
+ */
+enum replication_policy
+{
+  REPLICATION_SYNC_ALL, // Every replica
+  REPLICATION_MAJORITY, // Enough replicas for a majority with the primary
+  REPLICATION_ASYNC     // None; replicas catch up in the background
+};
+
+struct replication_round;
+
+// Log records of one tablet within a shipment, in LSN order
+struct log_run
+{
+  std::string_view tablet_name;
+  std::string_view records; // Concatenated, exactly as in the primary's log
+};
+
+// Reads the records of a tablet's log after an LSN, as the primary logged
+// them; false if the log no longer reaches back that far.
+typedef std::function<bool(const std::string &tablet_name, uint64_t after_lsn, std::string &records)> log_source;
+
+// Parses "sync-all", "majority" or "async"; returns false for anything else.
+bool parse_replication_policy(const std::string &name, replication_policy &policy);
+
+// Acks a write waits for under a policy when its tablet has this many replicas.
+int replication_required_acks(replication_policy policy, size_t replicas);
+
+/**
+ * @brief Queues a log record for every replica without waiting for them.
+ *
+ * Replication ships the primary's own log: each replica has one long-lived
+ * connection and a sender thread that drains its queue in order, packing
+ * whatever has queued up into a single F2B_TYPE_LOG_RECORDS shipment and
+ * waiting for the replica's reply before sending the next one. Records
+ * therefore reach a replica in the order they were queued, which is LSN
+ * order as long as each tablet's records are queued as they are logged.
+ * A replica that cannot be reached is skipped, and its queued records are
+ * dropped, until REPLICATION_RETRY_MS has passed. When it refuses a later
+ * shipment because records are missing, they are read back from the log
+ * source and shipped ahead of it; once a checkpoint has dropped them, the
+ * replica is told to resync the tablet from a snapshot.
+ *
+ * @param replicas The replicas of the record's tablet.
+ * @param tablet_name The tablet whose log holds the record.
+ * @param record The record, as encode_wal_record wrote it.
+ * @return The round to pass to replication_wait.
+ */
+std::shared_ptr<replication_round> replication_enqueue(const std::vector<sockaddr_in> &replicas,
+                                                       const std::string &tablet_name,
+                                                       const std::string &record);
+
+/**
+ * @brief Waits until a queued record has enough acks, then until none of
+ * its replicas lags by more than REPLICATION_MAX_LAG records.
+ *
+ * @param round The round returned by replication_enqueue.
+ * @param required_acks Acks to wait for; the wait also ends once every
+ *        replica has either acked or been lost.
+ * @return The number of replicas that had acked when the wait ended.
+ */
+int replication_wait(const std::shared_ptr<replication_round> &round, int required_acks);
+
+// Packs runs into the value of an F2B_TYPE_LOG_RECORDS message: per run a
+// u32 tablet name length, the name, a u32 records length and the records.
+std::string encode_log_shipment(const std::vector<log_run> &runs);
+
+// Splits such a value into runs viewing it; false if it is malformed.
+bool decode_log_shipment(std::string_view value, std::vector<log_run> &runs);
+
+// Sets where senders read records a replica reports missing.
+void replication_set_log_source(log_source source);
+
+// Per-replica lag and totals as "key=value" pairs separated by spaces.
+std::string replication_stats();
+
+#endif // REPLICATION_H
@@ -0,0 +1,97 @@
+#include "row_cache.h"
+#include <atomic>
+#include <pthread.h>
+#include <sstream>
+#include <vector>
+
+using namespace std;
+
+// Hit and miss counts of one thread, on a cache line of their own so
+// lock-free readers never write to a line another thread uses
+struct alignas(64) access_counters
+{
+  atomic<uint64_t> hits{0};
+  atomic<uint64_t> misses{0};
+};
+
+static atomic<size_t> budget{0};
+static atomic<int64_t> resident{0};
+static atomic<uint64_t> evictions{0};
+
+// Every thread's counters. They are kept when a thread exits so its counts
+// stay in the totals; threads come from fixed pools, so this stays small.
+static vector<access_counters *> counters;
+static pthread_mutex_t counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static access_counters &thread_counters()
+{
+  thread_local access_counters *mine = nullptr;
+  if (mine == nullptr)
+  {
+    mine = new access_counters();
+    pthread_mutex_lock(&counters_mutex);
+    counters.push_back(mine);
+    pthread_mutex_unlock(&counters_mutex);
+  }
+  return *mine;
+}
+
+void row_cache_set_budget(size_t bytes)
+{
+  budget = bytes;
+}
+
+void row_cache_charge(int64_t bytes)
+{
+  resident.fetch_add(bytes, memory_order_relaxed);
+}
+
+size_t row_cache_excess()
+{
+  size_t limit = budget.load(memory_order_relaxed);
+  int64_t used = resident.load(memory_order_relaxed);
+  if (limit == 0 || used <= int64_t(limit))
+  {
+    return 0;
+  }
+  return used - limit * ROW_CACHE_LOW_WATERMARK_PERCENT / 100;
+}
+
+// Only the owning thread writes its counters, so a plain load and store
+// replaces a locked read-modify-write
+void row_cache_hit()
+{
+  atomic<uint64_t> &hits = thread_counters().hits;
+  hits.store(hits.load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+void row_cache_miss()
+{
+  atomic<uint64_t> &misses = thread_counters().misses;
+  misses.store(misses.load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+void row_cache_evicted(size_t rows)
+{
+  evictions.fetch_add(rows, memory_order_relaxed);
+}
+
+string row_cache_stats()
+{
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  pthread_mutex_lock(&counters_mutex);
+  for (const access_counters *thread : counters)
+  {
+    hits += thread->hits.load(memory_order_relaxed);
+    misses += thread->misses.load(memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&counters_mutex);
+  ostringstream out;
+  out << "cache_budget=" << budget.load()
+      << " cache_resident=" << resident.load()
+      << " cache_hits=" << hits
+      << " cache_misses=" << misses
+      << " cache_evictions=" << evictions.load();
+  return out.str();
+}
@@ -0,0 +1,41 @@
+#ifndef ROW_CACHE_H
+#define ROW_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Eviction frees rows until the node is this far below its budget, so it
+// does not run again after every few writes
+#define ROW_CACHE_LOW_WATERMARK_PERCENT 90
+
+/**
+ * Node-wide accounting of the rows tablets hold in memory.
+ *
+ * Rows that are also in a tablet's checkpoint file can be dropped from
+ * memory and decoded again on their next access. With a budget set (-m),
+ * the checkpoint thread evicts cold rows once the estimated footprint of
+ * the in-memory rows exceeds it, and checkpoints tablets early so rows that
+ * were only in memory become evictable too.
+ */
+
+// Sets the budget in bytes; 0 (the default) means unbounded.
+void row_cache_set_budget(size_t bytes);
+
+// Adds to (or, when negative, removes from) the estimated resident bytes.
+void row_cache_charge(int64_t bytes);
+
+// Bytes to free to get back under the low watermark; 0 if within budget.
+size_t row_cache_excess();
+
+// Counts a row access served from memory, or one that had to read the
+// checkpoint file. Each thread counts into its own slot.
+void row_cache_hit();
+void row_cache_miss();
+
+void row_cache_evicted(size_t rows);
+
+// "cache_budget=... cache_resident=... cache_hits=... ..." for STATS.
+std::string row_cache_stats();
+
+#endif // ROW_CACHE_H
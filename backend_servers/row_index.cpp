@@ -0,0 +1,195 @@
+#include "row_index.h"
+#include "epoch.h"
+
+using namespace std;
+
+static shared_ptr<row_table> make_row_table(size_t capacity)
+{
+  auto table = make_shared<row_table>();
+  table->mask = capacity - 1;
+  table->slots.reset(new row_slot[capacity]);
+  for (size_t i = 0; i < capacity; i++)
+  {
+    table->slots[i].hash.store(0, memory_order_relaxed);
+    table->slots[i].entry.store(nullptr, memory_order_relaxed);
+  }
+  return table;
+}
+
+// Left in the slot of a removed entry; never matches a lookup
+static row_entry tombstone("", 0);
+
+row_index::row_index()
+    : table_owner(make_row_table(ROW_TABLE_MIN_CAPACITY)),
+      entries(make_shared<vector<unique_ptr<row_entry>>>())
+{
+  table.store(table_owner.get());
+}
+
+/**
+ * @brief Probes a table for a rowkey.
+ *
+ * A slot's hash is written before its entry is published with a release
+ * store, and slots are never emptied again, so a reader that sees an entry
+ * also sees its hash, and an empty slot ends the probe.
+ */
+row_entry *row_index_find(const row_index &index, string_view rowkey, size_t hash)
+{
+  const row_table *table = index.table.load(memory_order_acquire);
+  for (size_t i = hash & table->mask;; i = (i + 1) & table->mask)
+  {
+    const row_slot &slot = table->slots[i];
+    row_entry *entry = slot.entry.load(memory_order_acquire);
+    if (entry == nullptr)
+    {
+      return nullptr;
+    }
+    if (entry != &tombstone && slot.hash.load(memory_order_relaxed) == hash && entry->rowkey == rowkey)
+    {
+      return entry;
+    }
+  }
+}
+
+static void place_entry(row_table &table, row_entry *entry)
+{
+  size_t i = entry->hash & table.mask;
+  while (table.slots[i].entry.load(memory_order_relaxed) != nullptr)
+  {
+    i = (i + 1) & table.mask;
+  }
+  table.slots[i].hash.store(entry->hash, memory_order_relaxed);
+  table.slots[i].entry.store(entry, memory_order_release);
+  table.count++;
+}
+
+/**
+ * @brief Inserts an entry, first moving to a new table if this one would
+ * pass half full counting tombstones.
+ *
+ * The new table is twice the size unless dropping the tombstones makes
+ * enough room. It is filled completely before it is published, and the old
+ * one is retired, as readers may still be probing it.
+ */
+row_entry *row_index_insert(row_index &index, string_view rowkey, size_t hash, shared_ptr<const tablet_row> row)
+{
+  row_table *table = index.table_owner.get();
+  if ((table->count + table->tombstones + 1) * 2 > table->mask + 1)
+  {
+    size_t capacity = table->mask + 1;
+    if ((table->count + 1) * 4 > capacity)
+    {
+      capacity *= 2;
+    }
+    shared_ptr<row_table> grown = make_row_table(capacity);
+    for (const unique_ptr<row_entry> &entry : *index.entries)
+    {
+      place_entry(*grown, entry.get());
+    }
+    index.table.store(grown.get(), memory_order_release);
+    epoch_retire(move(index.table_owner));
+    index.table_owner = move(grown);
+    table = index.table_owner.get();
+  }
+
+  index.entries->push_back(make_unique<row_entry>(rowkey, hash));
+  row_entry *entry = index.entries->back().get();
+  entry->position = index.entries->size() - 1;
+  entry->row.store(row.get(), memory_order_relaxed);
+  entry->owner = move(row);
+  // The release store in place_entry publishes the version with the entry
+  place_entry(*table, entry);
+  return entry;
+}
+
+void row_index_publish(row_entry &entry, shared_ptr<const tablet_row> row)
+{
+  entry.row.store(row.get(), memory_order_release);
+  entry.owner.swap(row);
+  if (row)
+  {
+    epoch_retire(move(row));
+  }
+}
+
+/**
+ * @brief Replaces an entry's slot with a tombstone and retires the entry.
+ *
+ * The last entry takes its place in the entry list, so removal does not
+ * shift the list.
+ */
+void row_index_remove(row_index &index, row_entry &entry)
+{
+  row_table &table = *index.table_owner;
+  for (size_t i = entry.hash & table.mask;; i = (i + 1) & table.mask)
+  {
+    if (table.slots[i].entry.load(memory_order_relaxed) == &entry)
+    {
+      table.slots[i].entry.store(&tombstone, memory_order_release);
+      table.count--;
+      table.tombstones++;
+      break;
+    }
+  }
+
+  vector<unique_ptr<row_entry>> &entries = *index.entries;
+  size_t position = entry.position;
+  unique_ptr<row_entry> removed = move(entries[position]);
+  if (position + 1 < entries.size())
+  {
+    entries[position] = move(entries.back());
+    entries[position]->position = position;
+  }
+  entries.pop_back();
+  // Readers may still be looking at the entry and its version
+  epoch_retire(shared_ptr<const row_entry>(move(removed)));
+}
+
+/**
+ * @brief Runs the eviction clock (CLOCK, a cheap approximation of LRU).
+ */
+size_t row_index_sweep(row_index &index, size_t steps, const function<bool(const row_entry &entry)> &evict)
+{
+  vector<unique_ptr<row_entry>> &entries = *index.entries;
+  size_t removed = 0;
+  for (; steps > 0 && !entries.empty(); steps--)
+  {
+    if (index.clock_hand >= entries.size())
+    {
+      index.clock_hand = 0;
+    }
+    row_entry &entry = *entries[index.clock_hand];
+    if (entry.referenced.load(memory_order_relaxed))
+    {
+      entry.referenced.store(false, memory_order_relaxed);
+    }
+    else if (evict(entry))
+    {
+      // The last entry moves into this position, so the hand stays put
+      row_index_remove(index, entry);
+      removed++;
+      continue;
+    }
+    index.clock_hand++;
+  }
+  return removed;
+}
+
+void row_index_clear(row_index &index)
+{
+  shared_ptr<row_table> empty = make_row_table(ROW_TABLE_MIN_CAPACITY);
+  index.table.store(empty.get(), memory_order_release);
+  epoch_retire(move(index.table_owner));
+  // The entries own the current row versions, so they go the same way
+  epoch_retire(move(index.entries));
+  index.table_owner = move(empty);
+  index.entries = make_shared<vector<unique_ptr<row_entry>>>();
+}
+
+void row_index_for_each(const row_index &index, const function<void(const row_entry &entry)> &visit)
+{
+  for (const unique_ptr<row_entry> &entry : *index.entries)
+  {
+    visit(*entry);
+  }
+}
@@ -0,0 +1,111 @@
+#ifndef ROW_INDEX_H
+#define ROW_INDEX_H
+
+#include "checkpoint_file.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Initial number of slots of a row table; always a power of two
+#define ROW_TABLE_MIN_CAPACITY 16
+
+/**
+ * @brief A row a tablet holds in memory.
+ *
+ * Row versions are immutable: a write builds a new version and publishes it
+ * with a single atomic store, and readers holding an epoch_guard load the
+ * current one without taking any lock. The version it replaced is retired
+ * through epoch_retire, so a reader still looking at it is never left with
+ * freed memory.
+ */
+struct row_entry
+{
+  // Short keys are kept inline by std::string's small-string buffer
+  const std::string rowkey;
+  const size_t hash;
+  // Current version, or null if the row is known not to exist
+  std::atomic<const tablet_row *> row{nullptr};
+  // Owns row; only touched under the stripe lock
+  std::shared_ptr<const tablet_row> owner;
+  // Set on every access and cleared by the eviction clock, so rows used
+  // since its last pass are spared
+  std::atomic<bool> referenced{true};
+  // Writer side only: the tablet's write generation at the last change of
+  // the row (0 if it was never changed in memory), and the entry's place in
+  // row_index::entries
+  uint64_t last_write = 0;
+  size_t position = 0;
+
+  row_entry(std::string_view rowkey, size_t hash) : rowkey(rowkey), hash(hash) {}
+};
+
+// One slot of a row table. The hash sits next to the entry pointer, so a
+// probe compares hashes inside the flat slot array and only follows the
+// pointer of an entry whose hash matches. A removed entry leaves a
+// tombstone, which probes step over.
+struct row_slot
+{
+  std::atomic<size_t> hash;
+  std::atomic<row_entry *> entry;
+};
+
+// Open-addressing table of entries with linear probing. Slots only go from
+// empty to an entry and from an entry to a tombstone; a table that fills up
+// is replaced by a rebuilt copy, never resized or cleaned in place.
+struct row_table
+{
+  size_t mask;
+  std::unique_ptr<row_slot[]> slots;
+  size_t count = 0;      // Slots holding an entry
+  size_t tombstones = 0; // Slots holding a tombstone
+};
+
+/**
+ * @brief Maps rowkeys to entries; lookups are lock-free, inserts and
+ * publishes are serialized by the caller (the stripe lock).
+ */
+struct row_index
+{
+  // The table readers probe
+  std::atomic<row_table *> table{nullptr};
+  // Owns table and every entry; only touched by writers
+  std::shared_ptr<row_table> table_owner;
+  std::shared_ptr<std::vector<std::unique_ptr<row_entry>>> entries;
+  // Position of the eviction clock in entries
+  size_t clock_hand = 0;
+
+  row_index();
+};
+
+// Finds an entry without locking; the caller holds an epoch_guard or the
+// writer lock. Returns nullptr if the row has no entry.
+row_entry *row_index_find(const row_index &index, std::string_view rowkey, size_t hash);
+
+// Adds an entry whose first version is row (null for a missing row); rowkey
+// must not have one yet. Readers see the entry and its version together.
+row_entry *row_index_insert(row_index &index, std::string_view rowkey, size_t hash,
+                            std::shared_ptr<const tablet_row> row);
+
+// Makes row the entry's current version and retires the previous one.
+void row_index_publish(row_entry &entry, std::shared_ptr<const tablet_row> row);
+
+// Drops one entry, leaving readers that still hold it unharmed.
+void row_index_remove(row_index &index, row_entry &entry);
+
+// Moves the eviction clock over up to steps entries. A referenced entry is
+// spared and loses its mark; any other entry for which evict returns true
+// is removed. Returns the number of entries removed.
+size_t row_index_sweep(row_index &index, size_t steps,
+                       const std::function<bool(const row_entry &entry)> &evict);
+
+// Drops every entry, leaving readers that still hold them unharmed.
+void row_index_clear(row_index &index);
+
+// Visits every entry in no particular order; writer side only.
+void row_index_for_each(const row_index &index,
+                        const std::function<void(const row_entry &entry)> &visit);
+
+#endif // ROW_INDEX_H
@@ -4,11 +4,27 @@
 // Includes custom utility functions
 // #include "../utils/utils.h"
 #include "utils.h"
+#include "event_loop.h"
+#include "replication.h"
 #include <cmath>
 
 // Namespace declaration for convenience
 using namespace std;
 #define COORDINATOR_PORT 7070
+#define PRIMARY_MAP_POLL_MS 250
+#define CHECKPOINT_POLL_SECONDS 1
+// Longest a worker waits on another backend for a forwarded write
+#define FORWARD_TIMEOUT_MS 5000
+// Times a restarting replica tries to catch each tablet up from its primary
+#define CATCH_UP_ATTEMPTS 3
+// Reply to a write that fewer replicas acked than its range's policy needs
+#define REPLICATION_SHORTFALL_ERROR "Not enough replicas acked the write"
+// Reply to a write whose tablet log could not be written or synced
+#define LOG_FAILURE_ERROR "Failed to log the write"
+// Reply to the ops of a batch group whose primary could not be reached
+#define FORWARD_FAILURE_ERROR "Failed to reach the primary"
+#define SCAN_DEFAULT_LIMIT 100 // Rows per SCAN page when none is asked for
+#define SCAN_MAX_LIMIT 1000
 
 vector<int> client_fds{};  // All client file descriptors
 string server_ip;          // Server IP address
@@ -17,18 +33,35 @@ int server_port;           // Port on which server listens for connections
 int server_index;          // Index of the server
 int listen_fd;             // File descriptor for the listening socket
 bool verbose = false;      // Verbosity flag for debugging
+wal_durability log_durability = WAL_DURABILITY_STRICT; // Set with -d
 
 unordered_map<string, vector<sockaddr_in>> tablet_ranges_to_other_addr{};
+// Tablets without a "replication" line in the config file use majority
+unordered_map<string, replication_policy> tablet_replication_policy;
 unordered_map<string, tablet_data> cache;
 vector<string> server_tablet_ranges;
 vector<string> all_unique_tablet_ranges;
+// Primary of every config range, as last sent by the coordinator; only
+// trusted until primary_lease_until
 unordered_map<string, string> range_to_primary_map;
+uint64_t primary_map_epoch = 0;
+chrono::steady_clock::time_point primary_lease_until;
+chrono::milliseconds primary_lease_length{0};
 
 pthread_mutex_t primary_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Set by writers to wake the checkpoint thread before its next poll
+bool checkpoint_requested = false;
+pthread_mutex_t checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t checkpoint_cond = PTHREAD_COND_INITIALIZER;
+
 bool suspended = false;                                    // Global variable to control suspension
 pthread_mutex_t suspend_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for suspended variable
 
+// Tablets being resynced from a snapshot of their primary in the background
+set<string> resyncing_tablets;
+pthread_mutex_t resync_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 // Function prototypes for parsing and initializing server configuration
 sockaddr_in parse_current_address(char *raw_line);
 sockaddr_in parse_config_file(string config_file);
@@ -36,23 +69,37 @@ sockaddr_in parse_config_file(string config_file);
 // Signal handler function for clean exit
 void exit_handler(int sig);
 
-// Function prototype for handling client connections in separate threads
-void *handle_connection(void *arg);
+// Function prototype for processing an F_2_B_Message on a worker thread
+message_result process_message(const string &message, bool binary);
+
+// Function prototype for the background checkpoint thread
+void *checkpoint_thread(void *);
+
+// Function prototype for finding the config range of a row or tablet
+string get_tablet_range_from_row_key(string row_key);
+
+// Function prototype for appending records received from a primary
+string append_log_run(const string &tablet_name, tablet_data &tablet, string_view records, bool &gap);
+
+// Function prototype for reading a tablet's log records after an LSN
+bool read_log_suffix(const string &tablet_name, uint64_t from_lsn, string &records);
 
 void save_cache()
 {
-  for (const auto &entry : cache)
+  for (auto &entry : cache)
   {
     ofstream file(data_file_location + "/" + entry.first);
-
-    for (const auto &row : entry.second.row_to_kv)
-    {
-      for (const auto &inner_entry : row.second)
-      {
-        file << row.first << " " << inner_entry.first << " "
-             << inner_entry.second << "\n";
-      }
-    }
+    tablet_data &tablet = entry.second;
+
+    for_each_row(snapshot_rows(tablet), tablet.base.get(),
+                 [&](const string &rowkey, const tablet_row &row)
+                 {
+                   for (const auto &inner_entry : row)
+                   {
+                     file << rowkey << " " << *inner_entry.first << " "
+                          << *inner_entry.second << "\n";
+                   }
+                 });
     file.close();
   }
 }
@@ -62,11 +109,10 @@ void initialize_cache(std::unordered_map<std::string, tablet_data> &cache)
   // Iterate over each tablet range provided in the server_tablet_ranges
   for (const std::string &tablet_range : server_tablet_ranges)
   {
-    // Initialize a new tablet data instance for each range
-    tablet_data new_tablet;
-
-    // Insert the new tablet data into the cache using the tablet range as the key
-    cache[tablet_range] = new_tablet;
+    // Construct a new tablet data instance in place for each range, so its
+    // mutex and condition variable are never copied
+    cache.try_emplace(tablet_range);
+    wal_open(cache[tablet_range].wal, data_file_location + "/" + get_log_file_name(tablet_range));
   }
 }
 
@@ -79,24 +125,71 @@ void printMap(const std::unordered_map<std::string, std::string> &map)
 }
 
 /**
- * @brief Updates the primary server for a given range.
+ * @brief Installs a primary map sent by the coordinator.
+ *
+ * Maps come both as replies to PMAP and pushed by the coordinator, so an
+ * older map may arrive after a newer one; it is ignored.
+ *
+ * @param entries "<epoch> <lease_ms> <range>=<ip:port> ...", with "-" for a
+ * range that has no primary.
+ * @return false if the map is malformed or older than the current one.
+ */
+bool install_primary_map(const string &entries)
+{
+  istringstream in(entries);
+  uint64_t epoch;
+  long lease_ms;
+  if (!(in >> epoch >> lease_ms))
+  {
+    return false;
+  }
+  unordered_map<string, string> primaries;
+  string entry;
+  while (in >> entry)
+  {
+    size_t eq = entry.find('=');
+    if (eq == string::npos)
+    {
+      return false;
+    }
+    string primary = entry.substr(eq + 1);
+    primaries[entry.substr(0, eq)] = primary == "-" ? "No primary available" : primary;
+  }
+
+  pthread_mutex_lock(&primary_mutex);
+  bool newer = epoch >= primary_map_epoch;
+  if (newer)
+  {
+    if (epoch != primary_map_epoch && verbose)
+    {
+      cout << "Primary map epoch " << primary_map_epoch << " -> " << epoch << endl;
+    }
+    range_to_primary_map = move(primaries);
+    primary_map_epoch = epoch;
+    primary_lease_length = chrono::milliseconds(lease_ms);
+    primary_lease_until = chrono::steady_clock::now() + primary_lease_length;
+  }
+  pthread_mutex_unlock(&primary_mutex);
+  return newer;
+}
+
+/**
+ * @brief Fetches the primary map from the coordinator.
  *
- * This function connects to the coordinator to request the primary server
- * for the specified range. It sends a "PGET" command and updates the global
- * map with the primary server information if the response is successful.
+ * This function connects to the coordinator and sends a "PMAP" command. A
+ * successful reply replaces the cached map and renews its lease.
  *
- * @param range The data range for which the primary server is being updated.
+ * @return false if the coordinator could not be reached.
  */
-void update_primary(const string &range)
+bool refresh_primary_map()
 {
   int sock;
   struct sockaddr_in serv_addr;
-  char buffer[MAX_BUFFER_SIZE] = {0};
 
   if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
   {
     cerr << "Socket creation error" << endl;
-    return;
+    return false;
   }
 
   serv_addr.sin_family = AF_INET;
@@ -104,373 +197,721 @@ void update_primary(const string &range)
   if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0)
   {
     cerr << "Invalid address/ Address not supported" << endl;
-    return;
+    close(sock);
+    return false;
   }
 
   if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
   {
     cerr << "Connection Failed" << endl;
-    return;
+    close(sock);
+    return false;
   }
 
-  string request = "PGET " + range + "\r\n";
+  string request = "PMAP\r\n";
   send(sock, request.c_str(), request.length(), 0);
-  read(sock, buffer, MAX_BUFFER_SIZE);
-  string response(buffer);
-  cout << "Response from Coordinator: " << response << endl;
+  read_buffer coordinator_buf;
+  string_view reply_frame;
+  string response;
+  if (read_frame(sock, coordinator_buf, reply_frame))
+  {
+    response = string(reply_frame);
+  }
+  close(sock);
+  if (verbose)
+  {
+    cout << "Response from Coordinator: " << response;
+  }
 
   // Parse response
-  if (response.substr(0, 3) == "+OK")
+  if (response.substr(0, 4) != "+OK ")
   {
-    while (!response.empty() && (response.back() == '\n' || response.back() == '\r'))
-    {
-      response.pop_back();
-    }
-    pthread_mutex_lock(&primary_mutex);
-    range_to_primary_map[range] = response.substr(4);
-    pthread_mutex_unlock(&primary_mutex);
+    return false;
   }
-  else
+  install_primary_map(response.substr(4));
+  return true;
+}
+
+/**
+ * @brief Looks up the primary of a tablet in the cached primary map.
+ *
+ * The coordinator pushes the map on every heartbeat, so this normally costs
+ * no round trip. Only once the lease has run out is the map fetched here;
+ * if that fails too, no primary is known.
+ *
+ * @param tablet_name The tablet, e.g. "aa_am".
+ * @return "ip:port" of the primary, or "No primary available".
+ */
+string get_primary(const string &tablet_name)
+{
+  pthread_mutex_lock(&primary_mutex);
+  bool expired = chrono::steady_clock::now() >= primary_lease_until;
+  pthread_mutex_unlock(&primary_mutex);
+  if (expired)
   {
-    pthread_mutex_lock(&primary_mutex);
-    range_to_primary_map[range] = "No primary available";
-    pthread_mutex_unlock(&primary_mutex);
+    refresh_primary_map();
   }
 
-  close(sock);
+  string range = get_tablet_range_from_row_key(tablet_name);
+  pthread_mutex_lock(&primary_mutex);
+  auto it = range_to_primary_map.find(range);
+  string primary = it != range_to_primary_map.end() && chrono::steady_clock::now() < primary_lease_until
+                       ? it->second
+                       : "No primary available";
+  pthread_mutex_unlock(&primary_mutex);
+  return primary;
 }
 
 /**
- * @brief Retrieves the latest tablet and log data from the primary servers.
+ * @brief Keeps the primary map's lease from running out.
  *
- * This function iterates over the server's tablet ranges, updates the primary
- * server for each range, and fetches the latest tablet and log data. It sends
- * "GET", "TABGET", "LGET", and "LOGGET" commands to the primary servers to
- * synchronize data and updates the local cache and log files accordingly.
+ * Pushes from the coordinator normally renew the lease long before this
+ * thread looks; it only fetches the map when half the lease has passed
+ * without one, so requests seldom find it expired.
  */
-void get_latest_tablet_and_log()
+void *primary_map_thread(void *)
 {
-  for (const auto &range : server_tablet_ranges)
+  while (true)
   {
-    update_primary(range);
     pthread_mutex_lock(&primary_mutex);
-    auto it = range_to_primary_map.find(range);
-    cout << range_to_primary_map[range] << " " << server_ip + ":" + to_string(server_port) << endl;
+    bool due = chrono::steady_clock::now() + primary_lease_length / 2 >= primary_lease_until;
     pthread_mutex_unlock(&primary_mutex);
-    if (it != range_to_primary_map.end() && it->second != "No primary available" && it->second != server_ip + ":" + to_string(server_port))
+    if (due)
     {
-      string primary = it->second;
-      size_t colon_pos = primary.find(':');
-      string primary_ip = primary.substr(0, colon_pos);
-      int primary_port = stoi(primary.substr(colon_pos + 1));
-
-      int sock;
-      struct sockaddr_in serv_addr;
-      if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-      {
-        cerr << "Socket creation error" << endl;
-        continue;
-      }
-
-      serv_addr.sin_family = AF_INET;
-      serv_addr.sin_port = htons(primary_port);
-      if (inet_pton(AF_INET, primary_ip.c_str(), &serv_addr.sin_addr) <= 0)
-      {
-        cerr << "Invalid address/ Address not supported" << endl;
-        close(sock);
-        continue;
-      }
+      refresh_primary_map();
+    }
+    usleep(PRIMARY_MAP_POLL_MS * 1000);
+  }
+  return NULL;
+}
 
-      if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
-      {
-        cerr << "Connection Failed with " << primary_ip << ":" << primary_port << endl;
-        close(sock);
-        continue;
-      }
+/**
+ * @brief Writes a whole buffer to a file descriptor.
+ *
+ * @return false if a write failed.
+ */
+bool write_all(int fd, const char *data, size_t length)
+{
+  while (length > 0)
+  {
+    ssize_t n = write(fd, data, length);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      return false;
+    }
+    data += n;
+    length -= n;
+  }
+  return true;
+}
 
-      // Read and ignore the welcome message from the server
-      char welcome_buffer[WELCOME_BUFFER_SIZE] = {0};
-      read(sock, welcome_buffer, WELCOME_BUFFER_SIZE);
-      // cout << "Ignored message: " << welcome_buffer << endl; // Optionally log the ignored message
-      bool runLogGet = false;
-      // Send GET command
-      string get_command = "GET " + range + "\r\n";
-      send(sock, get_command.c_str(), get_command.length(), 0);
-      char buffer[MAX_BUFFER_SIZE] = {0};
-      read(sock, buffer, MAX_BUFFER_SIZE);
-      // cout << "GET Response from primary: " << range << " " << buffer << endl;
-
-      // Check version response and possibly send TABGET
-      string response(buffer);
-      string response_prefix = "VER ";
-      size_t ver_pos = response.find(response_prefix);
-      if (ver_pos != string::npos)
-      {
-        int received_version = stoi(response.substr(ver_pos + response_prefix.length()));
-        if (received_version != cache[range].tablet_version)
-        {
-          runLogGet = true;
-          string tabget_command = "TABGET " + range + "\r\n";
-          send(sock, tabget_command.c_str(), tabget_command.length(), 0);
-
-          string new_file = data_file_location + "/" + range + "_" + to_string(received_version) + ".txt";
-          ofstream out(new_file);
-          string accumulatedData; // To store incomplete data that may not end with a newline
-          bool reading = true;
-
-          while (reading)
-          {
-            char buffer[MAX_BUFFER_SIZE] = {0};
-            int bytesRead = read(sock, buffer, sizeof(buffer) - 1);
-            if (bytesRead <= 0)
-            {
-              reading = false; // Connection closed or error
-              continue;
-            }
-
-            accumulatedData.append(buffer, bytesRead);
-            size_t pos;
-            // Process complete lines
-            while ((pos = accumulatedData.find('\n')) != string::npos)
-            {
-              string line = accumulatedData.substr(0, pos + 1); // Include the newline
-              accumulatedData.erase(0, pos + 1);
-              if (line.find("##########\n") != string::npos)
-              {
-                cout << "End-of-data marker received, stopping read." << endl;
-                reading = false;
-                break;
-              }
-              out << line; // Write the complete line to file
-              // cout << "READ THE LINE: " << line;
-            }
-          }
-          if (!accumulatedData.empty())
-          {
-            out << accumulatedData; // Write any remaining data that didn't end with a newline
-          }
-          out.close();
-
-          // Delete old version file
-          string old_file = data_file_location + "/" + range + "_" + to_string(cache[range].tablet_version) + ".txt";
-          cache[range].tablet_version = received_version;
-          remove(old_file.c_str());
-        }
-      }
+/**
+ * @brief Copies a TABGET/BLOBGET/LOGGET transfer into a file.
+ *
+ * The transfer starts with STREAM_LENGTH_HEADER and the file's size. Bytes
+ * already in the receive buffer are written first; the rest is spliced from
+ * the socket through a pipe into the file without passing through user
+ * space. The file is synced before returning, so the caller can rename it
+ * into place.
+ *
+ * @param sock The socket connected to the primary.
+ * @param buf The receive buffer already used on this socket.
+ * @param path The file to create, normally a temporary name.
+ * @return false if the transfer failed; the file is removed and the
+ * connection is out of step and must be closed.
+ */
+bool receive_file(int sock, read_buffer &buf, const string &path)
+{
+  const string_view header = STREAM_LENGTH_HEADER;
+  string_view frame;
+  if (!read_frame(sock, buf, frame) || frame.substr(0, header.size()) != header)
+  {
+    cerr << "Transfer of " << path << " refused: " << frame;
+    return false;
+  }
+  uint64_t remaining = strtoull(string(frame.substr(header.size())).c_str(), NULL, 10);
 
-      // Send LGET command
-      string lget_command = "LGET " + range + "\r\n";
-      send(sock, lget_command.c_str(), lget_command.length(), 0);
-      memset(buffer, 0, sizeof(buffer));
-      read(sock, buffer, MAX_BUFFER_SIZE);
-      cout << "LGET Response from primary: " << range << " " << buffer << endl;
-
-      // Check requests_since_checkpoint response and possibly send LOGGET
-      string lget_response(buffer);
-      size_t checkpoint_pos = lget_response.find("VER ");
-      if (checkpoint_pos != string::npos)
-      {
-        int received_checkpoint = stoi(lget_response.substr(checkpoint_pos + 4));
-        if (received_checkpoint != cache[range].requests_since_checkpoint || runLogGet)
-        {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  int pipe_fds[2] = {-1, -1};
+  bool ok = fd >= 0 && pipe2(pipe_fds, O_CLOEXEC) == 0;
 
-          string logget_command = "LOGGET " + range + "\r\n";
-          send(sock, logget_command.c_str(), logget_command.length(), 0);
-
-          string tempLogFile = data_file_location + "/logs/" + range + "_log_temp.txt";
-          ofstream tempOut(tempLogFile);
-          string accumulatedData;
-          bool reading = true;
-          while (reading)
-          {
-            char buffer[MAX_BUFFER_SIZE] = {0};
-            int bytesRead = read(sock, buffer, sizeof(buffer) - 1);
-            if (bytesRead <= 0)
-            {
-              reading = false;
-              continue;
-            }
+  size_t buffered = min<uint64_t>(remaining, buf.end - buf.start);
+  ok = ok && write_all(fd, buf.data.data() + buf.start, buffered);
+  read_buffer_consume(buf, buffered);
+  remaining -= buffered;
 
-            accumulatedData.append(buffer, bytesRead);
-            size_t pos;
-            while ((pos = accumulatedData.find('\n')) != string::npos)
-            {
-              string line = accumulatedData.substr(0, pos + 1);
-              accumulatedData.erase(0, pos + 1);
-              if (line.find("##########\n") != string::npos)
-              {
-                cout << "End-of-data marker received, stopping read." << endl;
-                reading = false;
-                break;
-              }
-              tempOut << line;
-            }
-          }
-          if (!accumulatedData.empty())
-          {
-            tempOut << accumulatedData; // Write any remaining data that didn't end with a newline
-          }
-          tempOut.close();
-
-          // Rename the temporary log file to the old log file location
-          string oldLogFile = data_file_location + "/logs/" + range + "_logs.txt";
-          remove(oldLogFile.c_str());                      // Remove the old file
-          rename(tempLogFile.c_str(), oldLogFile.c_str()); // Rename temp to old
-          cout << "Log file updated for " << range << endl;
-        }
+  while (ok && remaining > 0)
+  {
+    ssize_t n = splice(sock, NULL, pipe_fds[1], NULL, min<uint64_t>(remaining, STREAM_CHUNK_SIZE), SPLICE_F_MOVE);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    ok = n > 0;
+    for (ssize_t in_pipe = max<ssize_t>(n, 0); ok && in_pipe > 0;)
+    {
+      ssize_t m = splice(pipe_fds[0], NULL, fd, NULL, in_pipe, SPLICE_F_MOVE);
+      if (m < 0 && errno == EINTR)
+      {
+        continue;
       }
+      ok = m > 0;
+      in_pipe -= max<ssize_t>(m, 0);
+    }
+    remaining -= max<ssize_t>(n, 0);
+  }
+  ok = ok && fdatasync(fd) == 0;
 
-      // Send quit command at the end of all interactions
-      string quit_command = "quit\r\n";
-      send(sock, quit_command.c_str(), quit_command.length(), 0);
+  if (!ok)
+  {
+    cerr << "Failed to receive " << path << ": " << strerror(errno) << endl;
+  }
+  for (int pipe_fd : pipe_fds)
+  {
+    if (pipe_fd >= 0)
+    {
+      close(pipe_fd);
+    }
+  }
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+  if (!ok)
+  {
+    remove(path.c_str());
+  }
+  return ok;
+}
 
-      // Close the socket
-      close(sock);
+/**
+ * @brief Reads a transfer of known length, e.g. the records of a SYNC reply.
+ *
+ * @param sock The socket connected to the primary.
+ * @param buf The receive buffer already used on this socket.
+ * @param length The number of bytes to read.
+ * @param out Receives the bytes.
+ * @return false if the peer closed the connection first.
+ */
+bool receive_exactly(int sock, read_buffer &buf, size_t length, string &out)
+{
+  out.clear();
+  while (true)
+  {
+    size_t take = min(length - out.size(), buf.end - buf.start);
+    out.append(buf.data.data() + buf.start, take);
+    read_buffer_consume(buf, take);
+    if (out.size() == length)
+    {
+      return true;
     }
-    else
+    ssize_t n = read_buffer_fill(buf, sock);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
     {
-      cout << "Cannot find primary for: " << range << endl;
-      cout << range_to_primary_map[range];
-      printMap(range_to_primary_map);
+      return false;
     }
   }
 }
 
-int main(int argc, char *argv[])
+/**
+ * @brief Appends bytes to a file and syncs it.
+ *
+ * @param path The file.
+ * @param data The bytes.
+ * @return false if the file could not be written.
+ */
+bool append_to_file(const string &path, const string &data)
 {
-  // Check if there are enough command-line arguments
-  if (argc == 1)
+  int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+  bool ok = fd >= 0 && write_all(fd, data.data(), data.size()) && fdatasync(fd) == 0;
+  if (!ok)
   {
-    cerr << "*** PennCloud: T15" << endl;
-    exit(EXIT_FAILURE);
+    cerr << "Failed to append to " << path << ": " << strerror(errno) << endl;
   }
-
-  int option;
-  // Parse command-line options
-  while ((option = getopt(argc, argv, "v")) != -1)
+  if (fd >= 0)
   {
-    switch (option)
-    {
-    case 'v':
-      verbose = true;
-      break;
-    default:
-      // Incorrect syntax for command-line arguments
-      cerr << "Syntax: " << argv[0] << " -v <config_file_name> <index>" << endl;
-      exit(EXIT_FAILURE);
-    }
+    close(fd);
   }
+  return ok;
+}
 
-  // Ensure there are enough arguments after parsing options
-  if (optind == argc)
+/**
+ * @brief Asks the primary for a tablet's log records after an LSN.
+ *
+ * @param sock The socket connected to the primary, in a GET session.
+ * @param buf The receive buffer already used on this socket.
+ * @param range The tablet.
+ * @param from_lsn The last LSN already held.
+ * @param records Receives the records.
+ * @return 1 if the records arrived, 0 if the primary no longer has them all
+ * and a snapshot is needed, -1 if the connection failed.
+ */
+int fetch_log_suffix(int sock, read_buffer &buf, const string &range, uint64_t from_lsn, string &records)
+{
+  string sync_command = "SYNC " + range + " FROM " + to_string(from_lsn) + "\r\n";
+  send(sock, sync_command.c_str(), sync_command.length(), 0);
+  string_view frame;
+  string sync_response;
+  if (read_frame(sock, buf, frame))
   {
-    cerr << "Syntax: " << argv[0] << " -v <config_file_name> <index>" << endl;
-    exit(EXIT_FAILURE);
+    sync_response = string(frame);
+  }
+  if (verbose)
+  {
+    cout << "SYNC Response from primary: " << range << " " << sync_response;
   }
 
-  // Extract configuration file name
-  string config_file = argv[optind];
-
-  // Extract server index
-  optind++;
-  if (optind == argc)
+  if (sync_response.rfind("LOG ", 0) != 0)
   {
-    cerr << "Syntax: " << argv[0] << " -v <config_file_name> <index>" << endl;
-    exit(EXIT_FAILURE);
+    return sync_response.empty() ? -1 : 0;
+  }
+  size_t length = stoull(sync_response.substr(4));
+  if (!receive_exactly(sock, buf, length, records))
+  {
+    cerr << "Failed to receive the log of " << range << endl;
+    return -1;
   }
+  return 1;
+}
 
-  // Create a socket
-  listen_fd = socket(PF_INET, SOCK_STREAM, 0);
+/**
+ * @brief Brings one tablet up to date from its primary.
+ *
+ * Sends "GET" and "SYNC <tablet> FROM <lsn>" to the primary, which answers
+ * with just the log records past the local last LSN. Only if the primary has
+ * checkpointed those records away does it answer "SNAPSHOT", and the
+ * snapshot pinned by GET is copied whole with "TABGET", "BLOBGET" and
+ * "LOGGET", followed by the records logged while it was being copied. The
+ * copy is received into temporary files and only installed once all of it,
+ * those records included, has arrived.
+ *
+ * @param range The tablet.
+ * @param live Whether the server is serving the tablet meanwhile. A copy is
+ *        then installed under the tablet's exclusive lock, between
+ *        checkpoints, and the tablet is rebuilt from it straight away;
+ *        otherwise the caller recovers the tablets afterwards.
+ * @return false if the tablet could not be brought up to date and another
+ * attempt should be made.
+ */
+bool catch_up_tablet(const string &range, bool live)
+{
+  string primary = get_primary(range);
+  cout << primary << " " << server_ip + ":" + to_string(server_port) << endl;
+  if (primary == "No primary available" || primary == server_ip + ":" + to_string(server_port))
+  {
+    cout << "Cannot find primary for: " << range << endl;
+    pthread_mutex_lock(&primary_mutex);
+    printMap(range_to_primary_map);
+    pthread_mutex_unlock(&primary_mutex);
+    return true;
+  }
+  size_t colon_pos = primary.find(':');
+  string primary_ip = primary.substr(0, colon_pos);
+  int primary_port = stoi(primary.substr(colon_pos + 1));
 
-  if (listen_fd == -1)
+  int sock;
+  struct sockaddr_in serv_addr;
+  if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
   {
-    cerr << "Socket creation failed.\n"
-         << endl;
-    exit(EXIT_FAILURE);
+    cerr << "Socket creation error" << endl;
+    return false;
   }
 
-  // Set socket options
-  int opt = 1;
-  if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt,
-                 sizeof(opt)) < 0)
+  serv_addr.sin_family = AF_INET;
+  serv_addr.sin_port = htons(primary_port);
+  if (inet_pton(AF_INET, primary_ip.c_str(), &serv_addr.sin_addr) <= 0)
   {
-    cerr << "Setting socket option failed.\n";
-    close(listen_fd);
-    exit(EXIT_FAILURE);
+    cerr << "Invalid address/ Address not supported" << endl;
+    close(sock);
+    return false;
   }
 
-  // Parse configuration file and extract server address and port
-  server_index = atoi(argv[optind]);
-  sockaddr_in server_sockaddr = parse_config_file(config_file);
+  if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+  {
+    cerr << "Connection Failed with " << primary_ip << ":" << primary_port << endl;
+    close(sock);
+    return false;
+  }
 
-  set<string> unique_ranges_set{};
+  // Read and ignore the welcome message from the server
+  read_buffer primary_buf;
+  string_view frame;
+  read_frame(sock, primary_buf, frame);
+  // Send GET command
+  string get_command = "GET " + range + "\r\n";
+  send(sock, get_command.c_str(), get_command.length(), 0);
+  string response;
+  if (read_frame(sock, primary_buf, frame))
+  {
+    response = string(frame);
+  }
 
-  for (const auto s : server_tablet_ranges)
+  // "VER <version> LSN <lsn>": the primary has pinned a snapshot of the
+  // tablet whose log ends at that LSN
+  int received_version = -1;
+  uint64_t snapshot_lsn = 0;
+  size_t ver_pos = response.find("VER ");
+  size_t lsn_pos = response.find(" LSN ");
+  if (ver_pos != string::npos && lsn_pos != string::npos)
   {
-    unique_ranges_set.insert(s);
+    received_version = stoi(response.substr(ver_pos + 4));
+    snapshot_lsn = stoull(response.substr(lsn_pos + 5));
   }
 
-  for (const auto e : tablet_ranges_to_other_addr)
+  // Ask for the records past the last one this replica holds
+  tablet_data &tablet = cache[range];
+  string records;
+  int fetched = fetch_log_suffix(sock, primary_buf, range, tablet.last_lsn, records);
+  if (fetched < 0)
   {
-    unique_ranges_set.insert(e.first);
+    close(sock);
+    return false;
+  }
+  if (fetched > 0)
+  {
+    bool gap = false;
+    string error = records.empty() ? "" : append_log_run(range, tablet, records, gap);
+    // recover_tablets reads the log back from disk
+    wal_flush(tablet.wal);
+    close(sock);
+    if (!error.empty())
+    {
+      cerr << "Failed to catch up " << range << ": " << error << endl;
+      return false;
+    }
+    cout << "Caught up " << range << " to LSN " << tablet.last_lsn << endl;
+    return true;
+  }
+  if (received_version < 0)
+  {
+    cerr << "No snapshot of " << range << " from " << primary << endl;
+    close(sock);
+    return false;
   }
 
-  all_unique_tablet_ranges = vector<string>(unique_ranges_set.begin(), unique_ranges_set.end());
+  string tabget_command = "TABGET " + range + "\r\n";
+  send(sock, tabget_command.c_str(), tabget_command.length(), 0);
 
-  update_server_tablet_ranges(server_tablet_ranges);
-  if (verbose)
+  // Written aside and renamed, as the current version may be mapped
+  string new_file = data_file_location + "/" + range + "_" + to_string(received_version) + ".txt";
+  string temp_file = new_file + ".tmp";
+  string blob_file, temp_blob_file;
+  string temp_log_file = data_file_location + "/logs/" + range + "_log_temp.txt";
+  auto abandon = [&]()
   {
-    cout << "Server IP: " << server_ip << ":" << server_port << endl;
-    cout << "Server Port: " << ntohs(server_sockaddr.sin_port) << endl;
-    cout << "Data Loc:" << data_file_location << endl;
-    cout << "Server Index: " << server_index << endl;
-    cout << "All Unique Ranges:\n";
-    for (const auto &range : all_unique_tablet_ranges)
+    remove(temp_file.c_str());
+    if (!temp_blob_file.empty())
     {
-      cout << range << "\n";
+      remove(temp_blob_file.c_str());
     }
-    cout << "Server Tablet Ranges:\n";
-    for (const auto &range : server_tablet_ranges)
+    remove(temp_log_file.c_str());
+    close(sock);
+    return false;
+  };
+  if (!receive_file(sock, primary_buf, temp_file))
+  {
+    return abandon();
+  }
+
+  // Its large values are in the blob log it names
+  shared_ptr<checkpoint_file> received = open_checkpoint_file(temp_file);
+  if (received != nullptr && received->blob_log_id != 0)
+  {
+    string blobget_command = "BLOBGET " + range + "\r\n";
+    send(sock, blobget_command.c_str(), blobget_command.length(), 0);
+    blob_file = data_file_location + "/" + get_blob_log_file_name(range, received->blob_log_id);
+    temp_blob_file = blob_file + ".tmp";
+    if (!receive_file(sock, primary_buf, temp_blob_file))
     {
-      cout << range << "\n";
+      return abandon();
     }
   }
+  received.reset();
 
-  // Bind the socket to the server address
-  if (bind(listen_fd, (struct sockaddr *)&server_sockaddr,
-           sizeof(server_sockaddr)) != 0)
+  string logget_command = "LOGGET " + range + "\r\n";
+  send(sock, logget_command.c_str(), logget_command.length(), 0);
+  if (!receive_file(sock, primary_buf, temp_log_file))
   {
-    cerr << "Socket binding failed.\n"
-         << endl;
-    close(listen_fd);
-    exit(EXIT_FAILURE);
+    return abandon();
   }
 
-  // Start listening for incoming connections
-  if (listen(listen_fd, SOMAXCONN) != 0)
+  // Writes went on while the snapshot was copied; their records continue
+  // the snapshot's log. Without them the copy would be missing writes, so
+  // a primary that has checkpointed them away means starting over.
+  if (fetch_log_suffix(sock, primary_buf, range, snapshot_lsn, records) <= 0 ||
+      !append_to_file(temp_log_file, records))
   {
-    cerr << "Socket listening failed.\n"
-         << endl;
-    close(listen_fd);
-    exit(EXIT_FAILURE);
+    cerr << "Lost the records logged during the copy of " << range << endl;
+    return abandon();
   }
 
-  // INIT the cache.
+  if (live)
+  {
+    // Checkpoints run on their thread under suspend_mutex
+    pthread_mutex_lock(&suspend_mutex);
+    lock_tablet_exclusive(tablet);
+    wal_flush(tablet.wal);
+  }
+  // The blob log must be in place before the version that names it
+  if (!temp_blob_file.empty())
+  {
+    rename(temp_blob_file.c_str(), blob_file.c_str());
+  }
+  rename(temp_file.c_str(), new_file.c_str());
+
+  // Delete old version file
+  if (received_version != tablet.tablet_version)
+  {
+    string old_file = data_file_location + "/" + range + "_" + to_string(tablet.tablet_version) + ".txt";
+    remove(old_file.c_str());
+  }
+  tablet.tablet_version = received_version;
+
+  // Rename the temporary log file over the old log file
+  string old_log_file = data_file_location + "/logs/" + range + "_logs.txt";
+  rename(temp_log_file.c_str(), old_log_file.c_str());
+  wal_reopen(tablet.wal);
+  cout << "Log file updated for " << range << endl;
+  if (live)
+  {
+    reload_tablet(cache, range, data_file_location);
+    pthread_rwlock_unlock(&tablet.tablet_lock);
+    pthread_mutex_unlock(&suspend_mutex);
+  }
+
+  // Send quit command at the end of all interactions
+  string quit_command = "quit\r\n";
+  send(sock, quit_command.c_str(), quit_command.length(), 0);
+
+  // Close the socket
+  close(sock);
+  return true;
+}
+
+/**
+ * @brief Retrieves the latest tablet and log data from the primary servers.
+ *
+ * Every tablet of this server is caught up from its primary, retrying up to
+ * CATCH_UP_ATTEMPTS times: a failed attempt installs nothing, and the next
+ * one pins a fresh snapshot.
+ */
+void get_latest_tablet_and_log()
+{
+  for (const auto &range : server_tablet_ranges)
+  {
+    int attempt = 1;
+    while (!catch_up_tablet(range, false))
+    {
+      if (attempt++ == CATCH_UP_ATTEMPTS)
+      {
+        cerr << "Giving up catching up " << range << " after " << CATCH_UP_ATTEMPTS << " attempts" << endl;
+        break;
+      }
+      cerr << "Retrying catch-up of " << range << endl;
+    }
+  }
+}
+
+/**
+ * @brief Body of a thread resyncing one tablet from its primary, for up to
+ * CATCH_UP_ATTEMPTS attempts, while the server keeps serving it.
+ *
+ * @param arg The tablet, as a string allocated with new.
+ */
+void *resync_thread(void *arg)
+{
+  unique_ptr<string> range(static_cast<string *>(arg));
+  int attempt = 1;
+  while (!catch_up_tablet(*range, true))
+  {
+    if (attempt++ == CATCH_UP_ATTEMPTS)
+    {
+      cerr << "Giving up resyncing " << *range << " after " << CATCH_UP_ATTEMPTS << " attempts" << endl;
+      break;
+    }
+  }
+  pthread_mutex_lock(&resync_mutex);
+  resyncing_tablets.erase(*range);
+  pthread_mutex_unlock(&resync_mutex);
+  return NULL;
+}
+
+/**
+ * @brief Starts resyncing a tablet in the background, unless it already is.
+ *
+ * @param range The tablet.
+ */
+void start_resync(const string &range)
+{
+  pthread_mutex_lock(&resync_mutex);
+  bool started = resyncing_tablets.insert(range).second;
+  pthread_mutex_unlock(&resync_mutex);
+  if (started)
+  {
+    cout << "Resyncing " << range << " from its primary" << endl;
+    pthread_t resync_tid;
+    pthread_create(&resync_tid, NULL, resync_thread, new string(range));
+    pthread_detach(resync_tid);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  // Check if there are enough command-line arguments
+  if (argc == 1)
+  {
+    cerr << "*** PennCloud: T15" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  int option;
+  // Parse command-line options
+  while ((option = getopt(argc, argv, "vd:m:")) != -1)
+  {
+    switch (option)
+    {
+    case 'v':
+      verbose = true;
+      break;
+    case 'd':
+      if (!parse_wal_durability(optarg, log_durability))
+      {
+        cerr << "Log durability must be one of none, batch or strict" << endl;
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'm':
+      // Memory budget for in-memory rows, in MiB; cold rows beyond it are
+      // evicted and read back from the checkpoint files
+      row_cache_set_budget(strtoull(optarg, NULL, 10) << 20);
+      break;
+    default:
+      // Incorrect syntax for command-line arguments
+      cerr << "Syntax: " << argv[0] << " [-v] [-d none|batch|strict] [-m budget_mib] <config_file_name> <index>" << endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Ensure there are enough arguments after parsing options
+  if (optind == argc)
+  {
+    cerr << "Syntax: " << argv[0] << " [-v] [-d none|batch|strict] [-m budget_mib] <config_file_name> <index>" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // Extract configuration file name
+  string config_file = argv[optind];
+
+  // Extract server index
+  optind++;
+  if (optind == argc)
+  {
+    cerr << "Syntax: " << argv[0] << " [-v] [-d none|batch|strict] [-m budget_mib] <config_file_name> <index>" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // Create a socket
+  listen_fd = socket(PF_INET, SOCK_STREAM, 0);
+
+  if (listen_fd == -1)
+  {
+    cerr << "Socket creation failed.\n"
+         << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // Set socket options
+  int opt = 1;
+  if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt,
+                 sizeof(opt)) < 0)
+  {
+    cerr << "Setting socket option failed.\n";
+    close(listen_fd);
+    exit(EXIT_FAILURE);
+  }
+
+  // Parse configuration file and extract server address and port
+  server_index = atoi(argv[optind]);
+  sockaddr_in server_sockaddr = parse_config_file(config_file);
+
+  set<string> unique_ranges_set{};
+
+  for (const auto s : server_tablet_ranges)
+  {
+    unique_ranges_set.insert(s);
+  }
+
+  for (const auto e : tablet_ranges_to_other_addr)
+  {
+    unique_ranges_set.insert(e.first);
+  }
+
+  all_unique_tablet_ranges = vector<string>(unique_ranges_set.begin(), unique_ranges_set.end());
+
+  update_server_tablet_ranges(server_tablet_ranges);
+  if (verbose)
+  {
+    cout << "Server IP: " << server_ip << ":" << server_port << endl;
+    cout << "Server Port: " << ntohs(server_sockaddr.sin_port) << endl;
+    cout << "Data Loc:" << data_file_location << endl;
+    cout << "Server Index: " << server_index << endl;
+    cout << "All Unique Ranges:\n";
+    for (const auto &range : all_unique_tablet_ranges)
+    {
+      cout << range << "\n";
+    }
+    cout << "Server Tablet Ranges:\n";
+    for (const auto &range : server_tablet_ranges)
+    {
+      cout << range << "\n";
+    }
+  }
+
+  // Bind the socket to the server address
+  if (bind(listen_fd, (struct sockaddr *)&server_sockaddr,
+           sizeof(server_sockaddr)) != 0)
+  {
+    cerr << "Socket binding failed.\n"
+         << endl;
+    close(listen_fd);
+    exit(EXIT_FAILURE);
+  }
+
+  // Start listening for incoming connections
+  if (listen(listen_fd, SOMAXCONN) != 0)
+  {
+    cerr << "Socket listening failed.\n"
+         << endl;
+    close(listen_fd);
+    exit(EXIT_FAILURE);
+  }
+
+  // Commit log writes in groups before any tablet log is opened
+  wal_start(log_durability);
+  // Replicas that missed records are sent them from the local log
+  replication_set_log_source(read_log_suffix);
+
+  // INIT the cache.
   initialize_cache(cache);
 
   // Load data to cache
-  load_cache(cache, data_file_location);
-  recover(cache, data_file_location, server_tablet_ranges);
+  recover_tablets(cache, data_file_location);
   // cout << "PRINTING: " << cache["aa_am"].requests_since_checkpoint << endl;
   // cout << "PRINTING: " << cache["aa_am"].tablet_version << endl;
 
   // TODO: Get the latest tablet and log files from the primary
 
-  // Get primary for every tablet.
-  for (const auto &range : server_tablet_ranges)
-  {
-    update_primary(range);
-  }
+  // Get primary for every range; the coordinator keeps the map current
+  // from here on by pushing it with each heartbeat
+  refresh_primary_map();
   if (verbose)
   {
     cout << "Range to Primary Map:" << endl;
@@ -481,11 +922,8 @@ int main(int argc, char *argv[])
   }
   get_latest_tablet_and_log();
 
-  // Reload data to cache
-  load_cache(cache, data_file_location);
-
-  // Perform Recovery
-  recover(cache, data_file_location, server_tablet_ranges);
+  // Reload data to cache with whatever the primaries sent
+  recover_tablets(cache, data_file_location);
 
   // cout << "PRINTING: " << cache["aa_am"].requests_since_checkpoint << endl;
   // cout << "PRINTING: " << cache["aa_am"].tablet_version << endl;
@@ -493,39 +931,19 @@ int main(int argc, char *argv[])
   // Register signal handler for clean exit
   signal(SIGINT, exit_handler);
 
-  // Accept and handle incoming connections
-  while (true)
-  {
-    sockaddr_in client_sockaddr;
-    socklen_t client_socklen = sizeof(client_sockaddr);
-    int client_fd =
-        accept(listen_fd, (struct sockaddr *)&client_sockaddr, &client_socklen);
-
-    if (client_fd < 0)
-    {
-      // If accept fails due to certain errors, continue accepting
-      if ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK))
-      {
-        continue;
-      }
-      // Otherwise, print error and exit loop
-      cerr << "Failed to accept new connection: " << strerror(errno) << endl;
-      break;
-    }
-
-    // Push into the list of all client file descriptors
-    client_fds.push_back(client_fd);
+  // Checkpoint tablets in the background from now on
+  pthread_t checkpoint_tid;
+  pthread_create(&checkpoint_tid, NULL, checkpoint_thread, NULL);
+  pthread_detach(checkpoint_tid);
 
-    if (verbose)
-    {
-      cout << "[" << client_fd << "] New connection\n";
-    }
+  // Keep the primary map's lease alive if the coordinator's pushes stop
+  pthread_t primary_map_tid;
+  pthread_create(&primary_map_tid, NULL, primary_map_thread, NULL);
+  pthread_detach(primary_map_tid);
 
-    // Create a new thread to handle the connection
-    pthread_t thd;
-    pthread_create(&thd, nullptr, handle_connection, new int(client_fd));
-    // pthread_detach(thd);
-  }
+  // Serve all connections from a single epoll loop backed by a fixed pool
+  // of worker threads
+  run_event_loop(listen_fd, NUM_WORKER_THREADS);
 
   // Close the listening socket and exit
   close(listen_fd);
@@ -628,6 +1046,26 @@ void parse_other_addresses(char *raw_line)
   }
 }
 
+/**
+ * @brief Parses a "replication <tablet> <policy>" line of the configuration
+ * file into tablet_replication_policy.
+ *
+ * @param line The line, e.g. "replication c_e async".
+ */
+void parse_replication_line(const string &line)
+{
+  istringstream fields(line);
+  string keyword, tablet, name;
+  replication_policy policy;
+  fields >> keyword >> tablet >> name;
+  if (tablet.empty() || !parse_replication_policy(name, policy))
+  {
+    cerr << "Ignoring bad replication line (policy must be sync-all, majority or async): " << line << endl;
+    return;
+  }
+  tablet_replication_policy[tablet] = policy;
+}
+
 /**
  * Parses the configuration file to extract server address information.
  *
@@ -647,6 +1085,13 @@ sockaddr_in parse_config_file(string config_file)
   // Read each line of the configuration file
   while (getline(config_stream, line))
   {
+    // "replication <tablet> <policy>" lines set a tablet's replication policy
+    // and are not server lines
+    if (line.rfind("replication ", 0) == 0)
+    {
+      parse_replication_line(line);
+      continue;
+    }
     // Convert string line to C-style string
     char raw_line[line.length() + 1];
     strcpy(raw_line, line.c_str());
@@ -737,489 +1182,1331 @@ string get_tablet_range_from_row_key(string row_key)
 }
 
 /**
- * @brief Handles the LIST command by sending all key-value pairs to the client.
+ * @brief Serializes a message in the protocol spoken on a connection.
  *
- * This function iterates through the cache, locks each tablet, and sends
- * all key-value pairs to the client in serialized form. After processing
- * all entries, it sends a final success message to indicate completion.
+ * @param f2b_message The message to encode.
+ * @param binary Whether the peer negotiated binary (v2) frames.
+ * @return The encoded frame.
+ */
+string encode_reply(const F_2_B_Message &f2b_message, bool binary)
+{
+  return binary ? encode_message_v2(f2b_message) : encode_message(f2b_message);
+}
+
+/**
+ * @brief Sends one message to another backend and waits for its reply.
+ *
+ * Used for forwarding writes to the primary. The binary protocol is
+ * negotiated first, so values travel without any escaping; a peer that only
+ * speaks text is still understood.
  *
- * @param client_fd The file descriptor of the client connection.
- * @return An F_2_B_Message indicating the completion status of the LIST operation.
+ * The caller is one of the fixed workers, and the peer may be waiting on
+ * its own workers for a write forwarded back here while two backends
+ * disagree about a primary. Connecting, sending and every read therefore
+ * give up after FORWARD_TIMEOUT_MS, so workers are never tied up for good.
+ *
+ * @param addr The address of the backend to contact.
+ * @param request The message to send.
+ * @param response Set to the backend's reply.
+ * @return false if the backend could not be reached or closed the connection.
  */
-F_2_B_Message handle_list(int client_fd)
+bool exchange_with_backend(const sockaddr_in &addr, const F_2_B_Message &request, F_2_B_Message &response)
 {
-  for (auto &entry : cache)
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0)
   {
-    const string &tablet_name = entry.first;
-    tablet_data &data = entry.second;
-    pthread_mutex_lock(&data.tablet_lock);
-    for (auto &row_pair : data.row_to_kv)
-    {
-      for (auto &col_pair : row_pair.second)
-      {
-        cout << row_pair.first << " " << col_pair.first << " " << col_pair.second << endl;
-        F_2_B_Message list_message;
-        list_message.type = 10;
-        list_message.rowkey = row_pair.first;
-        list_message.colkey = col_pair.first;
-        list_message.status = 0;
-        list_message.value = col_pair.second;
-        list_message.errorMessage = "";
-        list_message.value2 = "";
-        list_message.isFromPrimary = 0;
-        string serialized = encode_message(list_message);
-        send(client_fd, serialized.c_str(), serialized.length(), 0);
-        sleep(0.01);
-      }
-    }
+    cerr << "Error in socket creation" << endl;
+    return false;
+  }
+  timeval timeout{FORWARD_TIMEOUT_MS / 1000, (FORWARD_TIMEOUT_MS % 1000) * 1000};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    cerr << "Connection Failed" << endl;
+    close(sock);
+    return false;
+  }
 
-    // Unlock the tablet
-    pthread_mutex_unlock(&data.tablet_lock);
+  read_buffer backend_buf;
+  if (!negotiate_protocol_v2(sock, backend_buf))
+  {
+    close(sock);
+    return false;
+  }
+  string serialized = encode_reply(request, backend_buf.binary);
+  if (send(sock, serialized.data(), serialized.size(), MSG_NOSIGNAL) < 0)
+  {
+    cerr << "Error in send(). Exiting" << endl;
+    close(sock);
+    return false;
+  }
+  if (verbose)
+  {
+    cout << "[" << sock << "] S: " << (backend_buf.binary ? encode_message(request) : serialized);
   }
 
-  // Send a final success message
-  F_2_B_Message success_message;
-  success_message.status = 0; // Indicate success
-  success_message.errorMessage = "success";
-  success_message.rowkey = "terminate";
-  success_message.colkey = "terminate";
-  success_message.type = 10;
-  return success_message;
+  string_view frame;
+  bool received = read_frame(sock, backend_buf, frame);
+  if (received)
+  {
+    response = backend_buf.binary ? decode_message_v2(frame) : decode_message(string(frame));
+  }
+  close(sock);
+  return received;
 }
 
 /**
- * Function to handle client connections.
+ * @brief Wakes the checkpoint thread early once a tablet has logged enough
+ * writes; the checkpoint itself never runs on the request path.
  *
- * @param arg Pointer to the client file descriptor.
- * @return nullptr
+ * @param tablet_name The tablet that was just written to.
  */
-void *handle_connection(void *arg)
+void checkpoint_if_needed(const string &tablet_name)
 {
-  // Extract client file descriptor from argument
-  int client_fd = *static_cast<int *>(arg);
-  // delete static_cast<int *>(arg); // Delete memory allocated for the argument
+  tablet_data &tablet = cache[tablet_name];
+  if (tablet.requests_since_checkpoint > CHECKPOINT_SIZE || wal_size(tablet.wal) > CHECKPOINT_LOG_BYTES ||
+      row_cache_excess() > 0)
+  {
+    pthread_mutex_lock(&checkpoint_mutex);
+    checkpoint_requested = true;
+    pthread_cond_signal(&checkpoint_cond);
+    pthread_mutex_unlock(&checkpoint_mutex);
+  }
+}
 
-  // Send welcome message to client
-  string response = "WELCOME TO THE SERVER\r\n";
-  ssize_t bytes_sent = send(client_fd, response.c_str(), response.length(), 0);
-  // Check for send errors
-  if (bytes_sent < 0)
+/**
+ * @brief Brings the node back under its memory budget.
+ *
+ * Every tablet is asked for an equal share of the excess, round after
+ * round, so the cold rows of every tablet go before the warm rows of any.
+ * Stops early once no tablet has anything left to evict.
+ */
+void evict_cold_rows()
+{
+  size_t excess = row_cache_excess();
+  while (excess > 0 && !cache.empty())
   {
-    cerr << "[" << client_fd << "] Error in send(). Exiting" << endl;
-    return nullptr;
+    size_t share = max<size_t>(excess / cache.size(), 1);
+    size_t freed = 0;
+    for (auto &entry : cache)
+    {
+      freed += evict_rows(entry.second, share);
+    }
+    if (freed == 0)
+    {
+      break;
+    }
+    excess = row_cache_excess();
   }
+}
 
-  string lockedTablet = "";
-  bool isLocked = false;
-  char buffer[MAX_BUFFER_SIZE];
-  // Continue reading client messages until quit command received
-  while (do_read(client_fd, buffer))
+/**
+ * @brief Body of the checkpoint thread.
+ *
+ * Wakes when a writer asks for it, and at least every
+ * CHECKPOINT_POLL_SECONDS for the time-based trigger, frees retired row
+ * versions, then checkpoints every tablet that is due and evicts cold rows
+ * if the node is over its memory budget. Holding suspend_mutex keeps a
+ * resume from reloading tablets while one is being checkpointed.
+ */
+void *checkpoint_thread(void *)
+{
+  while (true)
   {
-    string message(buffer);
-    // Print received message if in verbose mode
-    if (verbose)
+    pthread_mutex_lock(&checkpoint_mutex);
+    if (!checkpoint_requested)
     {
-      cout << "[" << client_fd << "] C: " << message;
+      timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += CHECKPOINT_POLL_SECONDS;
+      pthread_cond_timedwait(&checkpoint_cond, &checkpoint_mutex, &deadline);
     }
+    checkpoint_requested = false;
+    pthread_mutex_unlock(&checkpoint_mutex);
 
-    // Check for quit command
-    if (message == "quit\r\n")
+    // Free row versions replaced since the last round, even if writes stopped
+    epoch_reclaim();
+
+    pthread_mutex_lock(&suspend_mutex);
+    for (auto &[tablet_name, tablet] : cache)
     {
-      if (isLocked)
-      {
-        pthread_mutex_unlock(&cache[lockedTablet].tablet_lock);
-        isLocked = false;
-      }
-      string goodbye = "Quit command received. Server goodbye!\r\n";
-      bytes_sent = send(client_fd, goodbye.c_str(), goodbye.length(), 0);
-      // Check for send errors
-      if (bytes_sent < 0)
+      if (suspended)
       {
-        cerr << "[" << client_fd << "] Error in send(). Exiting" << endl;
         break;
       }
-
-      // Print goodbye message if in verbose mode
-      if (verbose)
+      pthread_rwlock_rdlock(&tablet.tablet_lock);
+      bool due = checkpoint_due(tablet);
+      int pending_requests = tablet.requests_since_checkpoint;
+      pthread_rwlock_unlock(&tablet.tablet_lock);
+      if (due)
       {
-        cout << "[" << client_fd << "] S: " << goodbye;
+        cout << "Checkpointing the file: " << tablet_name << " " << pending_requests << endl;
+        checkpoint_tablet(tablet, tablet_name, data_file_location);
       }
-      break;
     }
-    if (message.substr(0, 4) == "GET " && !isLocked)
+    if (!suspended)
     {
-      size_t endpos = message.find_last_not_of("\r\n");
-      if (endpos != string::npos)
-      {
-        message = message.substr(0, endpos + 1);
-      }
-      lockedTablet = message.substr(4);
-      pthread_mutex_lock(&cache[lockedTablet].tablet_lock);
-      isLocked = true;
-
-      int version_number = cache[lockedTablet].tablet_version;
-      response = "VER " + to_string(version_number) + "\r\n";
-      cout << lockedTablet << endl;
-      cout
-          << "GET Response:" << response << endl;
-      send(client_fd, response.c_str(), response.length(), 0);
-      continue;
+      evict_cold_rows();
     }
-    else if (message.substr(0, 5) == "LGET " && isLocked)
-    {
-      size_t endpos = message.find_last_not_of("\r\n");
-      if (endpos != string::npos)
-      {
-        message = message.substr(0, endpos + 1);
-      }
-      int requests_since_checkpoint = cache[lockedTablet].requests_since_checkpoint;
-      response = "VER " + to_string(requests_since_checkpoint) + "\r\n";
-      cout << "LGET Response:" << response << endl;
-      send(client_fd, response.c_str(), response.length(), 0);
-      continue;
+    pthread_mutex_unlock(&suspend_mutex);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Queues a log record the primary has just written for every other
+ * replica of its range. Called from log_message, so each replica receives
+ * a tablet's records in LSN order.
+ *
+ * @param tablet_name The tablet whose log holds the record.
+ * @param record The record, as logged.
+ * @return The round to wait on with wait_for_replicas.
+ */
+shared_ptr<replication_round> queue_replication(const string &tablet_name, const string &record)
+{
+  // The range is that of the tablet, even for a row outside every range
+  // that get_new_file_name placed in it
+  string tablet_range = get_tablet_range_from_row_key(tablet_name);
+  if (verbose)
+  {
+    cout << "Replicating a record of " << tablet_name << " to the replicas of " << tablet_range << endl;
+  }
+  return replication_enqueue(tablet_ranges_to_other_addr[tablet_range], tablet_name, record);
+}
+
+/**
+ * @brief Waits for as many replicas as the replication policy of the
+ * tablet's range requires to apply a queued record.
+ *
+ * @param round The round returned by queue_replication.
+ * @param tablet_name The tablet the write was applied to.
+ * @return false if fewer replicas acked than the policy requires; the
+ * write must then not be reported as successful.
+ */
+bool wait_for_replicas(const shared_ptr<replication_round> &round, const string &tablet_name)
+{
+  string tablet_range = get_tablet_range_from_row_key(tablet_name);
+  auto it = tablet_replication_policy.find(tablet_range);
+  replication_policy policy = it == tablet_replication_policy.end() ? REPLICATION_MAJORITY : it->second;
+  size_t replicas = tablet_ranges_to_other_addr[tablet_range].size();
+  int wanted = replication_required_acks(policy, replicas);
+  int acked = replication_wait(round, wanted);
+  if (acked < wanted && verbose)
+  {
+    cout << "Only " << acked << " of " << replicas << " replicas acked a write to " << tablet_range << endl;
+  }
+  return acked >= wanted;
+}
+
+/**
+ * @brief Reports whether an operation modifies the tablet.
+ *
+ * @param type The F_2_B_Message type of the operation.
+ * @return true for PUT, DELETE and CPUT.
+ */
+bool is_write_op(int type)
+{
+  return type == 2 || type == 3 || type == 4;
+}
+
+/**
+ * @brief Reports whether an operation only reads, so any replica may serve
+ * it and it is never replicated.
+ *
+ * @param type The F_2_B_Message type of the operation.
+ * @return true for GET, LIST, SCAN and PREFIX.
+ */
+bool is_read_op(int type)
+{
+  return type == 1 || type == F2B_TYPE_LIST || type == F2B_TYPE_SCAN || type == F2B_TYPE_PREFIX;
+}
+
+/**
+ * @brief Logs and applies a single-row write.
+ *
+ * Takes the tablet lock shared and the row's stripe exclusively, so writes to
+ * other rows of the tablet proceed in parallel.
+ *
+ * @param message The PUT, DELETE or CPUT.
+ * @param tablet_name The tablet holding the row.
+ * @param handler The handler that applies the write.
+ * @param replicate Whether this server is the primary and must replicate it.
+ * @return The handler's result, or status 1 if the log failed or too few
+ * replicas acked it. A write the log has already failed is not applied.
+ */
+F_2_B_Message apply_row_write(const F_2_B_Message &message, const string &tablet_name,
+                              F_2_B_Message (*handler)(F_2_B_Message, string, unordered_map<string, tablet_data> &),
+                              bool replicate)
+{
+  tablet_data &tablet = cache[tablet_name];
+  if (wal_failed(tablet.wal))
+  {
+    F_2_B_Message result = message;
+    result.status = 1;
+    result.errorMessage = LOG_FAILURE_ERROR;
+    return result;
+  }
+  lock_tablet_for_write(tablet);
+  row_stripe &stripe = lock_row_for_write(tablet, message.rowkey);
+  // Add the message to the LOG, and ship the same record to the replicas
+  shared_ptr<replication_round> round;
+  auto ship = [&](uint64_t, const string &record)
+  { round = queue_replication(tablet_name, record); };
+  uint64_t ticket = replicate ? log_message(message, tablet, ship) : log_message(message, tablet);
+  F_2_B_Message result = handler(message, tablet_name, cache);
+  pthread_mutex_unlock(&stripe.lock);
+  tablet.requests_since_checkpoint++;
+  pthread_rwlock_unlock(&tablet.tablet_lock);
+  // Wait outside the locks so concurrent writers share the same sync
+  if (!wal_wait_durable(tablet.wal, ticket))
+  {
+    result.status = 1;
+    result.errorMessage = LOG_FAILURE_ERROR;
+  }
+  else if (round && !wait_for_replicas(round, tablet_name))
+  {
+    result.status = 1;
+    result.errorMessage = REPLICATION_SHORTFALL_ERROR;
+  }
+  return result;
+}
+
+/**
+ * @brief Applies the ops of a batch that fall into one tablet.
+ *
+ * The tablet lock and the stripes of the group's rows are taken once for the
+ * whole group, and all its writes go to the log as a single batch record, so
+ * replay applies them together.
+ *
+ * @param tablet_name The tablet every op in the group belongs to.
+ * @param ops All ops of the batch.
+ * @param indices Positions in ops of the group's ops.
+ * @param results Receives the result of each op at the same position.
+ * @param replicate Whether this server is the primary and must replicate
+ *        the group's writes, as a single batch. If the log fails or too
+ *        few replicas ack them, every write of the group fails with status 1;
+ *        writes the log has already failed are not applied.
+ */
+void apply_batch_group(const string &tablet_name, const vector<F_2_B_Message> &ops,
+                       const vector<size_t> &indices, vector<F_2_B_Message> &results, bool replicate)
+{
+  vector<F_2_B_Message> writes;
+  for (size_t i : indices)
+  {
+    if (is_write_op(ops[i].type))
+    {
+      writes.push_back(ops[i]);
+    }
+  }
+
+  tablet_data &tablet = cache[tablet_name];
+  // Writes the log has already failed are answered here and not applied
+  bool log_failed = !writes.empty() && wal_failed(tablet.wal);
+  if (log_failed)
+  {
+    writes.clear();
+  }
+  vector<size_t> applied;
+  for (size_t i : indices)
+  {
+    if (log_failed && is_write_op(ops[i].type))
+    {
+      results[i] = ops[i];
+      results[i].status = 1;
+      results[i].errorMessage = LOG_FAILURE_ERROR;
     }
-    else if (message.substr(0, 7) == "LOGGET " && isLocked)
+    else
     {
-      size_t endpos = message.find_last_not_of("\r\n");
-      if (endpos != string::npos)
-      {
-        message = message.substr(0, endpos + 1);
-      }
-      string logFilename = data_file_location + "/logs/" + lockedTablet + "_logs.txt"; // Assume log files are named like this
-      ifstream logFile(logFilename);
-      if (!logFile.is_open())
-      {
-        cerr << "Failed to open log file: " << logFilename << endl;
-        send(client_fd, "##########\n", 11, 0); // Send end-of-data marker even if file fails to open
-      }
-      else
-      {
-        string line;
-        while (getline(logFile, line))
-        {
-          line += "\n"; // Ensure each line ends with a newline for consistent transmission
-          send(client_fd, line.c_str(), line.length(), 0);
-        }
-        logFile.close();
-        send(client_fd, "##########\n", 11, 0); // Send the special end-of-data marker
-      }
+      applied.push_back(i);
+    }
+  }
+
+  uint64_t ticket = 0;
+  shared_ptr<replication_round> round;
+  if (writes.empty())
+  {
+    pthread_rwlock_rdlock(&tablet.tablet_lock);
+  }
+  else
+  {
+    lock_tablet_for_write(tablet);
+  }
+  // Every row of the group is loaded while its stripe is locked, so the
+  // GETs below find it in memory and take no lock of their own
+  vector<string> rowkeys;
+  for (size_t i : applied)
+  {
+    rowkeys.push_back(ops[i].rowkey);
+  }
+  vector<row_stripe *> stripes = lock_rows_for_write(tablet, rowkeys);
+  for (const string &rowkey : rowkeys)
+  {
+    find_row(tablet, rowkey);
+  }
+  F_2_B_Message record;
+  if (!writes.empty())
+  {
+    record.type = F2B_TYPE_BATCH;
+    record.rowkey = writes.front().rowkey;
+    record.value = encode_batch(writes);
+    record.status = 0;
+    record.isFromPrimary = 0;
+    // Replicas only need the writes, as this one record
+    auto ship = [&](uint64_t, const string &logged)
+    { round = queue_replication(tablet_name, logged); };
+    ticket = replicate ? log_message(record, tablet, ship) : log_message(record, tablet);
+  }
+
+  for (size_t i : applied)
+  {
+    switch (ops[i].type)
+    {
+    case 1:
+      results[i] = handle_get(ops[i], tablet_name, cache);
+      break;
+    case 2:
+      results[i] = handle_put(ops[i], tablet_name, cache);
+      break;
+    case 3:
+      results[i] = handle_delete(ops[i], tablet_name, cache);
+      break;
+    case 4:
+      results[i] = handle_cput(ops[i], tablet_name, cache);
+      break;
+    }
+  }
+  for (row_stripe *stripe : stripes)
+  {
+    pthread_mutex_unlock(&stripe->lock);
+  }
+  tablet.requests_since_checkpoint += writes.size();
+  pthread_rwlock_unlock(&tablet.tablet_lock);
+  const char *error = nullptr;
+  if (ticket != 0 && !wal_wait_durable(tablet.wal, ticket))
+  {
+    error = LOG_FAILURE_ERROR;
+  }
+  else if (round && !wait_for_replicas(round, tablet_name))
+  {
+    error = REPLICATION_SHORTFALL_ERROR;
+  }
+  for (size_t i : applied)
+  {
+    if (error != nullptr && is_write_op(ops[i].type))
+    {
+      results[i].status = 1;
+      results[i].errorMessage = error;
+    }
+  }
+}
+
+/**
+ * @brief Processes a batch message carrying several GET/PUT/DELETE/CPUT ops.
+ *
+ * Ops are grouped per tablet. Each group is applied under one acquisition of
+ * its tablet lock with one log record, and replicated to the other replicas
+ * as a single batch. Groups with writes for a tablet this server is not the
+ * primary of are forwarded to that primary as a sub-batch. The reply packs
+ * one result per op, in request order. An op that cannot be applied, such
+ * as one whose rowkey names no tablet or whose group's primary could not be
+ * reached, gets status 1 in its own result; the other ops are unaffected.
+ *
+ * @param batch The decoded batch message.
+ * @param binary Whether the reply is encoded as a binary (v2) frame.
+ * @return The reply to send to the client.
+ */
+message_result process_batch(const F_2_B_Message &batch, bool binary)
+{
+  vector<F_2_B_Message> ops = decode_batch(batch.value);
+  vector<F_2_B_Message> results(ops.size());
+
+  // Ordered by tablet so groups are always locked in the same order
+  map<string, vector<size_t>> groups;
+  for (size_t i = 0; i < ops.size(); i++)
+  {
+    if (ops[i].type < 1 || ops[i].type > 4)
+    {
+      results[i] = ops[i];
+      results[i].status = 1;
+      results[i].errorMessage = "Unsupported operation in batch";
       continue;
     }
-    else if (message.substr(0, 7) == "TABGET " && isLocked)
+    try
     {
-      size_t endpos = message.find_last_not_of("\r\n");
-      if (endpos != string::npos)
-      {
-        message = message.substr(0, endpos + 1);
-      }
+      groups[get_new_file_name(ops[i].rowkey, server_tablet_ranges)].push_back(i);
+    }
+    catch (const invalid_argument &e)
+    {
+      results[i] = ops[i];
+      results[i].status = 1;
+      results[i].errorMessage = e.what();
+    }
+  }
 
-      string filename = data_file_location + "/" + lockedTablet + "_" + to_string(cache[lockedTablet].tablet_version) + ".txt";
-      ifstream file(filename);
-      if (!file.is_open())
+  string curr_ip_port = server_ip + ":" + to_string(server_port);
+  for (const auto &[tablet_name, indices] : groups)
+  {
+    F_2_B_Message sub_batch = batch;
+    vector<F_2_B_Message> group_ops;
+    bool has_writes = false;
+    for (size_t i : indices)
+    {
+      group_ops.push_back(ops[i]);
+      has_writes = has_writes || is_write_op(ops[i].type);
+    }
+    sub_batch.rowkey = group_ops.front().rowkey;
+    sub_batch.value = encode_batch(group_ops);
+
+    bool amIPrimary = true;
+    string primary_ip_port;
+    if (has_writes && batch.isFromPrimary != 1)
+    {
+      primary_ip_port = get_primary(tablet_name);
+      amIPrimary = primary_ip_port == curr_ip_port;
+    }
+
+    if (!amIPrimary)
+    {
+      // Let the primary apply and replicate the whole group
+      F_2_B_Message primary_response;
+      sockaddr_in primary_sockaddr = parse_addr(const_cast<char *>(primary_ip_port.c_str()));
+      vector<F_2_B_Message> group_results;
+      if (exchange_with_backend(primary_sockaddr, sub_batch, primary_response))
       {
-        cerr << "Failed to open file: " << filename << endl;
-        send(client_fd, "##########\n", 11, 0);
+        group_results = decode_batch(primary_response.value);
       }
       else
       {
-        string line;
-        while (getline(file, line))
+        cerr << "Failed to forward a batch group of " << tablet_name << " to " << primary_ip_port << endl;
+      }
+      // Groups already applied stand; only this one's ops fail
+      for (size_t k = 0; k < indices.size(); k++)
+      {
+        if (k < group_results.size())
         {
-          line += "\n";
-          cout << "SENT LINE: " << line << endl;
-          send(client_fd, line.c_str(), line.length(), 0);
+          results[indices[k]] = group_results[k];
+          continue;
         }
-        file.close();
-        send(client_fd, "##########\n", 11, 0);
+        results[indices[k]] = ops[indices[k]];
+        results[indices[k]].status = 1;
+        results[indices[k]].errorMessage = FORWARD_FAILURE_ERROR;
       }
       continue;
     }
 
-    // Decode received message into F_2_B_Message
-    F_2_B_Message f2b_message = decode_message(message);
-    // print_message(f2b_message);
-    if (f2b_message.isFromPrimary != 1)
+    apply_batch_group(tablet_name, ops, indices, results, has_writes && batch.isFromPrimary != 1);
+    if (has_writes)
     {
-      // cout << "UPDATED MESSAGE: " << endl;
-      // print_message(f2b_message);
-      f2b_message.isFromPrimary = 0;
+      checkpoint_if_needed(tablet_name);
     }
-    F_2_B_Message f2b_message_for_other_server = f2b_message;
+  }
 
-    if (suspended && f2b_message.type != 6)
+  F_2_B_Message reply = batch;
+  reply.value = encode_batch(results);
+  reply.status = 0;
+  reply.errorMessage = "Batch processed";
+  message_result result;
+  result.response = encode_reply(reply, binary);
+  return result;
+}
+
+/**
+ * @brief Appends a run of a primary's log records to the tablet's log and
+ * applies them, as one step under the locks of every row they write.
+ *
+ * Records the log already holds, resent after a reconnect, are skipped.
+ * The rest must continue the log exactly: a replica that missed records
+ * refuses the run rather than diverge from the primary.
+ *
+ * @param tablet_name The tablet the records belong to.
+ * @param tablet The tablet's data.
+ * @param records The records, as the primary logged them.
+ * @param gap Set if the run was refused for records missing before it.
+ * @return An empty string, or why the run was refused.
+ */
+string append_log_run(const string &tablet_name, tablet_data &tablet, string_view records, bool &gap)
+{
+  gap = false;
+  vector<string_view> raw;
+  vector<uint64_t> lsns;
+  vector<F_2_B_Message> messages;
+  vector<string> rowkeys;
+  string_view record;
+  while (next_wal_record(records, record))
+  {
+    uint64_t lsn;
+    F_2_B_Message message;
+    if (!decode_wal_record(record, lsn, message) || (!lsns.empty() && lsn != lsns.back() + 1))
     {
-      f2b_message.status = 2;
-      f2b_message.errorMessage = "Server Suspended";
-      string serialized = encode_message(f2b_message);
-      bytes_sent = send(client_fd, serialized.c_str(), serialized.length(), 0);
-      if (bytes_sent < 0)
-      {
-        cerr << "[" << client_fd << "] Error in send(). Exiting" << endl;
-        break;
-      }
-      if (verbose)
-      {
-        cout << "[" << client_fd << "] S: " << serialized;
-      }
-      break;
+      return "Damaged log records";
     }
-    else if (suspended && f2b_message.type == 6)
+    if (message.type == F2B_TYPE_BATCH)
     {
-      pthread_mutex_lock(&suspend_mutex);
-      get_latest_tablet_and_log();
-      load_cache(cache, data_file_location);
-      recover(cache, data_file_location, server_tablet_ranges);
-      suspended = false;
-      pthread_mutex_unlock(&suspend_mutex);
-      f2b_message.status = 0;
-      f2b_message.errorMessage = "Server back online";
-      string serialized = encode_message(f2b_message);
-      bytes_sent = send(client_fd, serialized.c_str(), serialized.length(), 0);
-      if (bytes_sent < 0)
+      for (const F_2_B_Message &op : decode_batch(message.value))
       {
-        cerr << "[" << client_fd << "] Error in send(). Exiting" << endl;
-        break;
-      }
-      if (verbose)
-      {
-        cout << "[" << client_fd << "] S: " << serialized;
+        rowkeys.push_back(op.rowkey);
       }
-
-      break;
     }
-    else if (f2b_message.type == 5)
+    else
     {
-      pthread_mutex_lock(&suspend_mutex);
-      suspended = true;
-      pthread_mutex_unlock(&suspend_mutex);
-      f2b_message.status = 0;
-      f2b_message.errorMessage = "Server successfully Suspended";
-      string serialized = encode_message(f2b_message);
-      bytes_sent = send(client_fd, serialized.c_str(), serialized.length(), 0);
-      if (bytes_sent < 0)
-      {
-        cerr << "[" << client_fd << "] Error in send(). Exiting" << endl;
-        break;
-      }
-      if (verbose)
-      {
-        cout << "[" << client_fd << "] S: " << serialized;
-      }
-      break;
+      rowkeys.push_back(message.rowkey);
     }
+    raw.push_back(record);
+    lsns.push_back(lsn);
+    messages.push_back(move(message));
+  }
+  if (!records.empty() || lsns.empty())
+  {
+    return "Damaged log records";
+  }
+  if (wal_failed(tablet.wal))
+  {
+    return string(LOG_FAILURE_ERROR) + " of " + tablet_name;
+  }
 
-    string tablet_name = get_new_file_name(f2b_message.rowkey, server_tablet_ranges);
-    cout << "This row is in new file: " << tablet_name << endl;
-
-    update_primary(tablet_name);
-    pthread_mutex_lock(&primary_mutex);
-    string primary_ip_port = range_to_primary_map[tablet_name];
-    pthread_mutex_unlock(&primary_mutex);
-    string curr_ip_port = server_ip + ":" + to_string(server_port);
-    bool amIPrimary = primary_ip_port == curr_ip_port;
-    cout << amIPrimary << " " << curr_ip_port << " " << primary_ip_port << endl;
-
-    // if req not from primary and I am not the primary and the type of req is not get
-    // FOrward to primary
-    // Wait for a response
-    // Fotward response to sender
-    // continue
+  lock_tablet_for_write(tablet);
+  vector<row_stripe *> stripes = lock_rows_for_write(tablet, rowkeys);
+  pthread_mutex_lock(&tablet.lsn_mutex);
+  uint64_t last_lsn = tablet.last_lsn;
+  size_t first = 0;
+  while (first < lsns.size() && lsns[first] <= last_lsn)
+  {
+    first++;
+  }
+  gap = first < lsns.size() && lsns[first] != last_lsn + 1;
+  uint64_t ticket = 0;
+  if (!gap && first < lsns.size())
+  {
+    string appended;
+    for (size_t i = first; i < raw.size(); i++)
+    {
+      appended.append(raw[i]);
+    }
+    ticket = wal_append(tablet.wal, appended);
+    tablet.last_lsn = lsns.back();
+  }
+  pthread_mutex_unlock(&tablet.lsn_mutex);
+  if (!gap)
+  {
+    for (size_t i = first; i < messages.size(); i++)
+    {
+      replay_message(cache, messages[i], tablet_name);
+    }
+  }
+  for (row_stripe *stripe : stripes)
+  {
+    pthread_mutex_unlock(&stripe->lock);
+  }
+  pthread_rwlock_unlock(&tablet.tablet_lock);
 
-    if (f2b_message_for_other_server.isFromPrimary == 0 && f2b_message_for_other_server.type != 1 && !amIPrimary && f2b_message_for_other_server.type != 10)
+  if (gap)
+  {
+    return "Missing log records " + to_string(last_lsn + 1) + " to " + to_string(lsns[first] - 1) + " of " +
+           tablet_name;
+  }
+  if (ticket != 0)
+  {
+    if (!wal_wait_durable(tablet.wal, ticket))
     {
+      return string(LOG_FAILURE_ERROR) + " of " + tablet_name;
+    }
+    checkpoint_if_needed(tablet_name);
+  }
+  return "";
+}
 
-      string serialized_to_primary = encode_message(f2b_message);
+/**
+ * @brief Processes log records shipped by a primary (F2B_TYPE_LOG_RECORDS).
+ *
+ * @param message The decoded shipment.
+ * @param binary Whether the reply is encoded as a binary (v2) frame.
+ * @return The reply: status 0 once every run is durable in the local log
+ * and applied, 1 if a run was refused. A run refused for a gap names its
+ * tablet in rowkey and the last LSN held in value, so the primary can send
+ * what is missing. An empty run means the primary no longer has those
+ * records; the tablet is then resynced from a snapshot in the background.
+ */
+message_result process_log_records(const F_2_B_Message &message, bool binary)
+{
+  F_2_B_Message reply = message;
+  reply.value.clear();
+  reply.status = 0;
+  reply.errorMessage = "Log records applied";
 
-      int sock = socket(AF_INET, SOCK_STREAM, 0);
-      if (sock < 0)
+  vector<log_run> runs;
+  if (!decode_log_shipment(message.value, runs))
+  {
+    reply.status = 1;
+    reply.errorMessage = "Malformed log records";
+  }
+  for (const log_run &run : runs)
+  {
+    auto it = cache.find(string(run.tablet_name));
+    bool gap = false;
+    string error;
+    if (it == cache.end())
+    {
+      error = "Unknown tablet " + string(run.tablet_name);
+    }
+    else if (run.records.empty())
+    {
+      start_resync(it->first);
+      error = "Resyncing " + it->first + " from a snapshot";
+    }
+    else
+    {
+      error = append_log_run(it->first, it->second, run.records, gap);
+    }
+    if (!error.empty())
+    {
+      cerr << error << endl;
+      reply.status = 1;
+      reply.errorMessage = error;
+      if (gap)
       {
-        cerr << "Error in socket creation" << endl;
-        break;
+        pthread_mutex_lock(&it->second.lsn_mutex);
+        reply.rowkey = it->first;
+        reply.value = to_string(it->second.last_lsn);
+        pthread_mutex_unlock(&it->second.lsn_mutex);
       }
+      break;
+    }
+  }
 
-      sockaddr_in primary_sockaddr = parse_addr(const_cast<char *>(primary_ip_port.c_str()));
-      cout << "Primary Port:" << ntohs(primary_sockaddr.sin_port) << endl;
+  message_result result;
+  result.response = encode_reply(reply, binary);
+  return result;
+}
 
-      if (connect(sock, (struct sockaddr *)&primary_sockaddr, sizeof(primary_sockaddr)) < 0)
-      {
-        cerr << "Connection Failed" << endl;
-        break;
-      }
-      char welcome_buffer[WELCOME_BUFFER_SIZE] = {0};
-      read(sock, welcome_buffer, WELCOME_BUFFER_SIZE);
-      cout << "Ignored message: " << welcome_buffer << endl; // Optionally log the ignored message
-      bytes_sent = send(sock, serialized_to_primary.c_str(), serialized_to_primary.length(), 0);
-      if (bytes_sent < 0)
-      {
-        cerr << "Error in send(). Exiting" << endl;
-        break;
-      }
+/**
+ * @brief Reads the records of a tablet's log after an LSN.
+ *
+ * Writes carry on meanwhile: a record still being written ends the copy
+ * early, and a checkpoint swaps in a truncated file whole, so either way
+ * the result is a run of complete records.
+ *
+ * @param tablet_name The tablet.
+ * @param from_lsn The last LSN the reader holds.
+ * @param records Receives the records after from_lsn.
+ * @return false if the log no longer holds them, or the reader claims
+ * records this server never logged.
+ */
+bool read_log_suffix(const string &tablet_name, uint64_t from_lsn, string &records)
+{
+  records.clear();
+  auto it = cache.find(tablet_name);
+  if (it == cache.end())
+  {
+    return false;
+  }
+  tablet_data &tablet = it->second;
+  pthread_mutex_lock(&tablet.lsn_mutex);
+  uint64_t last_lsn = tablet.last_lsn;
+  pthread_mutex_unlock(&tablet.lsn_mutex);
+  // Every record up to last_lsn is in the file from here on
+  wal_flush(tablet.wal);
+  return from_lsn == last_lsn || (from_lsn < last_lsn && read_wal_suffix(tablet.wal.path, from_lsn, records));
+}
 
-      if (verbose)
-      {
-        cout << "[" << client_fd << ", " << sock << "] S: " << serialized_to_primary;
-      }
+/**
+ * @brief Answers a recovering replica's "SYNC <tablet> FROM <lsn>".
+ *
+ * @param tablet_name The tablet of the session.
+ * @param from_lsn The last LSN the replica holds.
+ * @return "LOG <bytes>" followed by the records after from_lsn, or
+ * "SNAPSHOT" if read_log_suffix cannot provide them.
+ */
+message_result sync_log_suffix(const string &tablet_name, uint64_t from_lsn)
+{
+  message_result result;
+  string records;
+  if (read_log_suffix(tablet_name, from_lsn, records))
+  {
+    result.response = "LOG " + to_string(records.size()) + "\r\n" + records;
+  }
+  else
+  {
+    result.response = "SNAPSHOT\r\n";
+  }
+  if (verbose)
+  {
+    cout << "SYNC " << tablet_name << " from LSN " << from_lsn << ": " << result.response.substr(0, result.response.find('\r')) << endl;
+  }
+  return result;
+}
 
-      char buffer[MAX_BUFFER_SIZE] = {0};
-      ssize_t bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
-      if (bytes_received <= 0)
-      {
-        cout << "Server closed the connection or error occurred." << endl;
-        break;
-      }
+/**
+ * @brief Finds the first row key past the end of a tablet's range.
+ *
+ * @param tablet_name The tablet's range, e.g. "aa_am".
+ * @return The smallest key of the next range ("an"), or an empty string if
+ * the tablet covers the end of the key space.
+ */
+string next_tablet_start(const string &tablet_name)
+{
+  string bound = tablet_name.substr(tablet_name.find('_') + 1);
+  while (!bound.empty() && bound.back() == 'z')
+  {
+    bound.pop_back();
+  }
+  if (bound.empty())
+  {
+    return "";
+  }
+  bound.back()++;
+  return bound;
+}
 
-      string buffer_str(buffer);
-      bytes_sent = send(client_fd, buffer_str.c_str(), buffer_str.length(), 0);
+/**
+ * @brief Finds the first row key past every key with a prefix.
+ *
+ * @param prefix The prefix.
+ * @return The prefix with its last byte incremented, or an empty string (no
+ * bound) if there is none.
+ */
+string prefix_end(string prefix)
+{
+  while (!prefix.empty() && (unsigned char)prefix.back() == 0xff)
+  {
+    prefix.pop_back();
+  }
+  if (!prefix.empty())
+  {
+    prefix.back()++;
+  }
+  return prefix;
+}
 
-      if (bytes_sent < 0)
-      {
-        cerr << "[" << client_fd << "] Error in send(). Exiting" << endl;
-        break;
-      }
+/**
+ * @brief Handles LIST by streaming one page of the node's cells.
+ *
+ * The node's tablets are listed one after the other in range order, each
+ * in rowkey order through scan_rows, so no tablet lock is held while cells
+ * are encoded, and the page goes out in one piece once it is complete.
+ * The cursor names the tablet and the row the next page starts from, as a
+ * key outside a tablet's range may still have been stored in it.
+ *
+ * @param message The LIST request (see F2B_TYPE_LIST).
+ * @param list_output The string the serialized cells are appended to.
+ * @param binary Whether the cells are encoded as binary (v2) frames.
+ * @return The closing "terminate" message, with the next page's cursor in
+ * value, empty once everything has been listed.
+ */
+F_2_B_Message handle_list(const F_2_B_Message &message, string &list_output, bool binary)
+{
+  F_2_B_Message done;
+  done.type = F2B_TYPE_LIST;
+  done.status = 0;
+  done.errorMessage = "success";
+  done.rowkey = "terminate";
+  done.colkey = "terminate";
+  done.isFromPrimary = 0;
+  done.requestId = message.requestId;
+
+  const string &prefix = message.rowkey;
+  string end = prefix_end(prefix);
+  size_t limit = SCAN_DEFAULT_LIMIT;
+  if (!message.value2.empty())
+  {
+    limit = strtoul(message.value2.c_str(), NULL, 10);
+  }
+  limit = min<size_t>(max<size_t>(limit, 1), SCAN_MAX_LIMIT);
 
-      if (verbose)
-      {
-        cout << "[" << client_fd << "] S: " << buffer_str;
-      }
-      close(sock);
-      continue;
+  vector<string> tablets;
+  if (!message.colkey.empty())
+  {
+    tablets.push_back(message.colkey);
+  }
+  else
+  {
+    for (const auto &entry : cache)
+    {
+      tablets.push_back(entry.first);
     }
-
-    // Handle message based on its type
-    switch (f2b_message.type)
+    sort(tablets.begin(), tablets.end());
+  }
+  size_t first = 0;
+  string resume;
+  if (!message.value.empty())
+  {
+    size_t space = message.value.find(' ');
+    string cursor_tablet = message.value.substr(0, space);
+    first = lower_bound(tablets.begin(), tablets.end(), cursor_tablet) - tablets.begin();
+    if (space != string::npos && first < tablets.size() && tablets[first] == cursor_tablet)
     {
-    case 1:
-      pthread_mutex_lock(&cache[tablet_name].tablet_lock);
-      f2b_message = handle_get(f2b_message, tablet_name, cache);
-      pthread_mutex_unlock(&cache[tablet_name].tablet_lock);
-      break;
-    case 2:
-      // Add the message to the LOG
-      pthread_mutex_lock(&cache[tablet_name].tablet_lock);
-      log_message(f2b_message, data_file_location, tablet_name);
-      f2b_message = handle_put(f2b_message, tablet_name, cache);
-      cache[tablet_name].requests_since_checkpoint++;
-      pthread_mutex_unlock(&cache[tablet_name].tablet_lock);
-      break;
-    case 3:
-      // Add the message to the LOG
-      pthread_mutex_lock(&cache[tablet_name].tablet_lock);
-      log_message(f2b_message, data_file_location, tablet_name);
-      f2b_message = handle_delete(f2b_message, tablet_name, cache);
-      cache[tablet_name].requests_since_checkpoint++;
-      pthread_mutex_unlock(&cache[tablet_name].tablet_lock);
-      break;
-    case 4:
-      // Add the message to the LOG
-      pthread_mutex_lock(&cache[tablet_name].tablet_lock);
-      log_message(f2b_message, data_file_location, tablet_name);
-      f2b_message = handle_cput(f2b_message, tablet_name, cache);
-      cache[tablet_name].requests_since_checkpoint++;
-      pthread_mutex_unlock(&cache[tablet_name].tablet_lock);
-      break;
-    case 10:
-      f2b_message = handle_list(client_fd);
-      break;
-    default:
-      cout << "Unknown command type received" << endl;
-      break;
+      resume = message.value.substr(space + 1);
     }
-    if (cache[tablet_name].requests_since_checkpoint > CHECKPOINT_SIZE)
+  }
+  for (size_t i = first; i < tablets.size(); i++)
+  {
+    if (cache.find(tablets[i]) == cache.end())
     {
-      cout << "Checkpointing the file: " << tablet_name << " "
-           << cache[tablet_name].requests_since_checkpoint << endl;
-      pthread_mutex_lock(&cache[tablet_name].tablet_lock);
-      checkpoint_tablet(cache[tablet_name], tablet_name, data_file_location);
-      cache[tablet_name].requests_since_checkpoint = 0;
-      pthread_mutex_unlock(&cache[tablet_name].tablet_lock);
+      done.status = 1;
+      done.errorMessage = "Unknown tablet";
+      return done;
     }
+  }
 
-    if (f2b_message_for_other_server.isFromPrimary == 0 && f2b_message_for_other_server.type != 1 && amIPrimary && f2b_message_for_other_server.type != 10)
+  // One row past the page tells whether there is another page, and where
+  size_t rows = 0;
+  for (size_t i = first; i < tablets.size() && rows <= limit; i++)
+  {
+    const string &tablet_name = tablets[i];
+    string start = i == first ? max(resume, prefix) : prefix;
+    scan_rows(cache[tablet_name], start, end, limit + 1 - rows, [&](const string &rowkey, const tablet_row &row)
+              {
+                if (rows++ == limit)
+                {
+                  done.value = tablet_name + " " + rowkey;
+                  return;
+                }
+                for (auto &col_pair : row)
+                {
+                  F_2_B_Message cell;
+                  cell.type = F2B_TYPE_LIST;
+                  cell.rowkey = rowkey;
+                  cell.colkey = *col_pair.first;
+                  cell.value = *col_pair.second;
+                  cell.status = 0;
+                  cell.isFromPrimary = 0;
+                  cell.requestId = message.requestId;
+                  list_output += encode_reply(cell, binary);
+                }
+              });
+  }
+  return done;
+}
+
+/**
+ * @brief Handles SCAN and PREFIX by streaming one page of a row range.
+ *
+ * Rows come out in rowkey order from the tablet's ordered index and its
+ * checkpoint file, without a lock held while they are encoded. A page ends
+ * after the requested number of rows or at the end of the tablet; the
+ * returned message carries the key the next page starts from, which may be
+ * the first key of the next tablet.
+ *
+ * @param message The SCAN or PREFIX request.
+ * @param tablet_name The tablet holding the request's rowkey.
+ * @param scan_output The string the serialized cells are appended to.
+ * @param binary Whether the cells are encoded as binary (v2) frames.
+ * @return The closing "terminate" message, with the continuation key in value.
+ */
+F_2_B_Message handle_scan(const F_2_B_Message &message, const string &tablet_name, string &scan_output, bool binary)
+{
+  string start = message.rowkey;
+  string end = message.value;
+  if (message.type == F2B_TYPE_PREFIX)
+  {
+    end = prefix_end(message.rowkey);
+    if (!message.value.empty())
     {
-      f2b_message_for_other_server.isFromPrimary = 1;
-      string tablet_range = get_tablet_range_from_row_key(f2b_message_for_other_server.rowkey);
-      for (auto other_addr : tablet_ranges_to_other_addr[tablet_range])
-      {
-        string serialized_to_backend = encode_message(f2b_message_for_other_server);
-        cout << "Sending a message with row key: " << tablet_range << " " << f2b_message_for_other_server.rowkey << " to " << htons(other_addr.sin_port) << endl;
+      start = message.value;
+    }
+  }
+  size_t limit = SCAN_DEFAULT_LIMIT;
+  if (!message.value2.empty())
+  {
+    limit = strtoul(message.value2.c_str(), NULL, 10);
+  }
+  limit = min<size_t>(max<size_t>(limit, 1), SCAN_MAX_LIMIT);
+
+  F_2_B_Message done;
+  done.type = message.type;
+  done.status = 0;
+  done.errorMessage = "success";
+  done.rowkey = "terminate";
+  done.colkey = "terminate";
+  done.isFromPrimary = 0;
+  done.requestId = message.requestId;
+
+  // One row past the page tells whether there is another page, and where
+  size_t rows = 0;
+  scan_rows(cache[tablet_name], start, end, limit + 1, [&](const string &rowkey, const tablet_row &row)
+            {
+              if (rows++ == limit)
+              {
+                done.value = rowkey;
+                return;
+              }
+              for (auto &col_pair : row)
+              {
+                F_2_B_Message cell;
+                cell.type = message.type;
+                cell.rowkey = rowkey;
+                cell.colkey = *col_pair.first;
+                cell.value = *col_pair.second;
+                cell.status = 0;
+                cell.isFromPrimary = 0;
+                cell.requestId = message.requestId;
+                scan_output += encode_reply(cell, binary);
+              }
+            });
+  if (rows <= limit)
+  {
+    // The tablet is exhausted; the range may go on in the next one. A start
+    // outside every local range lands in the first tablet, which must not
+    // send the client backwards.
+    string next = next_tablet_start(tablet_name);
+    if (next > start && (end.empty() || next < end))
+    {
+      done.value = next;
+    }
+  }
+  return done;
+}
 
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0)
-        {
-          cerr << "Error in socket creation" << endl;
-          break;
-        }
-        if (connect(sock, (struct sockaddr *)&other_addr, sizeof(other_addr)) < 0)
-        {
-          cerr << "Connection Failed" << endl;
-          close(sock);
-          continue;
-        }
-        bytes_sent = send(sock, serialized_to_backend.c_str(), serialized_to_backend.length(), 0);
-        if (bytes_sent < 0)
-        {
-          cerr << "Error in send(). Exiting" << endl;
-          close(sock);
-          break;
-        }
-        if (verbose)
-        {
-          cout << "[" << client_fd << ", " << sock << "] S: " << serialized_to_backend;
-        }
-        char buffer[MAX_BUFFER_SIZE] = {0};
-        ssize_t bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
-        if (bytes_received <= 0)
-        {
-          cout << "Does not receive response from other servers." << endl;
-          close(sock);
-          break;
-        }
-        else
-        {
-          if (verbose)
-          {
-            cout << "[" << client_fd << ", " << sock << "] S: "
-                 << "Received Response" << endl;
-          }
-        }
-        close(sock);
-      }
+/**
+ * @brief Strips the trailing "\r\n" from a text command and returns its argument.
+ *
+ * @param frame The raw frame, e.g. "TABGET aa_am\r\n".
+ * @param prefix_length The length of the command keyword including the space.
+ * @return The argument following the command keyword.
+ */
+string command_argument(string_view frame, size_t prefix_length)
+{
+  size_t endpos = frame.find_last_not_of("\r\n");
+  if (endpos != string_view::npos)
+  {
+    frame = frame.substr(0, endpos + 1);
+  }
+  return string(frame.substr(prefix_length));
+}
+
+/**
+ * @brief Processes one F_2_B_Message frame.
+ *
+ * Runs on a worker thread. It may block on the tablet locks and on forwarding
+ * or replicating the request to other backends, but never touches the client
+ * socket: the serialized reply is returned to the event loop. Replies keep
+ * the request id of the message, so a pipelining client can match them up.
+ *
+ * @param message The raw frame received from the client.
+ * @param binary Whether the client negotiated binary (v2) frames; the reply
+ * is encoded the same way.
+ * @return The reply to send and whether to close the connection afterwards.
+ */
+message_result process_message(const string &message, bool binary)
+{
+  message_result result;
+
+  // Decode received message into F_2_B_Message
+  F_2_B_Message f2b_message = binary ? decode_message_v2(message) : decode_message(message);
+  // print_message(f2b_message);
+  if (f2b_message.isFromPrimary != 1)
+  {
+    // cout << "UPDATED MESSAGE: " << endl;
+    // print_message(f2b_message);
+    f2b_message.isFromPrimary = 0;
+  }
+  F_2_B_Message f2b_message_for_other_server = f2b_message;
+
+  if (suspended && f2b_message.type != 6)
+  {
+    f2b_message.status = 2;
+    f2b_message.errorMessage = "Server Suspended";
+    result.response = encode_reply(f2b_message, binary);
+    result.close_connection = true;
+    return result;
+  }
+  else if (suspended && f2b_message.type == 6)
+  {
+    pthread_mutex_lock(&suspend_mutex);
+    get_latest_tablet_and_log();
+    recover_tablets(cache, data_file_location);
+    suspended = false;
+    pthread_mutex_unlock(&suspend_mutex);
+    f2b_message.status = 0;
+    f2b_message.errorMessage = "Server back online";
+    result.response = encode_reply(f2b_message, binary);
+    result.close_connection = true;
+    return result;
+  }
+  else if (f2b_message.type == 5)
+  {
+    pthread_mutex_lock(&suspend_mutex);
+    suspended = true;
+    pthread_mutex_unlock(&suspend_mutex);
+    f2b_message.status = 0;
+    f2b_message.errorMessage = "Server successfully Suspended";
+    result.response = encode_reply(f2b_message, binary);
+    result.close_connection = true;
+    return result;
+  }
+
+  if (f2b_message.type == F2B_TYPE_BATCH)
+  {
+    return process_batch(f2b_message, binary);
+  }
+
+  if (f2b_message.type == F2B_TYPE_LOG_RECORDS)
+  {
+    return process_log_records(f2b_message, binary);
+  }
+
+  // LIST covers every local tablet and is always served locally
+  if (f2b_message.type == F2B_TYPE_LIST)
+  {
+    f2b_message = handle_list(f2b_message, result.response, binary);
+    result.response += encode_reply(f2b_message, binary);
+    return result;
+  }
+
+  // A PREFIX page after the first is served by the tablet it resumes in
+  bool resumes = f2b_message.type == F2B_TYPE_PREFIX && !f2b_message.value.empty();
+  string tablet_name = get_new_file_name(resumes ? f2b_message.value : f2b_message.rowkey, server_tablet_ranges);
+  cout << "This row is in new file: " << tablet_name << endl;
+
+  string primary_ip_port = get_primary(tablet_name);
+  string curr_ip_port = server_ip + ":" + to_string(server_port);
+  bool amIPrimary = primary_ip_port == curr_ip_port;
+  cout << amIPrimary << " " << curr_ip_port << " " << primary_ip_port << endl;
+
+  // if req not from primary and I am not the primary and the type of req is not get
+  // FOrward to primary
+  // Wait for a response
+  // Fotward response to sender
+  // continue
+
+  if (f2b_message_for_other_server.isFromPrimary == 0 && !is_read_op(f2b_message_for_other_server.type) && !amIPrimary)
+  {
+    // Any failure talking to the primary drops the client connection
+    result.close_connection = true;
+    sockaddr_in primary_sockaddr = parse_addr(const_cast<char *>(primary_ip_port.c_str()));
+    cout << "Primary Port:" << ntohs(primary_sockaddr.sin_port) << endl;
+
+    F_2_B_Message primary_response;
+    if (!exchange_with_backend(primary_sockaddr, f2b_message, primary_response))
+    {
+      cout << "Server closed the connection or error occurred." << endl;
+      return result;
     }
 
-    // Encode response message
-    string serialized = encode_message(f2b_message);
-    // Send response to client
+    primary_response.requestId = f2b_message.requestId;
+    result.response = encode_reply(primary_response, binary);
+    result.close_connection = false;
+    return result;
+  }
+
+  bool replicate = f2b_message_for_other_server.isFromPrimary == 0 && !is_read_op(f2b_message.type) && amIPrimary;
+
+  // Handle message based on its type
+  switch (f2b_message.type)
+  {
+  case 1:
+    // Lock-free; see read_row
+    f2b_message = handle_get(f2b_message, tablet_name, cache);
+    break;
+  case 2:
+    f2b_message = apply_row_write(f2b_message, tablet_name, handle_put, replicate);
+    break;
+  case 3:
+    f2b_message = apply_row_write(f2b_message, tablet_name, handle_delete, replicate);
+    break;
+  case 4:
+    f2b_message = apply_row_write(f2b_message, tablet_name, handle_cput, replicate);
+    break;
+  case F2B_TYPE_SCAN:
+  case F2B_TYPE_PREFIX:
+    f2b_message = handle_scan(f2b_message, tablet_name, result.response, binary);
+    break;
+  default:
+    cout << "Unknown command type received" << endl;
+    break;
+  }
+  checkpoint_if_needed(tablet_name);
+
+  // Encode response message
+  string serialized = encode_reply(f2b_message, binary);
+  if (verbose && !binary)
+  {
     cout << "PRINTING SPECIAL: " << serialized << endl;
+  }
+  result.response += serialized;
+  return result;
+}
+
+/**
+ * @brief Handles one complete frame received on a client connection.
+ *
+ * Runs on the event loop thread and therefore never blocks. The peer
+ * recovery commands (GET/LGET/TABGET/BLOBGET/LOGGET/quit) only touch
+ * per-connection state and are answered inline; TABGET, BLOBGET and LOGGET
+ * stream their file as the socket drains. SYNC reads the log on a worker. PROTO 2 switches the connection to binary frames.
+ * Everything else is an F_2_B_Message and goes to a worker.
+ *
+ * @param conn The connection the frame arrived on.
+ * @param frame The raw frame, "\r\n" terminated or length-prefixed.
+ * @return How the event loop should proceed with this connection.
+ */
+frame_status handle_frame(const shared_ptr<connection> &conn, string_view frame)
+{
+  // Once negotiated, every frame is a binary F_2_B_Message
+  if (conn->in_buf.binary)
+  {
+    dispatch_to_worker(conn, [message = string(frame)]()
+                       { return process_message(message, true); });
+    return FRAME_DISPATCHED;
+  }
 
-    bytes_sent = send(client_fd, serialized.c_str(), serialized.length(), 0);
-    // Check for send errors
-    if (bytes_sent < 0)
+  // Print received message if in verbose mode
+  if (verbose)
+  {
+    cout << "[" << conn->fd << "] C: " << frame;
+  }
+
+  if (frame == PROTO_V2_REQUEST)
+  {
+    reply(*conn, PROTO_V2_ACCEPTED);
+    conn->in_buf.binary = true;
+    // Binary frames carry a request id, so replies may come back out of order
+    conn->pipelined = true;
+    return FRAME_DONE;
+  }
+
+  if (frame == "STATS\r\n")
+  {
+    reply(*conn, "+OK " + wal_stats() + " " + row_cache_stats() + " " + replication_stats() + "\r\n");
+    return FRAME_DONE;
+  }
+
+  // "PMAP <epoch> <lease_ms> <range>=<primary> ..." pushed by the coordinator
+  if (frame.substr(0, 5) == "PMAP ")
+  {
+    if (!install_primary_map(command_argument(frame, 5)))
     {
-      cerr << "[" << client_fd << "] Error in send(). Exiting" << endl;
-      break;
+      reply(*conn, "-ERR Stale or malformed primary map\r\n");
+      return FRAME_DONE;
     }
+    pthread_mutex_lock(&primary_mutex);
+    string epoch = to_string(primary_map_epoch);
+    pthread_mutex_unlock(&primary_mutex);
+    reply(*conn, "+OK " + epoch + "\r\n");
+    return FRAME_DONE;
+  }
 
-    // Print sent message if in verbose mode
+  // Check for quit command
+  if (frame == "quit\r\n")
+  {
+    conn->snapshot.reset();
+    string goodbye = "Quit command received. Server goodbye!\r\n";
+    reply(*conn, goodbye);
+    conn->close_after_flush = true;
+
+    // Print goodbye message if in verbose mode
     if (verbose)
     {
-      cout << "[" << client_fd << "] S: " << serialized;
+      cout << "[" << conn->fd << "] S: " << goodbye;
     }
+    return FRAME_DONE;
   }
+  if (frame.substr(0, 4) == "GET " && conn->snapshot == nullptr)
+  {
+    string tablet = command_argument(frame, 4);
+    auto it = cache.find(tablet);
+    if (it == cache.end())
+    {
+      reply(*conn, "-ERR Unknown tablet\r\n");
+      return FRAME_DONE;
+    }
+    // Pinning waits for the tablet lock and the log, so it runs on a worker;
+    // writes carry on while the peer copies the snapshot
+    dispatch_to_worker(conn, [tablet, tablet_state = &it->second]()
+                       {
+      message_result result;
+      shared_ptr<tablet_snapshot> snapshot = pin_tablet_snapshot(*tablet_state, tablet, data_file_location);
+      if (snapshot == nullptr)
+      {
+        result.response = "-ERR Failed to snapshot tablet\r\n";
+        return result;
+      }
 
-  // Remove client file descriptor from the list
-  auto it = find(client_fds.begin(), client_fds.end(), client_fd);
-  if (it != client_fds.end())
+      // The peer fetches records logged after last_lsn with SYNC
+      result.response = "VER " + to_string(snapshot->version) + " LSN " +
+                        to_string(snapshot->last_lsn) + "\r\n";
+      cout << tablet << endl;
+      cout
+          << "GET Response:" << result.response << endl;
+      result.apply = [tablet, tablet_state, snapshot](connection &session)
+      {
+        session.sync_tablet = tablet;
+        session.sync_tablet_data = tablet_state;
+        session.snapshot = snapshot;
+      };
+      return result; });
+    return FRAME_DISPATCHED;
+  }
+  else if (frame.substr(0, 5) == "LGET " && conn->snapshot != nullptr)
   {
-    client_fds.erase(it);
+    int requests_since_checkpoint = conn->sync_tablet_data->requests_since_checkpoint;
+    string response = "VER " + to_string(requests_since_checkpoint) + "\r\n";
+    cout << "LGET Response:" << response << endl;
+    reply(*conn, response);
+    return FRAME_DONE;
+  }
+  else if (frame.substr(0, 5) == "SYNC " && conn->snapshot != nullptr)
+  {
+    // "SYNC <tablet> FROM <lsn>"; like TABGET it serves the session's tablet
+    string argument = command_argument(frame, 5);
+    size_t from_pos = argument.find(" FROM ");
+    if (from_pos == string::npos)
+    {
+      reply(*conn, "-ERR Syntax: SYNC <tablet> FROM <lsn>\r\n");
+      return FRAME_DONE;
+    }
+    uint64_t from_lsn = strtoull(argument.c_str() + from_pos + 6, NULL, 10);
+    dispatch_to_worker(conn, [tablet_name = conn->sync_tablet, from_lsn]()
+                       { return sync_log_suffix(tablet_name, from_lsn); });
+    return FRAME_DISPATCHED;
+  }
+  else if (frame.substr(0, 7) == "LOGGET " && conn->snapshot != nullptr)
+  {
+    // Records pinned by the snapshot may still be waiting for group commit;
+    // the flush writes and syncs, so it runs on a worker
+    dispatch_to_worker(conn, [tablet_state = conn->sync_tablet_data]()
+                       {
+      wal_flush(tablet_state->wal);
+      message_result result;
+      result.apply = [](connection &session)
+      { stream_file(session, session.snapshot->log_fd, session.snapshot->log_size); };
+      return result; });
+    return FRAME_DISPATCHED;
+  }
+  else if (frame.substr(0, 7) == "TABGET " && conn->snapshot != nullptr)
+  {
+    stream_file(*conn, conn->snapshot->checkpoint_fd, conn->snapshot->checkpoint_size);
+    return FRAME_DONE;
+  }
+  else if (frame.substr(0, 8) == "BLOBGET " && conn->snapshot != nullptr)
+  {
+    // The blob log named by the checkpoint TABGET sends
+    stream_file(*conn, conn->snapshot->blob_fd, conn->snapshot->blob_size);
+    return FRAME_DONE;
   }
 
-  // Close client socket
-  close(client_fd);
-
-  // Print connection closed message if in verbose mode
-  if (verbose)
+  // Every F_2_B_Message starts with its numeric type
+  if (!isdigit(static_cast<unsigned char>(frame[0])))
   {
-    cout << "[" << client_fd << "] Connection closed!\n";
+    reply(*conn, "-ERR Command not recognized\r\n");
+    return FRAME_DONE;
   }
-  return nullptr;
+
+  dispatch_to_worker(conn, [message = string(frame)]()
+                     { return process_message(message, false); });
+  return FRAME_DISPATCHED;
+}
+
+/**
+ * @brief Releases anything a connection still holds when it goes away.
+ *
+ * A recovering peer that dies mid-transfer must not keep the files of its
+ * snapshot open until the connection object itself is freed.
+ *
+ * @param conn The connection being closed.
+ */
+void handle_connection_closed(connection &conn)
+{
+  conn.snapshot.reset();
+  conn.sync_tablet_data = nullptr;
 }
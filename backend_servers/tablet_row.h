@@ -0,0 +1,71 @@
+#ifndef TABLET_ROW_H
+#define TABLET_ROW_H
+
+#include "column_names.h"
+#include "value_slab.h"
+#include <algorithm>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief The columns of one version of a row, sorted by name.
+ *
+ * Rows hold a handful of columns, so one flat vector, searched by bisection,
+ * costs a single allocation per row where a hash table costs a bucket array
+ * plus a node per column. Column names are interned, so a column costs two
+ * pointers plus its value. Lookups take a string_view and compare against
+ * the interned names, so reads never touch the dictionary. Published
+ * versions are never changed.
+ */
+struct tablet_row
+{
+  typedef std::pair<column_name, cell_value> column;
+  typedef std::vector<column>::const_iterator const_iterator;
+
+  std::vector<column> columns;
+
+  const_iterator begin() const { return columns.begin(); }
+  const_iterator end() const { return columns.end(); }
+  size_t size() const { return columns.size(); }
+
+  const_iterator find(std::string_view name) const
+  {
+    auto it = lower_bound(columns, name);
+    return it != columns.end() && *it->first == name ? it : end();
+  }
+
+  bool contains(std::string_view name) const { return find(name) != end(); }
+
+  // The value of a column, inserted empty in order if it is not there yet
+  cell_value &operator[](std::string_view name)
+  {
+    auto it = lower_bound(columns, name);
+    if (it == columns.end() || *it->first != name)
+    {
+      it = columns.emplace(it, intern_column(name), nullptr);
+    }
+    return it->second;
+  }
+
+  void erase(std::string_view name)
+  {
+    auto it = lower_bound(columns, name);
+    if (it != columns.end() && *it->first == name)
+    {
+      columns.erase(it);
+    }
+  }
+
+private:
+  // First column not ordered before name, for a const or mutable vector
+  template <typename column_vector>
+  static auto lower_bound(column_vector &columns, std::string_view name) -> decltype(columns.begin())
+  {
+    return std::lower_bound(columns.begin(), columns.end(), name,
+                            [](const column &c, std::string_view key)
+                            { return *c.first < key; });
+  }
+};
+
+#endif // TABLET_ROW_H
@@ -1,3 +1,4 @@
+#include "../../utils/read_buffer.h"
 #include "../../utils/utils.h"
 #include <arpa/inet.h> // for inet_pton
 #include <cstring>     // for strlen and memset
@@ -83,36 +84,39 @@ int main(int argc, char *argv[])
         send(sock, input.c_str(), input.length(), 0);
         break;
       }
-      if (input == "list")
+      if (input.substr(0, 4) == "list")
       {
-        F_2_B_Message message;
-        message.type = 10;
-        message.rowkey = "adw";
-        message.colkey = "adw";
-        message.isFromPrimary = 0;
-
-        string serialized = encode_message(message);
-        send(sock, serialized.c_str(), serialized.length(), 0);
-        while (true)
+        // list [prefix [tablet]]: every page, following the cursor
+        istringstream args(input.substr(4));
+        string prefix, tablet, cursor;
+        args >> prefix >> tablet;
+        read_buffer buf;
+        do
         {
-          char buffer[1024] = {0};
-          int bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
-          if (bytes_received <= 0)
+          F_2_B_Message message;
+          message.type = F2B_TYPE_LIST;
+          message.rowkey = prefix;
+          message.colkey = tablet;
+          message.value = cursor;
+          message.isFromPrimary = 0;
+
+          string serialized = encode_message(message);
+          send(sock, serialized.c_str(), serialized.length(), 0);
+          cursor.clear();
+          string_view frame;
+          while (read_frame(sock, buf, frame))
           {
-            cout << "Server closed the connection or error occurred." << endl;
-            break;
-          }
-          string response(buffer);
-          F_2_B_Message received_message = decode_message(response);
-          if (received_message.rowkey == "terminate")
-          {
-            cout << "End of list." << endl;
+            F_2_B_Message received_message = decode_message(string(frame));
+            if (received_message.rowkey == "terminate")
+            {
+              cursor = received_message.value;
+              cout << (cursor.empty() ? "End of list." : "Next page from " + cursor) << endl;
+              break;
+            }
+            cout << "Server: " << endl;
             print_message(received_message);
-            break;
           }
-          cout << "Server: " << endl;
-          print_message(received_message);
-        }
+        } while (!cursor.empty());
         continue;
       }
       istringstream iss(input);
@@ -0,0 +1,236 @@
+// Microbenchmark of the backend's GET path.
+//
+// Runs handle_get from 1 up to -t threads against one in-memory tablet and
+// prints the aggregate GET rate for three read paths:
+//
+//   lockfree  handle_get as the server runs it, with no lock
+//   rwlock    the tablet's reader-writer lock taken shared around each GET
+//   mutex     one mutex taken around each GET, as reads did originally
+//
+// By default every thread reads the same hot cell, the worst case for a
+// shared lock word; -u spreads reads over -r rows instead. -w adds a thread
+// that keeps rewriting the hot cell while the readers run.
+//
+// Usage: ./get_bench [-t max_threads] [-s seconds_per_run] [-r rows] [-u] [-w]
+
+#include "../utils.h"
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <pthread.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+#define BENCH_TABLET "aa_am"
+#define HOT_ROW "cookie"
+#define HOT_COLUMN "session"
+
+enum read_path
+{
+  READ_LOCKFREE,
+  READ_RWLOCK,
+  READ_MUTEX
+};
+
+static unordered_map<string, tablet_data> cache;
+static pthread_mutex_t read_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic<bool> running;
+static atomic<bool> writer_running;
+
+struct reader_args
+{
+  read_path path;
+  bool uniform;
+  int rows;
+  unsigned seed;
+  uint64_t gets = 0;
+  uint64_t misses = 0;
+};
+
+static string row_name(int i)
+{
+  return "ab" + to_string(i);
+}
+
+static void *reader_main(void *arg)
+{
+  reader_args *args = static_cast<reader_args *>(arg);
+  tablet_data &tablet = cache[BENCH_TABLET];
+  F_2_B_Message request;
+  request.type = 1;
+  request.rowkey = HOT_ROW;
+  request.colkey = HOT_COLUMN;
+  while (running.load(memory_order_relaxed))
+  {
+    if (args->uniform)
+    {
+      request.rowkey = row_name(rand_r(&args->seed) % args->rows);
+      request.colkey = "c";
+    }
+    F_2_B_Message response;
+    switch (args->path)
+    {
+    case READ_LOCKFREE:
+      response = handle_get(request, BENCH_TABLET, cache);
+      break;
+    case READ_RWLOCK:
+      pthread_rwlock_rdlock(&tablet.tablet_lock);
+      response = handle_get(request, BENCH_TABLET, cache);
+      pthread_rwlock_unlock(&tablet.tablet_lock);
+      break;
+    case READ_MUTEX:
+      pthread_mutex_lock(&read_mutex);
+      response = handle_get(request, BENCH_TABLET, cache);
+      pthread_mutex_unlock(&read_mutex);
+      break;
+    }
+    args->misses += response.status != 0;
+    args->gets++;
+  }
+  return NULL;
+}
+
+static void *writer_main(void *)
+{
+  tablet_data &tablet = cache[BENCH_TABLET];
+  F_2_B_Message request;
+  request.type = 2;
+  request.rowkey = HOT_ROW;
+  request.colkey = HOT_COLUMN;
+  uint64_t version = 0;
+  while (writer_running.load(memory_order_relaxed))
+  {
+    request.value = "token-" + to_string(version++);
+    lock_tablet_for_write(tablet);
+    row_stripe &stripe = lock_row_for_write(tablet, request.rowkey);
+    handle_put(request, BENCH_TABLET, cache);
+    pthread_mutex_unlock(&stripe.lock);
+    pthread_rwlock_unlock(&tablet.tablet_lock);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Runs one path at one thread count and returns the GETs per second.
+ */
+static double run(read_path path, int threads, double seconds, bool uniform, int rows, uint64_t &misses)
+{
+  vector<reader_args> args(threads);
+  vector<pthread_t> workers(threads);
+  running = true;
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < threads; i++)
+  {
+    args[i].path = path;
+    args[i].uniform = uniform;
+    args[i].rows = rows;
+    args[i].seed = i + 1;
+    pthread_create(&workers[i], NULL, reader_main, &args[i]);
+  }
+  usleep(seconds * 1e6);
+  running = false;
+  uint64_t gets = 0;
+  misses = 0;
+  for (int i = 0; i < threads; i++)
+  {
+    pthread_join(workers[i], NULL);
+    gets += args[i].gets;
+    misses += args[i].misses;
+  }
+  double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  return gets / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+  int max_threads = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  double seconds = 1;
+  int rows = 10000;
+  bool uniform = false;
+  bool with_writer = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:s:r:uw")) != -1)
+  {
+    switch (opt)
+    {
+    case 't':
+      max_threads = atoi(optarg);
+      break;
+    case 's':
+      seconds = atof(optarg);
+      break;
+    case 'r':
+      rows = atoi(optarg);
+      break;
+    case 'u':
+      uniform = true;
+      break;
+    case 'w':
+      with_writer = true;
+      break;
+    default:
+      cerr << "Usage: " << argv[0] << " [-t max_threads] [-s seconds_per_run] [-r rows] [-u] [-w]" << endl;
+      return 1;
+    }
+  }
+
+  tablet_data &tablet = cache[BENCH_TABLET];
+  F_2_B_Message put;
+  put.type = 2;
+  put.rowkey = HOT_ROW;
+  put.colkey = HOT_COLUMN;
+  put.value = "token-initial";
+  handle_put(put, BENCH_TABLET, cache);
+  put.colkey = "c";
+  for (int i = 0; i < rows; i++)
+  {
+    put.rowkey = row_name(i);
+    put.value = "value-" + to_string(i);
+    handle_put(put, BENCH_TABLET, cache);
+  }
+
+  pthread_t writer;
+  if (with_writer)
+  {
+    writer_running = true;
+    pthread_create(&writer, NULL, writer_main, NULL);
+  }
+
+  cout << "CPUs: " << sysconf(_SC_NPROCESSORS_ONLN) << ", workload: "
+       << (uniform ? to_string(rows) + " rows, uniform" : string("one hot cell"))
+       << (with_writer ? ", with a concurrent writer" : "") << endl;
+  cout << setw(8) << "threads" << setw(16) << "lockfree M/s" << setw(16) << "rwlock M/s"
+       << setw(16) << "mutex M/s" << endl;
+  for (int threads = 1; threads <= max_threads; threads *= 2)
+  {
+    cout << setw(8) << threads << fixed << setprecision(2);
+    for (read_path path : {READ_LOCKFREE, READ_RWLOCK, READ_MUTEX})
+    {
+      uint64_t misses;
+      double rate = run(path, threads, seconds, uniform, rows, misses);
+      cout << setw(16) << rate / 1e6;
+      if (misses != 0)
+      {
+        cerr << "unexpected misses: " << misses << endl;
+      }
+    }
+    cout << endl;
+    if (threads < max_threads && threads * 2 > max_threads)
+    {
+      threads = max_threads / 2;
+    }
+  }
+
+  if (with_writer)
+  {
+    writer_running = false;
+    pthread_join(writer, NULL);
+  }
+  epoch_reclaim();
+  cout << "retired versions not yet freed: " << epoch_pending() << endl;
+  return 0;
+}
@@ -0,0 +1,148 @@
+// Memory and latency benchmark of a tablet's in-memory row storage.
+//
+// Fills one tablet through handle_put with -r rows of -c columns each and
+// reports heap bytes per cell (from mallinfo2 plus the value slab's chunks),
+// then the mean latency of PUTs that overwrite a cell and of GETs of random
+// cells.
+// Column names follow the webmail/drive pattern (content_1, content_2, ...).
+//
+// Usage: ./row_bench [-r rows] [-c columns] [-v value_bytes] [-n ops]
+
+#include "../utils.h"
+#include <chrono>
+#include <iostream>
+#include <malloc.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+#define BENCH_TABLET "aa_am"
+
+static unordered_map<string, tablet_data> cache;
+
+static string row_name(int i)
+{
+  return "ab" + to_string(i);
+}
+
+static string column_key(int i)
+{
+  return "content_" + to_string(i);
+}
+
+// Bytes allocated from the heap, large blocks served by mmap included, plus
+// the chunks of the tablet's value slab
+static size_t heap_bytes()
+{
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd + value_slab_bytes(*cache[BENCH_TABLET].values);
+}
+
+/**
+ * @brief Applies a PUT the way the server does, minus the log.
+ */
+static void put_cell(F_2_B_Message &put)
+{
+  tablet_data &tablet = cache[BENCH_TABLET];
+  lock_tablet_for_write(tablet);
+  row_stripe &stripe = lock_row_for_write(tablet, put.rowkey);
+  handle_put(put, BENCH_TABLET, cache);
+  pthread_mutex_unlock(&stripe.lock);
+  pthread_rwlock_unlock(&tablet.tablet_lock);
+}
+
+int main(int argc, char *argv[])
+{
+  int rows = 100000;
+  int columns = 1;
+  int value_bytes = 16;
+  int ops = 1000000;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:c:v:n:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'r':
+      rows = atoi(optarg);
+      break;
+    case 'c':
+      columns = atoi(optarg);
+      break;
+    case 'v':
+      value_bytes = atoi(optarg);
+      break;
+    case 'n':
+      ops = atoi(optarg);
+      break;
+    default:
+      cerr << "Usage: " << argv[0] << " [-r rows] [-c columns] [-v value_bytes] [-n ops]" << endl;
+      return 1;
+    }
+  }
+
+  cache[BENCH_TABLET];
+  F_2_B_Message put;
+  put.type = 2;
+  put.value = string(value_bytes, 'x');
+  size_t heap_before = heap_bytes();
+  for (int r = 0; r < rows; r++)
+  {
+    put.rowkey = row_name(r);
+    for (int c = 0; c < columns; c++)
+    {
+      put.colkey = column_key(c);
+      put_cell(put);
+    }
+  }
+  // Versions replaced while the rows were built are not part of the footprint
+  for (int i = 0; i < 4; i++)
+  {
+    epoch_reclaim();
+  }
+  size_t heap_after = heap_bytes();
+  double cells = double(rows) * columns;
+  cout << rows << " rows x " << columns << " columns, " << value_bytes << "-byte values" << endl;
+  cout << "heap bytes per cell: " << (heap_after - heap_before) / cells << endl;
+
+  // Keys are drawn up front so the timed loops only measure the tablet
+  vector<pair<string, string>> keys(ops);
+  unsigned seed = 1;
+  for (auto &[rowkey, colkey] : keys)
+  {
+    rowkey = row_name(rand_r(&seed) % rows);
+    colkey = column_key(rand_r(&seed) % columns);
+  }
+
+  auto start = chrono::steady_clock::now();
+  for (const auto &[rowkey, colkey] : keys)
+  {
+    put.rowkey = rowkey;
+    put.colkey = colkey;
+    put_cell(put);
+  }
+  double put_ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / ops;
+
+  F_2_B_Message get;
+  get.type = 1;
+  uint64_t misses = 0;
+  reverse(keys.begin(), keys.end());
+  start = chrono::steady_clock::now();
+  for (const auto &[rowkey, colkey] : keys)
+  {
+    get.rowkey = rowkey;
+    get.colkey = colkey;
+    misses += handle_get(get, BENCH_TABLET, cache).status != 0;
+  }
+  double get_ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / ops;
+
+  cout << "PUT mean latency: " << put_ns << " ns" << endl;
+  cout << "GET mean latency: " << get_ns << " ns" << endl;
+  if (misses != 0)
+  {
+    cerr << "unexpected misses: " << misses << endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,142 @@
+// Checks that a pinned tablet snapshot survives checkpoints.
+//
+// Logs writes to a tablet, pins a snapshot the way GET does, checkpoints the
+// tablet and then streams the pinned log with sendfile the way LOGGET does.
+// The stream must hold exactly the bytes the log had when it was pinned.
+// This is run twice: once with nothing logged after the pin, when the
+// checkpoint drops the whole log, and once with writes after the pin.
+//
+// Usage: ./snapshot_test
+// Exits with status 1 if a check fails.
+
+#include "../utils.h"
+#include "../wal.h"
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define TEST_TABLET "aa_am"
+
+static unordered_map<string, tablet_data> cache;
+
+/**
+ * @brief Applies and logs a PUT the way the server does.
+ */
+static void put_cell(tablet_data &tablet, const string &rowkey)
+{
+  F_2_B_Message put;
+  put.type = 2;
+  put.rowkey = rowkey;
+  put.colkey = "content_1";
+  put.value = "value of " + rowkey;
+  lock_tablet_for_write(tablet);
+  row_stripe &stripe = lock_row_for_write(tablet, put.rowkey);
+  handle_put(put, TEST_TABLET, cache);
+  log_message(put, tablet);
+  pthread_mutex_unlock(&stripe.lock);
+  pthread_rwlock_unlock(&tablet.tablet_lock);
+}
+
+/**
+ * @brief Reads a whole file, or up to length bytes of a descriptor.
+ */
+static string read_fd(int fd, off_t length)
+{
+  string data(length, '\0');
+  off_t done = 0;
+  while (done < length)
+  {
+    ssize_t n = pread(fd, data.data() + done, length - done, done);
+    if (n <= 0)
+    {
+      break;
+    }
+    done += n;
+  }
+  data.resize(done);
+  return data;
+}
+
+/**
+ * @brief Streams the first length bytes of a descriptor into a file.
+ *
+ * @return The bytes that arrived, which fall short if the source shrank.
+ */
+static string stream_log(int fd, off_t length, const string &path)
+{
+  int out_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  off_t offset = 0;
+  while (offset < length)
+  {
+    ssize_t n = sendfile(out_fd, fd, &offset, length - offset);
+    if (n <= 0)
+    {
+      break;
+    }
+  }
+  string data = read_fd(out_fd, offset);
+  close(out_fd);
+  remove(path.c_str());
+  return data;
+}
+
+/**
+ * @brief Pins a snapshot, checkpoints and streams the pinned log.
+ *
+ * @param writes_after_pin Writes logged between the pin and the checkpoint.
+ * @return true if the stream matched the log as it was pinned.
+ */
+static bool check_pinned_log(const string &dir, int round, int writes_after_pin)
+{
+  tablet_data &tablet = cache[TEST_TABLET];
+  for (int i = 0; i < 100; i++)
+  {
+    put_cell(tablet, "ab" + to_string(round) + "_" + to_string(i));
+  }
+  wal_flush(tablet.wal);
+
+  shared_ptr<tablet_snapshot> snapshot = pin_tablet_snapshot(tablet, TEST_TABLET, dir);
+  if (snapshot == nullptr || snapshot->log_size == 0)
+  {
+    cerr << "Round " << round << ": failed to pin a snapshot" << endl;
+    return false;
+  }
+  string pinned = read_fd(snapshot->log_fd, snapshot->log_size);
+
+  for (int i = 0; i < writes_after_pin; i++)
+  {
+    put_cell(tablet, "ac" + to_string(round) + "_" + to_string(i));
+  }
+  checkpoint_tablet(tablet, TEST_TABLET, dir);
+
+  string streamed = stream_log(snapshot->log_fd, snapshot->log_size, dir + "/streamed");
+  bool ok = streamed.size() == snapshot->log_size && streamed == pinned;
+  cout << "Round " << round << " (" << writes_after_pin << " writes after the pin): pinned "
+       << snapshot->log_size << " log bytes, streamed " << streamed.size()
+       << (ok ? ", ok" : ", MISMATCH") << endl;
+  return ok;
+}
+
+int main()
+{
+  char dir_template[] = "/tmp/snapshot_test_XXXXXX";
+  string dir = mkdtemp(dir_template);
+  mkdir((dir + "/logs").c_str(), 0755);
+
+  wal_start(WAL_DURABILITY_BATCH);
+  cache.try_emplace(TEST_TABLET);
+  wal_open(cache[TEST_TABLET].wal, dir + "/" + get_log_file_name(TEST_TABLET));
+  recover_tablets(cache, dir);
+
+  bool ok = check_pinned_log(dir, 0, 0);
+  ok = check_pinned_log(dir, 1, 50) && ok;
+
+  system(("rm -rf " + dir).c_str());
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+#include "thread_pool.h"
+#include <iostream>
+
+using namespace std;
+
+/**
+ * @brief Main loop of a pool worker.
+ *
+ * Waits for a task to be queued, pops it and runs it outside the queue lock.
+ * Workers live for the lifetime of the process.
+ *
+ * @param arg Pointer to the owning thread_pool.
+ * @return nullptr
+ */
+static void *worker_main(void *arg)
+{
+  thread_pool *pool = static_cast<thread_pool *>(arg);
+  while (true)
+  {
+    pthread_mutex_lock(&pool->queue_mutex);
+    while (pool->tasks.empty())
+    {
+      pthread_cond_wait(&pool->queue_cond, &pool->queue_mutex);
+    }
+    function<void()> task = std::move(pool->tasks.front());
+    pool->tasks.pop_front();
+    pool->active++;
+    pthread_mutex_unlock(&pool->queue_mutex);
+
+    task();
+
+    pthread_mutex_lock(&pool->queue_mutex);
+    pool->active--;
+    if (pool->active == 0 && pool->tasks.empty())
+    {
+      pthread_cond_broadcast(&pool->idle_cond);
+    }
+    pthread_mutex_unlock(&pool->queue_mutex);
+  }
+  return nullptr;
+}
+
+/**
+ * @brief Initialises the pool and spawns its worker threads.
+ *
+ * @param pool The pool to start.
+ * @param num_threads Number of worker threads to create.
+ */
+void thread_pool_start(thread_pool &pool, int num_threads)
+{
+  pthread_mutex_init(&pool.queue_mutex, NULL);
+  pthread_cond_init(&pool.queue_cond, NULL);
+  pthread_cond_init(&pool.idle_cond, NULL);
+  for (int i = 0; i < num_threads; i++)
+  {
+    pthread_t thd;
+    if (pthread_create(&thd, nullptr, worker_main, &pool) != 0)
+    {
+      cerr << "Failed to create worker thread " << i << endl;
+      continue;
+    }
+    pthread_detach(thd);
+    pool.workers.push_back(thd);
+  }
+}
+
+/**
+ * @brief Queues a task for execution by the pool.
+ *
+ * @param pool The pool to run the task on.
+ * @param task The work to perform.
+ */
+void thread_pool_submit(thread_pool &pool, function<void()> task)
+{
+  pthread_mutex_lock(&pool.queue_mutex);
+  pool.tasks.push_back(std::move(task));
+  pthread_cond_signal(&pool.queue_cond);
+  pthread_mutex_unlock(&pool.queue_mutex);
+}
+
+/**
+ * @brief Waits for the pool to run out of work.
+ *
+ * @param pool The pool to wait on.
+ */
+void thread_pool_wait_idle(thread_pool &pool)
+{
+  pthread_mutex_lock(&pool.queue_mutex);
+  while (pool.active > 0 || !pool.tasks.empty())
+  {
+    pthread_cond_wait(&pool.idle_cond, &pool.queue_mutex);
+  }
+  pthread_mutex_unlock(&pool.queue_mutex);
+}
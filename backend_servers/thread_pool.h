@@ -0,0 +1,34 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <deque>
+#include <functional>
+#include <pthread.h>
+#include <vector>
+
+/**
+ * @brief A fixed set of worker threads draining a shared FIFO of tasks.
+ *
+ * The number of threads is chosen once at start-up and never changes, so the
+ * server's thread count is independent of how many clients are connected.
+ */
+struct thread_pool
+{
+  std::vector<pthread_t> workers;
+  std::deque<std::function<void()>> tasks;
+  int active = 0; // Tasks currently running
+  pthread_mutex_t queue_mutex;
+  pthread_cond_t queue_cond;
+  pthread_cond_t idle_cond; // Signalled when the queue drains completely
+};
+
+// Starts num_threads workers that block on the pool's task queue.
+void thread_pool_start(thread_pool &pool, int num_threads);
+
+// Queues a task; it runs on whichever worker becomes free first.
+void thread_pool_submit(thread_pool &pool, std::function<void()> task);
+
+// Blocks until every queued task has finished running.
+void thread_pool_wait_idle(thread_pool &pool);
+
+#endif // THREAD_POOL_H
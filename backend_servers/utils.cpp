@@ -1,63 +1,478 @@
 #include "utils.h"
 using namespace std;
 
-// Maximum buffer size for data transmission
-const int MAX_BUFFER_SIZE = 1024 * 2 * 10;
-const int WELCOME_BUFFER_SIZE = 1024;
+/**
+ * @brief Initializes a reader-writer lock that prefers writers, so a steady
+ * stream of GETs cannot starve a PUT or a checkpoint.
+ *
+ * Locks set up this way must not be read-locked twice by one thread.
+ *
+ * @param lock The lock to initialize.
+ */
+static void init_writer_preferring_lock(pthread_rwlock_t &lock)
+{
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+row_stripe::row_stripe()
+{
+    pthread_mutex_init(&lock, NULL);
+}
+
+tablet_data::tablet_data() : requests_since_checkpoint(0)
+{
+    init_writer_preferring_lock(tablet_lock);
+    pthread_mutex_init(&lsn_mutex, NULL);
+    pthread_mutex_init(&order_lock, NULL);
+}
 
 /**
- * Reads data from the client socket into the buffer.
+ * @brief Locks a tablet for single-row mutations.
+ *
+ * The tablet lock is only taken shared, so writers to different rows run in
+ * parallel and serialize on their row's stripe instead.
  *
- * @param client_fd The file descriptor of the client socket.
- * @param client_buf The buffer to store the received data.
- * @return bool True if reading is successful, false otherwise.
+ * @param tablet The tablet to lock.
  */
-bool do_read(int client_fd, char *client_buf)
+void lock_tablet_for_write(tablet_data &tablet)
 {
-    size_t n = MAX_BUFFER_SIZE;
-    size_t bytes_left = n;
-    bool r_arrived = false;
+    pthread_rwlock_rdlock(&tablet.tablet_lock);
+}
 
-    while (bytes_left > 0)
-    {
-        ssize_t result = read(client_fd, client_buf + n - bytes_left, 1);
+/**
+ * @brief Locks a whole tablet against every other reader and writer.
+ *
+ * @param tablet The tablet to lock.
+ */
+void lock_tablet_exclusive(tablet_data &tablet)
+{
+    pthread_rwlock_wrlock(&tablet.tablet_lock);
+}
 
-        if (result == -1)
-        {
-            // Handle read errors
-            if ((errno == EINTR) || (errno == EAGAIN))
-            {
-                continue; // Retry if interrupted or non-blocking operation
-            }
-            return false; // Return false for other errors
-        }
-        else if (result == 0)
+tablet_snapshot::~tablet_snapshot()
+{
+    for (int fd : {checkpoint_fd, blob_fd, log_fd})
+    {
+        if (fd >= 0)
         {
-            return false; // Return false if connection closed by client
+            close(fd);
         }
+    }
+}
 
-        // Check if \r\n sequence has arrived
-        if (r_arrived && client_buf[n - bytes_left] == '\n')
-        {
-            client_buf[n - bytes_left + 1] = '\0'; // Null-terminate the string
-            break;                                 // Exit the loop
-        }
-        else
-        {
-            r_arrived = false;
-        }
+/**
+ * @brief Opens a file of a snapshot and takes its current size.
+ *
+ * @param path The file.
+ * @param fd Receives the descriptor, or -1 if the file does not exist.
+ * @param size Receives the size, 0 if the file does not exist.
+ * @return false if the file exists but could not be opened.
+ */
+static bool open_snapshot_file(const std::string &path, int &fd, off_t &size)
+{
+    struct stat st;
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        return fd < 0 && errno == ENOENT;
+    }
+    size = st.st_size;
+    return true;
+}
+
+/**
+ * @brief Pins a point-in-time copy of a tablet for a recovering peer.
+ *
+ * The checkpoint, the blob log it names and the log are opened while the
+ * tablet is locked exclusively, which only waits for writes already under
+ * way. The lock is released before anything is sent: a later checkpoint
+ * renames or removes those files, but the descriptors keep the pinned
+ * versions readable, and records appended to the log after the pin lie
+ * beyond log_size. The peer fetches those with SYNC afterwards.
+ *
+ * @param tablet The tablet.
+ * @param tablet_name The tablet's name.
+ * @param data_file_location The directory holding the tablet's files.
+ * @return The snapshot, or nullptr if a file could not be opened.
+ */
+std::shared_ptr<tablet_snapshot> pin_tablet_snapshot(tablet_data &tablet, const std::string &tablet_name,
+                                                     const std::string &data_file_location)
+{
+    auto snapshot = std::make_shared<tablet_snapshot>();
+    lock_tablet_exclusive(tablet);
+    snapshot->version = tablet.tablet_version;
+    snapshot->last_lsn = tablet.last_lsn;
+    std::string checkpoint_path = data_file_location + "/" + tablet_name + "_" + std::to_string(tablet.tablet_version) + ".txt";
+    bool ok = open_snapshot_file(checkpoint_path, snapshot->checkpoint_fd, snapshot->checkpoint_size);
+    if (ok && tablet.base != nullptr && tablet.base->blobs != nullptr)
+    {
+        ok = open_snapshot_file(tablet.base->blobs->path, snapshot->blob_fd, snapshot->blob_size);
+    }
+    snapshot->log_fd = wal_open_reader(tablet.wal, snapshot->log_size);
+    pthread_rwlock_unlock(&tablet.tablet_lock);
+
+    if (!ok || snapshot->log_fd < 0)
+    {
+        std::cerr << "Failed to pin a snapshot of " << tablet_name << ": " << strerror(errno) << std::endl;
+        return nullptr;
+    }
+    return snapshot;
+}
+
+// Equal to hash<string> of the same key, so either form can be looked up
+static size_t row_hash(string_view rowkey)
+{
+    return hash<string_view>{}(rowkey);
+}
 
-        // Check if \r has arrived
-        if (client_buf[n - bytes_left] == '\r')
+/**
+ * @brief Estimates the bytes a row version holds: its column list and its
+ * values. Column names are interned and not counted.
+ */
+static int64_t row_footprint(const tablet_row *row)
+{
+    if (row == nullptr)
+    {
+        return 0;
+    }
+    int64_t bytes = sizeof(tablet_row) + row->columns.capacity() * sizeof(tablet_row::column);
+    for (const auto &column : *row)
+    {
+        bytes += sizeof(cell_block) + (*column.second).size();
+    }
+    return bytes;
+}
+
+// Accounts for rows brought into or dropped from memory
+static void charge(tablet_data &tablet, int64_t bytes)
+{
+    tablet.resident_bytes += bytes;
+    row_cache_charge(bytes);
+}
+
+// Records an access to a row already in memory, for the eviction clock
+static void touch(row_entry &entry)
+{
+    if (!entry.referenced.load(memory_order_relaxed))
+    {
+        entry.referenced.store(true, memory_order_relaxed);
+    }
+    row_cache_hit();
+}
+
+// The stripe is chosen by the high bits, as the row table probes from the low ones
+static row_stripe &stripe_of(tablet_data &tablet, size_t hash)
+{
+    return tablet.stripes[(hash >> 32) % ROW_LOCK_STRIPES];
+}
+
+/**
+ * @brief Locks the stripe holding a row for a mutation.
+ *
+ * @param tablet The tablet, held at least shared by the caller.
+ * @param rowkey The row to modify.
+ * @return The locked stripe.
+ */
+row_stripe &lock_row_for_write(tablet_data &tablet, string_view rowkey)
+{
+    row_stripe &stripe = stripe_of(tablet, row_hash(rowkey));
+    pthread_mutex_lock(&stripe.lock);
+    return stripe;
+}
+
+/**
+ * @brief Locks the stripes of several rows for a mutation, in stripe order so
+ * two batches never wait on each other's stripes.
+ *
+ * @param tablet The tablet, held at least shared by the caller.
+ * @param rowkeys The rows to modify; may repeat.
+ * @return The locked stripes, each once.
+ */
+vector<row_stripe *> lock_rows_for_write(tablet_data &tablet, const vector<string> &rowkeys)
+{
+    vector<row_stripe *> stripes;
+    for (const string &rowkey : rowkeys)
+    {
+        stripes.push_back(&stripe_of(tablet, row_hash(rowkey)));
+    }
+    sort(stripes.begin(), stripes.end());
+    stripes.erase(unique(stripes.begin(), stripes.end()), stripes.end());
+    for (row_stripe *stripe : stripes)
+    {
+        pthread_mutex_lock(&stripe->lock);
+    }
+    return stripes;
+}
+
+/**
+ * @brief Finds a row's entry, creating it from the checkpoint file if the row
+ * is not in memory yet.
+ *
+ * A row the checkpoint does not hold gets an entry too, with no version, so
+ * later reads of a missing row do not search the file again. New entries are
+ * added to the tablet's ordered index as well, and count as cache misses.
+ *
+ * @param tablet The tablet, locked by the caller.
+ * @param rowkey The row to find.
+ * @param hash The rowkey's hash.
+ * @return The entry.
+ */
+static row_entry &load_row_entry(tablet_data &tablet, string_view rowkey, size_t hash)
+{
+    row_index &index = stripe_of(tablet, hash).index;
+    row_entry *entry = row_index_find(index, rowkey, hash);
+    if (entry != nullptr)
+    {
+        touch(*entry);
+        return *entry;
+    }
+    row_cache_miss();
+    tablet_row row;
+    shared_ptr<const tablet_row> version;
+    if (tablet.base != nullptr && checkpoint_find_row(*tablet.base, rowkey, row, tablet.values))
+    {
+        version = make_shared<const tablet_row>(move(row));
+    }
+    charge(tablet, ROW_ENTRY_OVERHEAD + row_footprint(version.get()));
+    entry = row_index_insert(index, rowkey, hash, move(version));
+    pthread_mutex_lock(&tablet.order_lock);
+    tablet.ordered_rows.emplace(entry->rowkey, entry);
+    pthread_mutex_unlock(&tablet.order_lock);
+    return *entry;
+}
+
+/**
+ * @brief Looks up a row under the writer locks.
+ *
+ * A row that has not been touched since the tablet was loaded is decoded
+ * from the checkpoint file and kept in memory from then on.
+ *
+ * @param tablet The tablet, locked by the caller along with the row's stripe.
+ * @param rowkey The row to find.
+ * @return The row's current version, or nullptr if it does not exist.
+ */
+const tablet_row *find_row(tablet_data &tablet, string_view rowkey)
+{
+    return load_row_entry(tablet, rowkey, row_hash(rowkey)).owner.get();
+}
+
+/**
+ * @brief Looks up a row without taking any lock.
+ *
+ * Only a row that is not in memory yet needs the tablet and stripe locks,
+ * once, to be loaded from the checkpoint file.
+ *
+ * @param tablet The tablet; the caller holds an epoch_guard and no lock on it.
+ * @param rowkey The row to find.
+ * @return The row's current version, valid until the guard is left, or
+ * nullptr if it does not exist.
+ */
+const tablet_row *read_row(tablet_data &tablet, string_view rowkey)
+{
+    size_t hash = row_hash(rowkey);
+    row_stripe &stripe = stripe_of(tablet, hash);
+    row_entry *entry = row_index_find(stripe.index, rowkey, hash);
+    if (entry != nullptr)
+    {
+        touch(*entry);
+    }
+    else
+    {
+        pthread_rwlock_rdlock(&tablet.tablet_lock);
+        pthread_mutex_lock(&stripe.lock);
+        entry = &load_row_entry(tablet, rowkey, hash);
+        pthread_mutex_unlock(&stripe.lock);
+        pthread_rwlock_unlock(&tablet.tablet_lock);
+    }
+    return entry->row.load(memory_order_acquire);
+}
+
+/**
+ * @brief Publishes a new version of a row, creating the row if needed.
+ *
+ * The new version starts as a copy of the current one, which readers and
+ * snapshots keep seeing until it is replaced. The row stays in memory until
+ * a checkpoint has written it out.
+ *
+ * @param tablet The tablet, locked by the caller along with the row's stripe.
+ * @param rowkey The row to modify.
+ * @param change Applied to the new version before it is published.
+ */
+void update_row(tablet_data &tablet, string_view rowkey, const function<void(tablet_row &)> &change)
+{
+    row_entry &entry = load_row_entry(tablet, rowkey, row_hash(rowkey));
+    auto row = entry.owner ? make_shared<tablet_row>(*entry.owner) : make_shared<tablet_row>();
+    change(*row);
+    entry.last_write = tablet.write_generation;
+    charge(tablet, row_footprint(row.get()) - row_footprint(entry.owner.get()));
+    row_index_publish(entry, move(row));
+}
+
+/**
+ * @brief Takes a snapshot of a tablet's in-memory rows.
+ *
+ * Each stripe is locked only while its row versions are collected. Versions
+ * are immutable, so the snapshot is unaffected by later writes.
+ *
+ * @param tablet The tablet, held at least shared by the caller.
+ * @return The current version of every row in memory.
+ */
+tablet_rows snapshot_rows(tablet_data &tablet)
+{
+    tablet_rows snapshot;
+    for (row_stripe &stripe : tablet.stripes)
+    {
+        pthread_mutex_lock(&stripe.lock);
+        row_index_for_each(stripe.index, [&](const row_entry &entry)
+                           {
+                               if (entry.owner)
+                               {
+                                   snapshot.emplace(entry.rowkey, entry.owner);
+                               }
+                           });
+        pthread_mutex_unlock(&stripe.lock);
+    }
+    return snapshot;
+}
+
+/**
+ * @brief Visits the rows of a tablet in rowkey order within a range.
+ *
+ * The in-memory rows come from the ordered index and take precedence over
+ * the checkpoint file, which is read from start onwards only. Neither side
+ * is copied: at most limit live in-memory rows are collected, which is
+ * enough, since the scan can never get past the last of them. The tablet
+ * lock is held only while they are collected.
+ *
+ * @param tablet The tablet; the caller holds no lock on it.
+ * @param start The first row to visit.
+ * @param end The row to stop before, or empty for the end of the tablet.
+ * @param limit The most rows to visit.
+ * @param visit Called with each row key and row.
+ */
+void scan_rows(tablet_data &tablet, const string &start, const string &end, size_t limit,
+               const function<void(const string &, const tablet_row &)> &visit)
+{
+    auto in_range = [&](string_view rowkey)
+    { return end.empty() || rowkey < end; };
+
+    // Versions read here stay valid until the guard is left
+    epoch_guard guard;
+    vector<pair<string_view, const tablet_row *>> rows;
+    size_t live = 0;
+    pthread_rwlock_rdlock(&tablet.tablet_lock);
+    shared_ptr<checkpoint_file> base = tablet.base;
+    pthread_mutex_lock(&tablet.order_lock);
+    for (auto it = tablet.ordered_rows.lower_bound(start);
+         it != tablet.ordered_rows.end() && in_range(it->first) && live < limit; ++it)
+    {
+        const tablet_row *row = it->second->row.load(memory_order_acquire);
+        rows.emplace_back(it->first, row);
+        live += row != nullptr && row->size() > 0;
+    }
+    pthread_mutex_unlock(&tablet.order_lock);
+    pthread_rwlock_unlock(&tablet.tablet_lock);
+
+    // Rows that were deleted or never existed are known only by their entry
+    size_t visited = 0;
+    auto emit = [&](string_view rowkey, const tablet_row *row)
+    {
+        if (row != nullptr && row->size() > 0)
         {
-            r_arrived = true;
+            visit(string(rowkey), *row);
+            visited++;
         }
+        return visited < limit;
+    };
+
+    size_t next = 0;
+    bool more = limit > 0;
+    if (more && base != nullptr)
+    {
+        checkpoint_scan(*base, start, [&](const string &rowkey, const tablet_row &row)
+                        {
+                            if (!in_range(rowkey))
+                            {
+                                return false;
+                            }
+                            for (; next < rows.size() && rows[next].first < rowkey; next++)
+                            {
+                                if (!emit(rows[next].first, rows[next].second))
+                                {
+                                    more = false;
+                                    return false;
+                                }
+                            }
+                            if (next < rows.size() && rows[next].first == rowkey)
+                            {
+                                more = emit(rowkey, rows[next++].second);
+                            }
+                            else
+                            {
+                                more = emit(rowkey, &row);
+                            }
+                            return more; });
+    }
+    for (; more && next < rows.size(); next++)
+    {
+        more = emit(rows[next].first, rows[next].second);
+    }
+}
 
-        bytes_left -= result; // Update bytes_left counter
+// The rows of a snapshot in rowkey order
+static vector<const tablet_rows::value_type *> sort_rows(const tablet_rows &rows)
+{
+    vector<const tablet_rows::value_type *> sorted;
+    sorted.reserve(rows.size());
+    for (const auto &entry : rows)
+    {
+        sorted.push_back(&entry);
     }
+    sort(sorted.begin(), sorted.end(), [](const auto *a, const auto *b)
+         { return a->first < b->first; });
+    return sorted;
+}
 
-    client_buf[MAX_BUFFER_SIZE - 1] = '\0'; // Null-terminate the string
-    return true;                            // Return true indicating successful reading
+/**
+ * @brief Visits every row of a tablet in rowkey order.
+ *
+ * In-memory rows take precedence over the same rows in the checkpoint
+ * file; checkpointed rows are decoded one at a time and never materialized.
+ *
+ * @param rows The tablet's in-memory rows (or a snapshot of them).
+ * @param base The tablet's checkpoint file, or nullptr.
+ * @param visit Called with each row key and row.
+ */
+void for_each_row(const tablet_rows &rows, const checkpoint_file *base,
+                  const function<void(const string &, const tablet_row &)> &visit)
+{
+    vector<const tablet_rows::value_type *> sorted = sort_rows(rows);
+    size_t next = 0;
+    if (base != nullptr)
+    {
+        checkpoint_for_each_row(*base, [&](const string &rowkey, const tablet_row &row)
+                                {
+                                    while (next < sorted.size() && sorted[next]->first < rowkey)
+                                    {
+                                        visit(sorted[next]->first, *sorted[next]->second);
+                                        next++;
+                                    }
+                                    if (next < sorted.size() && sorted[next]->first == rowkey)
+                                    {
+                                        visit(rowkey, *sorted[next]->second);
+                                        next++;
+                                        return;
+                                    }
+                                    visit(rowkey, row); });
+    }
+    for (; next < sorted.size(); next++)
+    {
+        visit(sorted[next]->first, *sorted[next]->second);
+    }
 }
 
 /**
@@ -69,12 +484,15 @@ bool do_read(int client_fd, char *client_buf)
  */
 F_2_B_Message handle_get(F_2_B_Message message, string tablet_name, unordered_map<string, tablet_data> &cache)
 {
-    if (cache[tablet_name].row_to_kv.contains(message.rowkey))
+    // No lock: the row version read here stays valid while the guard is held
+    epoch_guard guard;
+    const tablet_row *row = read_row(cache[tablet_name], message.rowkey);
+    if (row != nullptr)
     {
-        if (cache[tablet_name].row_to_kv[message.rowkey].contains(message.colkey))
+        auto col = row->find(message.colkey);
+        if (col != row->end())
         {
-            message.value =
-                cache[tablet_name].row_to_kv[message.rowkey][message.colkey];
+            message.value = *col->second;
             message.status = 0;
             message.errorMessage.clear();
         }
@@ -103,7 +521,9 @@ F_2_B_Message handle_get(F_2_B_Message message, string tablet_name, unordered_ma
 F_2_B_Message handle_put(F_2_B_Message message, string tablet_name, unordered_map<string, tablet_data> &cache)
 {
     // std::cout << tablet_name << " " << message.rowkey << " " << message.colkey << " " << message.value;
-    cache[tablet_name].row_to_kv[message.rowkey][message.colkey] = message.value;
+    cell_value value = make_cell_value(cache[tablet_name].values, message.value);
+    update_row(cache[tablet_name], message.rowkey, [&](tablet_row &row)
+               { row[message.colkey] = value; });
     message.status = 0;
     message.errorMessage = "Data written successfully";
     return message;
@@ -118,15 +538,17 @@ F_2_B_Message handle_put(F_2_B_Message message, string tablet_name, unordered_ma
  */
 F_2_B_Message handle_cput(F_2_B_Message message, string tablet_name, unordered_map<string, tablet_data> &cache)
 {
-    if (cache[tablet_name].row_to_kv.contains(message.rowkey))
+    const tablet_row *row = find_row(cache[tablet_name], message.rowkey);
+    if (row != nullptr)
     {
-        if (cache[tablet_name].row_to_kv[message.rowkey].contains(message.colkey))
+        auto col = row->find(message.colkey);
+        if (col != row->end())
         {
-            if (cache[tablet_name].row_to_kv[message.rowkey][message.colkey] ==
-                message.value)
+            if (*col->second == message.value)
             {
-                cache[tablet_name].row_to_kv[message.rowkey][message.colkey] =
-                    message.value2;
+                cell_value value = make_cell_value(cache[tablet_name].values, message.value2);
+                update_row(cache[tablet_name], message.rowkey, [&](tablet_row &row)
+                           { row[message.colkey] = value; });
                 message.status = 0;
                 message.errorMessage = "Colkey updated successfully";
             }
@@ -161,10 +583,13 @@ F_2_B_Message handle_cput(F_2_B_Message message, string tablet_name, unordered_m
  */
 F_2_B_Message handle_delete(F_2_B_Message message, string tablet_name, unordered_map<string, tablet_data> &cache)
 {
-    if (cache[tablet_name].row_to_kv.contains(message.rowkey))
+    const tablet_row *row = find_row(cache[tablet_name], message.rowkey);
+    if (row != nullptr)
     {
-        if (cache[tablet_name].row_to_kv[message.rowkey].erase(message.colkey))
+        if (row->contains(message.colkey))
         {
+            update_row(cache[tablet_name], message.rowkey, [&](tablet_row &row)
+                       { row.erase(message.colkey); });
             message.status = 0;
             message.errorMessage = "Colkey deleted successfully";
         }
@@ -184,16 +609,6 @@ F_2_B_Message handle_delete(F_2_B_Message message, string tablet_name, unordered
     return message;
 }
 
-void trim_trailing_whitespaces(string &str)
-{
-    // Find the last character that's not a whitespace
-    auto it = find_if(str.rbegin(), str.rend(), [](unsigned char ch)
-                      { return !isspace(ch); });
-
-    // Erase trailing whitespaces
-    str.erase(it.base(), str.end());
-}
-
 /**
  * @brief Generates the log file name for a given tablet data file.
  *
@@ -214,135 +629,287 @@ std::string get_log_file_name(const std::string &filename)
 }
 
 /**
- * @brief Logs a message to the specified tablet's log file.
+ * @brief Generates the file name of one of a tablet's blob logs.
  *
- * This function serializes an F_2_B_Message, constructs the log file path,
- * and appends the serialized message to the log file. It ensures the log file
- * is correctly opened and checks for write errors.
+ * The ".dat" extension keeps blob logs apart from the "_<version>.txt"
+ * checkpoints in the same directory.
  *
- * @param f2b_message The message to be logged.
- * @param data_file_location The directory location of the log files.
- * @param tablet_name The name of the tablet associated with the log.
+ * @param tablet_name The tablet's range.
+ * @param id The blob log's id.
+ * @return The file name, relative to the data directory.
  */
-void log_message(const F_2_B_Message &f2b_message, string data_file_location, string tablet_name)
+std::string get_blob_log_file_name(const std::string &tablet_name, uint32_t id)
 {
-    // Serialize the message using the provided serialize function
-    string serialized_message = encode_message(f2b_message);
-    trim_trailing_whitespaces(serialized_message);
-
-    // Construct the full path to the log file
-    string log_file_path = data_file_location + "/" + get_log_file_name(tablet_name);
-
-    // Open the log file in append mode
-    ofstream log_file(log_file_path, ios::app);
+    return tablet_name + "_blobs_" + std::to_string(id) + ".dat";
+}
 
-    // Check if the file is open
-    if (!log_file.is_open())
+/**
+ * @brief Appends a message to the tablet's write-ahead log.
+ *
+ * The message is given the tablet's next LSN and encoded as a binary record.
+ * The caller holds the lock of every row the message writes, so the records
+ * of one row follow the order in which its writes are applied; lsn_mutex
+ * keeps LSNs increasing through the file when writers in other stripes log
+ * at the same time. The record only joins the log's pending group here;
+ * the group-commit thread writes and syncs it. Callers that must not
+ * acknowledge the write before it is durable pass the returned ticket to
+ * wal_wait_durable, after releasing their locks so other writers can join
+ * the same group.
+ *
+ * @param f2b_message The message to be logged.
+ * @param tablet The tablet whose log receives the record.
+ * @param on_logged If set, called with the record before lsn_mutex is
+ *        released, so successive calls see the tablet's records in LSN order.
+ * @return The ticket identifying the record in the tablet's log.
+ */
+uint64_t log_message(const F_2_B_Message &f2b_message, tablet_data &tablet,
+                     const std::function<void(uint64_t lsn, const std::string &record)> &on_logged)
+{
+    pthread_mutex_lock(&tablet.lsn_mutex);
+    uint64_t lsn = ++tablet.last_lsn;
+    std::string record = encode_wal_record(lsn, f2b_message);
+    uint64_t ticket = wal_append(tablet.wal, record);
+    if (on_logged)
     {
-        cerr << "Failed to open log file: " << log_file_path << endl;
-        return;
+        on_logged(lsn, record);
     }
+    pthread_mutex_unlock(&tablet.lsn_mutex);
+    return ticket;
+}
 
-    // Write the serialized message to a new line in the log file
-    log_file << serialized_message << endl;
-
-    // Optionally check for write errors
-    if (log_file.fail())
+/**
+ * @brief Writes a tablet snapshot as a sorted checkpoint file and syncs it.
+ *
+ * Rows of the base checkpoint that the snapshot does not replace are copied
+ * without decoding them when they point into the same blob log, so their
+ * large values are neither read nor written again. Otherwise, for a base
+ * from an older server or when moving to a new blob log, they are decoded
+ * and added again, which appends their large values to blobs.
+ *
+ * @param rows The snapshot's in-memory rows.
+ * @param base The checkpoint file the snapshot was taken on top of, or nullptr.
+ * @param blobs The log large values are stored in, or nullptr to keep them
+ * inline.
+ * @param file_path The checkpoint file to create.
+ * @param last_lsn The LSN of the newest logged write the snapshot includes.
+ * @return true if the file and the blob log were written and synced.
+ */
+bool save_tablet(const tablet_rows &rows, const checkpoint_file *base, blob_log *blobs, const std::string &file_path,
+                 uint64_t last_lsn)
+{
+    checkpoint_writer writer;
+    if (!checkpoint_writer_open(writer, file_path, blobs))
     {
-        cerr << "Failed to write to log file: " << log_file_path << endl;
+        return false;
     }
+    writer.last_lsn = last_lsn;
+    if (base == nullptr || !checkpoint_can_copy(*base, blobs))
+    {
+        for_each_row(rows, base, [&](const string &rowkey, const tablet_row &row)
+                     { checkpoint_writer_add(writer, rowkey, row); });
+    }
+    else
+    {
+        // The merge of for_each_row, with the base rows left encoded
+        vector<const tablet_rows::value_type *> sorted = sort_rows(rows);
+        size_t next = 0;
+        checkpoint_for_each_encoded_row(*base, [&](const string &rowkey, const encoded_row &row)
+                                        {
+                                            for (; next < sorted.size() && sorted[next]->first < rowkey; next++)
+                                            {
+                                                checkpoint_writer_add(writer, sorted[next]->first, *sorted[next]->second);
+                                            }
+                                            if (next < sorted.size() && sorted[next]->first == rowkey)
+                                            {
+                                                checkpoint_writer_add(writer, rowkey, *sorted[next++]->second);
+                                                return;
+                                            }
+                                            checkpoint_writer_add_encoded(writer, rowkey, row); });
+        for (; next < sorted.size(); next++)
+        {
+            checkpoint_writer_add(writer, sorted[next]->first, *sorted[next]->second);
+        }
+    }
+    // The log prefix is dropped once this returns, so the data must be on disk
+    if (!checkpoint_writer_finish(writer))
+    {
+        std::cerr << "Failed to write file: " << file_path << std::endl;
+        return false;
+    }
+    return true;
+}
 
-    // Close the log file
-    log_file.close();
+/**
+ * @brief Decides whether a tablet should be checkpointed now.
+ *
+ * A tablet with new writes is due once it has logged more than
+ * CHECKPOINT_SIZE ops or CHECKPOINT_LOG_BYTES bytes, once
+ * CHECKPOINT_INTERVAL_SECONDS have passed since its last checkpoint, or as
+ * soon as the node is over its memory budget. Any tablet is due once its
+ * blob log holds enough garbage to be rewritten.
+ *
+ * @param tablet The tablet, locked by the caller.
+ * @return true if a checkpoint is due.
+ */
+bool checkpoint_due(tablet_data &tablet)
+{
+    if (tablet.requests_since_checkpoint == 0)
+    {
+        // With no new writes, a checkpoint only serves to collect garbage
+        return tablet.blobs != nullptr && (tablet.blobs->failed || blob_log_gc_due(*tablet.blobs));
+    }
+    // Over the memory budget, rows that are only in memory must be written
+    // out before they can be evicted
+    return tablet.requests_since_checkpoint > CHECKPOINT_SIZE ||
+           wal_size(tablet.wal) > CHECKPOINT_LOG_BYTES ||
+           row_cache_excess() > 0 ||
+           time(NULL) - tablet.last_checkpoint >= CHECKPOINT_INTERVAL_SECONDS;
 }
 
 /**
- * @brief Clears the contents of the specified log file.
+ * @brief Drops cold rows that the tablet's checkpoint file also holds.
  *
- * This function truncates the log file, effectively clearing its contents,
- * and confirms the successful clearance of the logs.
+ * The eviction clock visits the stripes in turn, EVICTION_SWEEP_STEPS
+ * entries at a time with one stripe locked, for at most two laps of the
+ * tablet: one to clear the marks of rows used since the last sweep and one
+ * to evict the rows still unmarked. Rows changed since the last checkpoint
+ * are skipped. An evicted row is decoded from the file again on its next
+ * access.
  *
- * @param folderPath The path to the directory containing the log file.
- * @param fileName The name of the log file to be cleared.
+ * @param tablet The tablet; the caller holds no lock on it.
+ * @param bytes The estimated bytes to free.
+ * @return The estimated bytes freed.
  */
-void clearLogFile(const string &folderPath, string &fileName)
+size_t evict_rows(tablet_data &tablet, size_t bytes)
 {
-    string filePath = folderPath + "/" + fileName;
-    ofstream ofs(filePath, ofstream::out | ofstream::trunc);
-    ofs.close();
-    cout << "Logs cleared successfully." << endl;
+    size_t freed = 0;
+    size_t evicted = 0;
+    pthread_rwlock_rdlock(&tablet.tablet_lock);
+    pthread_mutex_lock(&tablet.order_lock);
+    size_t steps = 2 * tablet.ordered_rows.size();
+    pthread_mutex_unlock(&tablet.order_lock);
+    while (freed < bytes && steps > 0)
+    {
+        row_stripe &stripe = tablet.stripes[tablet.eviction_stripe++ % ROW_LOCK_STRIPES];
+        pthread_mutex_lock(&stripe.lock);
+        evicted += row_index_sweep(stripe.index, EVICTION_SWEEP_STEPS, [&](const row_entry &entry)
+                                   {
+                                       if (freed >= bytes || entry.last_write >= tablet.clean_before)
+                                       {
+                                           return false;
+                                       }
+                                       freed += ROW_ENTRY_OVERHEAD + row_footprint(entry.owner.get());
+                                       pthread_mutex_lock(&tablet.order_lock);
+                                       tablet.ordered_rows.erase(entry.rowkey);
+                                       pthread_mutex_unlock(&tablet.order_lock);
+                                       return true; });
+        pthread_mutex_unlock(&stripe.lock);
+        steps -= min<size_t>(steps, EVICTION_SWEEP_STEPS);
+    }
+    pthread_rwlock_unlock(&tablet.tablet_lock);
+    charge(tablet, -int64_t(freed));
+    row_cache_evicted(evicted);
+    return freed;
 }
 
 /**
- * @brief Saves the tablet data to a new file version and removes the old version.
+ * @brief Checkpoints a tablet without holding its lock while writing.
  *
- * This function increments the tablet version, writes the current tablet data
- * to a new file with the updated version number, and deletes the old version
- * of the file. It ensures the directory exists and handles file operations safely.
+ * The tablet lock is held exclusively twice, briefly: once to take a copy-on-write
+ * snapshot (the row pointers, the op count, the last LSN and the log size at that point),
+ * and once to install the new version and drop the log prefix the snapshot
+ * covers. The new version file is written and synced in between, and so is
+ * a new log file holding the rest of the log, while readers and writers
+ * carry on; under the lock only the records logged meanwhile are copied. A recovering peer does not hold it up: its
+ * snapshot keeps the old version, blob log and log open, and the old files
+ * are only renamed over or removed.
  *
- * @param checkpoint_tablet_data The data of the tablet to be saved.
+ * This is also where the blob log is garbage collected: once enough of it
+ * is garbage, the checkpoint stores every live large value in a new log,
+ * and the old log is deleted with the old version.
+ *
+ * @param checkpoint_tablet_data The data of the tablet to be checkpointed.
  * @param tablet_name The name of the tablet.
  * @param data_file_location The directory location to save the tablet files.
  */
-void save_tablet(tablet_data &checkpoint_tablet_data, const std::string &tablet_name, const std::string &data_file_location)
+void checkpoint_tablet(tablet_data &checkpoint_tablet_data, string tablet_name, std::string data_file_location)
 {
-    // Ensure the directory exists
-    mkdir(data_file_location.c_str(), 0777);
+    std::string base_filename = tablet_name.substr(0, tablet_name.find_last_of('.'));
 
-    // Increment the version number for the new save
+    lock_tablet_exclusive(checkpoint_tablet_data);
+    tablet_rows snapshot = snapshot_rows(checkpoint_tablet_data);
+    shared_ptr<checkpoint_file> snapshot_base = checkpoint_tablet_data.base;
+    int covered_requests = checkpoint_tablet_data.requests_since_checkpoint;
+    uint64_t covered_log_bytes = wal_size(checkpoint_tablet_data.wal);
+    // Writers log under the shared lock, so no LSN is being handed out
+    uint64_t covered_lsn = checkpoint_tablet_data.last_lsn;
     int current_version = checkpoint_tablet_data.tablet_version;
-    int new_version = current_version + 1;
+    uint64_t covered_generation = checkpoint_tablet_data.write_generation++;
+    shared_ptr<blob_log> old_blobs = checkpoint_tablet_data.blobs;
+    shared_ptr<blob_log> blobs = old_blobs;
+    // A log that failed a write may hold garbage where values were expected
+    bool new_blob_log = blobs->failed || blob_log_gc_due(*blobs);
+    if (new_blob_log)
+    {
+        uint32_t id = ++checkpoint_tablet_data.last_blob_log_id;
+        blobs = blob_log_create(id, data_file_location + "/" + get_blob_log_file_name(base_filename, id));
+    }
+    pthread_rwlock_unlock(&checkpoint_tablet_data.tablet_lock);
 
     // Construct file paths with version numbers
-    std::string base_filename = tablet_name.substr(0, tablet_name.find_last_of('.'));
+    mkdir(data_file_location.c_str(), 0777);
     std::string old_file_path = data_file_location + "/" + base_filename + "_" + std::to_string(current_version) + ".txt";
-    std::string new_file_path = data_file_location + "/" + base_filename + "_" + std::to_string(new_version) + ".txt";
+    std::string new_file_path = data_file_location + "/" + base_filename + "_" + std::to_string(current_version + 1) + ".txt";
 
-    // Create and open the new version of the file
-    std::ofstream new_file(new_file_path);
-    if (!new_file.is_open())
+    bool saved = save_tablet(snapshot, snapshot_base.get(), blobs.get(), new_file_path, covered_lsn);
+    // Let writers stop copying the rows the snapshot shared
+    snapshot.clear();
+    snapshot_base.reset();
+    shared_ptr<checkpoint_file> new_base = saved ? open_checkpoint_file(new_file_path) : nullptr;
+    if (new_base == nullptr)
     {
-        std::cerr << "Failed to open file: " << new_file_path << std::endl;
+        std::remove(new_file_path.c_str());
+        if (new_blob_log)
+        {
+            std::remove(blobs->path.c_str());
+        }
         return;
     }
+    new_base->blobs = blobs;
+    blobs->live_bytes = new_base->blob_bytes;
+    wal_tail log_tail;
+    bool tail_copied = wal_copy_tail(checkpoint_tablet_data.wal, covered_log_bytes, log_tail);
 
-    // Write the data to the new version of the file
-    for (const auto &row : checkpoint_tablet_data.row_to_kv)
+    lock_tablet_exclusive(checkpoint_tablet_data);
+    checkpoint_tablet_data.tablet_version = current_version + 1;
+    checkpoint_tablet_data.base = new_base;
+    checkpoint_tablet_data.blobs = blobs;
+    checkpoint_tablet_data.requests_since_checkpoint -= covered_requests;
+    checkpoint_tablet_data.last_checkpoint = time(NULL);
+    checkpoint_tablet_data.clean_before = covered_generation + 1;
+    if (tail_copied)
     {
-        for (const auto &kv : row.second)
-        {
-            new_file << row.first << " " << kv.first << " " << kv.second << "\n";
-        }
+        wal_install_tail(checkpoint_tablet_data.wal, log_tail);
     }
+    pthread_rwlock_unlock(&checkpoint_tablet_data.tablet_lock);
 
-    // Close the new file
-    new_file.close();
-
-    // Update the current version number
-    checkpoint_tablet_data.tablet_version = new_version;
+    // Values overwritten since the last checkpoint have mostly been reclaimed
+    // by now; hand the chunks they emptied back to the system in one go
+    epoch_reclaim();
+    value_slab_trim(*checkpoint_tablet_data.values);
 
     // Remove the old version of the file if it exists
     if (std::remove(old_file_path.c_str()) != 0)
     {
         std::cerr << "Error deleting old file: " << old_file_path << std::endl;
     }
-}
-
-/**
- * @brief Checkpoints the tablet data and clears the corresponding log file.
- *
- * This function saves the current state of the tablet data to a new file version,
- * updates the tablet version, and clears the associated log file.
- *
- * @param checkpoint_tablet_data The data of the tablet to be checkpointed.
- * @param tablet_name The name of the tablet.
- * @param data_file_location The directory location to save the tablet files.
- */
-void checkpoint_tablet(tablet_data &checkpoint_tablet_data, string tablet_name, std::string data_file_location)
-{
-    string tablet_log_file = get_log_file_name(tablet_name);
-    save_tablet(checkpoint_tablet_data, tablet_name, data_file_location);
-    clearLogFile(data_file_location, tablet_log_file);
+    // Readers still holding the old version keep the old log open
+    if (new_blob_log)
+    {
+        std::remove(old_blobs->path.c_str());
+        std::cout << "Moved " << blobs->size << " of " << old_blobs->size << " blob log bytes of "
+                  << tablet_name << " to " << blobs->path << std::endl;
+    }
 }
 
 /**
@@ -390,182 +957,340 @@ std::string get_new_file_name(const std::string &row_key, const std::vector<std:
 }
 
 /**
- * @brief Loads the cache with tablet data from files in the specified directory.
+ * @brief Reads a checkpoint written by an older server, one "row col value"
+ * line per cell, into the tablet's in-memory rows.
  *
- * This function iterates through each tablet in the cache, reads the corresponding
- * files in the directory, and loads the data into the cache. It updates the tablet
- * version and ensures an initial file exists if no files are found.
- *
- * @param cache The cache to be loaded with tablet data.
- * @param data_file_location The directory location of the tablet files.
+ * @param tablet The tablet to fill.
+ * @param file_path The text checkpoint.
  */
-void load_cache(std::unordered_map<std::string, tablet_data> &cache, std::string data_file_location)
+static void load_text_checkpoint(tablet_data &tablet, const std::string &file_path)
 {
-    // Iterate through each entry in the cache map
-    for (auto &entry : cache)
+    std::ifstream file(file_path);
+    std::string line;
+    // Rows are built in full and published once each
+    std::unordered_map<std::string, tablet_row> rows;
+    while (getline(file, line))
     {
-        entry.second.tablet_version = 0;
-        // Create the base filename from entry.first by removing the extension
-        std::string base_filename = entry.first.substr(0, entry.first.find_last_of('.'));
+        std::stringstream ss(line);
+        std::string key, inner_key, value;
+
+        ss >> key >> inner_key;
+        std::getline(ss, value);
 
-        // Directory reading objects
-        DIR *dir;
-        struct dirent *ent;
-        std::string dir_path = data_file_location;
-        bool file_found = false;
+        value = std::regex_replace(value, std::regex("^ +| +$|( ) +"), "$1");
+        rows[key][inner_key] = make_cell_value(tablet.values, value);
+    }
+    for (auto &[key, row] : rows)
+    {
+        update_row(tablet, key, [&](tablet_row &current)
+                   { current = move(row); });
+    }
+}
 
-        // Open the directory
-        if ((dir = opendir(dir_path.c_str())) != NULL)
+/**
+ * @brief Lists the data directory once and finds each tablet's newest
+ * checkpoint version.
+ *
+ * @param data_file_location The directory holding <range>_<version>.txt files.
+ * @return The highest version found for each range.
+ */
+static std::unordered_map<std::string, int> find_checkpoint_versions(const std::string &data_file_location)
+{
+    std::unordered_map<std::string, int> versions;
+    DIR *dir = opendir(data_file_location.c_str());
+    if (dir == NULL)
+    {
+        std::cerr << "Could not open directory: " << data_file_location << std::endl;
+        return versions;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        std::string file_name = ent->d_name;
+        size_t underscore = file_name.find_last_of('_');
+        if (file_name.size() < 4 || file_name.compare(file_name.size() - 4, 4, ".txt") != 0 ||
+            underscore == std::string::npos)
         {
-            // Read all the files and directories within the directory
-            while ((ent = readdir(dir)) != NULL)
-            {
-                std::string file_name = std::string(ent->d_name);
-
-                // Check if the file starts with the base_filename and ends with ".txt"
-                if (file_name.find(base_filename + "_") == 0 && file_name.rfind(".txt") == file_name.length() - 4)
-                {
-                    file_found = true;
-
-                    // Extract the version number from the filename
-                    std::string version_str = file_name.substr(base_filename.length() + 1, file_name.rfind(".txt") - base_filename.length() - 1);
-                    int version_number = std::stoi(version_str);
-
-                    // Update the tablet version to the maximum version found
-                    if (version_number > entry.second.tablet_version)
-                    {
-                        entry.second.tablet_version = version_number;
-                    }
-
-                    // Construct the full path to the file
-                    std::string file_path = dir_path + "/" + file_name;
-
-                    // Open the file
-                    std::ifstream file(file_path);
-                    std::string line;
-
-                    // Read each line of the file
-                    if (file.is_open())
-                    {
-                        while (getline(file, line))
-                        {
-                            std::stringstream ss(line);
-                            std::string key, inner_key, value;
-
-                            ss >> key >> inner_key;
-                            std::getline(ss, value);
-
-                            value = std::regex_replace(value, std::regex("^ +| +$|( ) +"), "$1");
-                            entry.second.row_to_kv[key][inner_key] = value;
-                        }
-                        file.close();
-                    }
-                }
-            }
-            // Close the directory
-            closedir(dir);
+            continue;
         }
-        else
+        std::string version_str = file_name.substr(underscore + 1, file_name.size() - 4 - underscore - 1);
+        if (version_str.empty() || !all_of(version_str.begin(), version_str.end(), ::isdigit))
         {
-            // Could not open directory
-            std::cerr << "Could not open directory: " << dir_path << std::endl;
+            continue;
         }
-
-        // If no files were found, create an initial file with version 0
-        if (!file_found)
+        std::string range = file_name.substr(0, underscore);
+        int version_number = std::stoi(version_str);
+        auto it = versions.find(range);
+        if (it == versions.end() || version_number > it->second)
         {
-            std::string initial_file_path = dir_path + "/" + base_filename + "_0.txt";
-            std::ofstream new_file(initial_file_path);
-            if (!new_file.is_open())
-            {
-                std::cerr << "Failed to create initial file: " << initial_file_path << std::endl;
-            }
-            else
-            {
-                // Optionally write some initial data or just close the file
-                new_file.close();
-                entry.second.tablet_version = 0; // Initialize the version to 0
-            }
+            versions[range] = version_number;
         }
     }
+    closedir(dir);
+    return versions;
 }
 
 /**
- * @brief Replays a message on the cache, updating the tablet data accordingly.
+ * @brief Loads a tablet's newest checkpoint.
  *
- * This function handles GET, PUT, DELETE, and CPUT messages by invoking the
- * appropriate handlers and updating the cache and requests_since_checkpoint count.
+ * A sorted checkpoint is mapped and its rows are only decoded when first
+ * accessed, so loading costs the same whatever the size of the tablet. A
+ * text checkpoint from an older server is read in full instead and replaced
+ * by a sorted one at the next checkpoint. A tablet with no checkpoint gets
+ * an empty version 0. The blob log the checkpoint refers to is opened, or a
+ * new one started if it refers to none.
+ *
+ * @param tablet The tablet to load.
+ * @param tablet_name The tablet's range.
+ * @param version The newest version on disk, or -1 if there is none.
+ * @param data_file_location The directory location of the tablet files.
+ */
+static void load_checkpoint(tablet_data &tablet, const std::string &tablet_name, int version, const std::string &data_file_location)
+{
+    tablet.tablet_version = std::max(version, 0);
+    for (row_stripe &stripe : tablet.stripes)
+    {
+        row_index_clear(stripe.index);
+    }
+    tablet.ordered_rows.clear();
+    charge(tablet, -tablet.resident_bytes);
+    tablet.clean_before = tablet.write_generation;
+    tablet.base = nullptr;
+    tablet.blobs = nullptr;
+    tablet.last_lsn = 0;
+
+    std::string file_path = data_file_location + "/" + tablet_name + "_" + std::to_string(tablet.tablet_version) + ".txt";
+    if (version < 0)
+    {
+        if (!save_tablet(tablet_rows(), nullptr, nullptr, file_path, 0))
+        {
+            std::cerr << "Failed to create initial file: " << file_path << std::endl;
+        }
+    }
+    else
+    {
+        tablet.base = open_checkpoint_file(file_path);
+        if (tablet.base == nullptr)
+        {
+            load_text_checkpoint(tablet, file_path);
+        }
+    }
+
+    if (tablet.base != nullptr)
+    {
+        tablet.last_lsn = tablet.base->last_lsn;
+    }
+
+    uint32_t blob_log_id = tablet.base != nullptr ? tablet.base->blob_log_id : 0;
+    if (blob_log_id != 0)
+    {
+        tablet.base->blobs = blob_log_open(blob_log_id, data_file_location + "/" + get_blob_log_file_name(tablet_name, blob_log_id));
+        tablet.blobs = tablet.base->blobs;
+        tablet.last_blob_log_id = std::max(tablet.last_blob_log_id, blob_log_id);
+    }
+    if (tablet.blobs == nullptr)
+    {
+        // Ids are never reused, as values in memory may remember an old log
+        uint32_t id = ++tablet.last_blob_log_id;
+        tablet.blobs = blob_log_create(id, data_file_location + "/" + get_blob_log_file_name(tablet_name, id));
+    }
+    else
+    {
+        tablet.blobs->live_bytes = tablet.base->blob_bytes;
+    }
+}
+
+/**
+ * @brief Replays a logged write on the tablet whose log holds it.
  *
  * @param cache The cache containing the tablet data.
  * @param f2b_message The message to be replayed.
- * @param server_tablet_ranges The list of tablet ranges on the server.
+ * @param tablet_name The tablet the log belongs to.
  */
-void replay_message(std::unordered_map<std::string, tablet_data> &cache, F_2_B_Message f2b_message, vector<string> &server_tablet_ranges)
+void replay_message(std::unordered_map<std::string, tablet_data> &cache, const F_2_B_Message &f2b_message, const string &tablet_name)
 {
-    string tablet_name = get_new_file_name(f2b_message.rowkey, server_tablet_ranges);
-    cout << "This row is in file: " << tablet_name << endl;
-
     switch (f2b_message.type)
     {
-    case 1:
-        f2b_message = handle_get(f2b_message, tablet_name, cache);
-        break;
     case 2:
-        f2b_message = handle_put(f2b_message, tablet_name, cache);
-        cache[tablet_name].requests_since_checkpoint++;
+        handle_put(f2b_message, tablet_name, cache);
         break;
     case 3:
-        f2b_message = handle_delete(f2b_message, tablet_name, cache);
-        cache[tablet_name].requests_since_checkpoint++;
+        handle_delete(f2b_message, tablet_name, cache);
         break;
     case 4:
-        f2b_message = handle_cput(f2b_message, tablet_name, cache);
-        cache[tablet_name].requests_since_checkpoint++;
+        handle_cput(f2b_message, tablet_name, cache);
         break;
+    case F2B_TYPE_BATCH:
+        // One record holds every write of a batch for this tablet
+        for (const F_2_B_Message &op : decode_batch(f2b_message.value))
+        {
+            replay_message(cache, op, tablet_name);
+        }
+        return;
     default:
-        cout << "Unknown command type received" << endl;
-        break;
+        cerr << "Unknown command type in log of " << tablet_name << endl;
+        return;
     }
+    cache[tablet_name].requests_since_checkpoint++;
 }
 
+// Outcome of recovering one tablet, reported once all tablets are done
+struct tablet_recovery_report
+{
+    std::string tablet_name;
+    int version = 0;
+    size_t records = 0;
+    double seconds = 0;
+};
+
 /**
- * @brief Recovers the cache state by replaying log messages.
+ * @brief Loads one tablet's checkpoint and replays its log.
  *
- * This function iterates through the cache, reads log files, and replays
- * the messages to restore the state of each tablet. It updates the
- * requests_since_checkpoint count accordingly.
+ * Only touches its own tablet, so tablets can be recovered in parallel.
  *
- * @param cache The cache to be recovered.
- * @param data_file_location The directory location of the log files.
- * @param server_tablet_ranges The list of tablet ranges on the server.
+ * @param cache The cache holding the tablet.
+ * @param tablet_name The tablet to recover.
+ * @param version The tablet's newest checkpoint version, or -1.
+ * @param data_file_location The directory location of the tablet files.
+ * @param report Receives the tablet's recovery time and record count.
  */
-void recover(std::unordered_map<std::string, tablet_data> &cache, std::string &data_file_location, vector<string> &server_tablet_ranges)
+static void recover_tablet(std::unordered_map<std::string, tablet_data> &cache, const std::string &tablet_name, int version,
+                           const std::string &data_file_location, tablet_recovery_report &report)
 {
-    // Loop over the cache
-    for (auto &entry : cache)
+    auto start = std::chrono::steady_clock::now();
+    tablet_data &tablet = cache.find(tablet_name)->second;
+    load_checkpoint(tablet, tablet_name, version, data_file_location);
+
+    std::string full_log_file_path = data_file_location + "/" + get_log_file_name(tablet_name);
+    tablet.requests_since_checkpoint = 0;
+
+    // Logs written before the binary record format are converted once
+    convert_text_log(full_log_file_path);
+    // Records the checkpoint already holds are left from a crash between
+    // installing it and dropping them from the log
+    report.records = read_wal_file(full_log_file_path, [&](uint64_t lsn, const F_2_B_Message &message)
+                                   {
+                                       if (lsn <= tablet.last_lsn)
+                                       {
+                                           return;
+                                       }
+                                       replay_message(cache, message, tablet_name);
+                                       tablet.last_lsn = lsn; });
+    // The file may have been replaced or had a torn tail cut off
+    wal_reopen(tablet.wal);
+
+    report.tablet_name = tablet_name;
+    report.version = tablet.tablet_version;
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief Deletes the blob logs no loaded checkpoint refers to, left behind by
+ * a crash before an old log was deleted or a new one installed.
+ *
+ * @param cache The recovered tablets.
+ * @param data_file_location The directory holding the blob logs.
+ */
+static void remove_stale_blob_logs(std::unordered_map<std::string, tablet_data> &cache, const std::string &data_file_location)
+{
+    DIR *dir = opendir(data_file_location.c_str());
+    if (dir == NULL)
     {
-        std::string base_filename = entry.first.substr(0, entry.first.find_last_of('.'));
-        std::string versioned_filename = base_filename + "_" + std::to_string(entry.second.tablet_version);
-        std::string log_file_name = get_log_file_name(base_filename);
-        std::string full_log_file_path = data_file_location + "/" + log_file_name;
-        std::ifstream log_file(full_log_file_path);
-        entry.second.requests_since_checkpoint = 0;
-        if (!log_file.is_open())
+        return;
+    }
+    std::vector<std::string> stale;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        std::string file_name = ent->d_name;
+        size_t marker = file_name.find("_blobs_");
+        if (marker == std::string::npos)
         {
-            std::cerr << "Failed to open log file: " << full_log_file_path << std::endl;
             continue;
         }
-        std::string line;
-        while (std::getline(log_file, line))
+        auto tablet = cache.find(file_name.substr(0, marker));
+        if (tablet != cache.end() && tablet->second.blobs != nullptr &&
+            data_file_location + "/" + file_name != tablet->second.blobs->path)
         {
-            if (!line.empty())
-            {
-                F_2_B_Message message = decode_message(line);
-                replay_message(cache, message, server_tablet_ranges);
-            }
+            stale.push_back(data_file_location + "/" + file_name);
         }
-        log_file.close();
     }
+    closedir(dir);
+    for (const std::string &path : stale)
+    {
+        std::remove(path.c_str());
+    }
+}
+
+/**
+ * @brief Rebuilds every tablet from its checkpoint and log.
+ *
+ * The data directory is listed once, then each tablet is loaded and its log
+ * replayed as a separate task on a pool with one thread per CPU. The time
+ * and replay rate of every tablet are printed once all are done.
+ *
+ * @param cache The cache to be recovered; every tablet already exists in it.
+ * @param data_file_location The directory location of the tablet files.
+ */
+void recover_tablets(std::unordered_map<std::string, tablet_data> &cache, const std::string &data_file_location)
+{
+    static thread_pool recovery_pool;
+    static bool pool_started = false;
+    if (!pool_started)
+    {
+        thread_pool_start(recovery_pool, std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)));
+        pool_started = true;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::unordered_map<std::string, int> versions = find_checkpoint_versions(data_file_location);
+    std::vector<tablet_recovery_report> reports(cache.size());
+    size_t i = 0;
+    for (auto &entry : cache)
+    {
+        auto version = versions.find(entry.first);
+        int newest = version == versions.end() ? -1 : version->second;
+        tablet_recovery_report *report = &reports[i++];
+        const std::string *tablet_name = &entry.first;
+        thread_pool_submit(recovery_pool, [&cache, tablet_name, newest, &data_file_location, report]()
+                           { recover_tablet(cache, *tablet_name, newest, data_file_location, *report); });
+    }
+    thread_pool_wait_idle(recovery_pool);
+    remove_stale_blob_logs(cache, data_file_location);
+    double total_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    sort(reports.begin(), reports.end(), [](const auto &a, const auto &b)
+         { return a.tablet_name < b.tablet_name; });
+    size_t total_records = 0;
+    for (const tablet_recovery_report &report : reports)
+    {
+        total_records += report.records;
+        std::cout << "Recovered " << report.tablet_name << " v" << report.version << ": "
+                  << report.records << " log records in " << report.seconds * 1000 << " ms ("
+                  << (report.seconds > 0 ? report.records / report.seconds : 0) << " records/sec)" << std::endl;
+    }
+    std::cout << "Recovered " << reports.size() << " tablets, " << total_records << " log records in "
+              << total_seconds * 1000 << " ms" << std::endl;
+}
+
+/**
+ * @brief Rebuilds one tablet from its checkpoint and log while the server
+ * runs, e.g. once a snapshot from its primary has been installed under it.
+ *
+ * @param cache The cache holding the tablet.
+ * @param tablet_name The tablet to rebuild; the caller holds its lock
+ *        exclusively and keeps it from being checkpointed meanwhile.
+ * @param data_file_location The directory location of the tablet files.
+ */
+void reload_tablet(std::unordered_map<std::string, tablet_data> &cache, const std::string &tablet_name,
+                   const std::string &data_file_location)
+{
+    std::unordered_map<std::string, int> versions = find_checkpoint_versions(data_file_location);
+    auto version = versions.find(tablet_name);
+    tablet_recovery_report report;
+    recover_tablet(cache, tablet_name, version == versions.end() ? -1 : version->second, data_file_location, report);
+    std::cout << "Reloaded " << report.tablet_name << " v" << report.version << ": " << report.records
+              << " log records in " << report.seconds * 1000 << " ms" << std::endl;
 }
 
 /**
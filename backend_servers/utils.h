@@ -2,31 +2,46 @@
 #define UTILS_FUNCTIONS_H
 
 #include "../utils/utils.h"
+#include "wal.h"
+#include "wal_record.h"
+#include "checkpoint_file.h"
+#include "row_index.h"
+#include "epoch.h"
+#include "row_cache.h"
+#include "thread_pool.h"
 #include <algorithm>
 #include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <dirent.h>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <regex>
 #include <signal.h>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <ctime>
 #include <unistd.h>
 #include <unordered_map>
 #include <set>
 #include <vector>
 
 #define CHECKPOINT_SIZE 100
+// Log size that triggers a checkpoint however few ops it holds
+#define CHECKPOINT_LOG_BYTES (16 * 1024 * 1024)
+// Longest a written-to tablet goes without a checkpoint
+#define CHECKPOINT_INTERVAL_SECONDS 60
 #define NUM_SPLITS 2
 
-extern const int MAX_BUFFER_SIZE;
-extern const int WELCOME_BUFFER_SIZE;
 // Global variables for server configuration and state
 
 struct fileRange
@@ -36,18 +51,69 @@ struct fileRange
   std::string filename;
 };
 
+// Number of lock stripes per tablet; a row lives in stripe
+// hash(rowkey) % ROW_LOCK_STRIPES
+#define ROW_LOCK_STRIPES 16
+// Estimated bytes an in-memory row costs beyond its version: its entry, its
+// slots in the row table and its node in the ordered index
+#define ROW_ENTRY_OVERHEAD 160
+// Entries the eviction clock passes in one stripe before moving to the next
+#define EVICTION_SWEEP_STEPS 64
+
+// A snapshot of the rows a tablet holds in memory; any other row is read
+// from the tablet's checkpoint file.
+typedef std::unordered_map<std::string, std::shared_ptr<const tablet_row>> tablet_rows;
+
+// One shard of a tablet's in-memory rows. Writers serialize on the lock;
+// readers look rows up without it.
+struct row_stripe
+{
+  pthread_mutex_t lock;
+  row_index index;
+  row_stripe();
+};
+
 struct tablet_data
 {
-  std::unordered_map<std::string, std::unordered_map<std::string, std::string>>
-      row_to_kv;
-  pthread_mutex_t tablet_lock;
-  int requests_since_checkpoint = 0;
+  // In-memory rows, sharded by row hash so writes to different rows of the
+  // tablet take different locks
+  row_stripe stripes[ROW_LOCK_STRIPES];
+  // Latest sorted checkpoint, or null if every row is in memory
+  std::shared_ptr<checkpoint_file> base;
+  // Log the next checkpoint stores large values in: base's own, unless it is
+  // being replaced. Changes under the exclusive lock.
+  std::shared_ptr<blob_log> blobs;
+  uint32_t last_blob_log_id = 0;
+  // Keys of the in-memory rows in order, for range scans. The views point
+  // into the entries, which outlive their place here. Guarded by order_lock,
+  // taken after the row's stripe.
+  std::map<std::string_view, row_entry *> ordered_rows;
+  pthread_mutex_t order_lock;
+  // Estimated bytes of the rows held in memory (see row_cache.h)
+  std::atomic<int64_t> resident_bytes{0};
+  // Writes are stamped with write_generation, which each checkpoint snapshot
+  // moves on. Rows last written before clean_before are in the checkpoint
+  // file, so they can be evicted. Both change under the exclusive lock.
+  uint64_t write_generation = 1;
+  uint64_t clean_before = 1;
+  // Stripe the next eviction starts from; only the checkpoint thread evicts
+  size_t eviction_stripe = 0;
+  // Holds the tablet's cell values. Never freed: values of retired row
+  // versions may be released after the tablet is gone.
+  value_slab *values = new value_slab();
+  // Held shared by writes, which then lock their row's stripe, and
+  // exclusively to change base or take a checkpoint snapshot. GETs of rows
+  // already in memory take no lock at all.
+  pthread_rwlock_t tablet_lock;
+  std::atomic<int> requests_since_checkpoint;
   int tablet_version;
-  tablet_data() : requests_since_checkpoint(0)
-  {
-    // Initialize the mutex
-    pthread_mutex_init(&tablet_lock, NULL);
-  }
+  time_t last_checkpoint = time(NULL);
+  // Write-ahead log of mutations since the last checkpoint
+  wal_log wal;
+  // Serializes LSN assignment with the append, so the log stays in LSN order
+  pthread_mutex_t lsn_mutex;
+  uint64_t last_lsn = 0; // LSN of the newest logged write
+  tablet_data();
 };
 
 // Declare function prototypes
@@ -65,20 +131,65 @@ std::string
 get_new_file_name(const std::string &row_key,
                   const std::vector<std::string> &server_tablet_list);
 
-// Function prototype for reading data from client socket
-bool do_read(int client_fd, char *client_buf);
+// Row access. find_row and update_row are for callers holding the tablet
+// lock and the row's stripe lock; read_row only needs an epoch_guard.
+const tablet_row *find_row(tablet_data &tablet, std::string_view rowkey);
+const tablet_row *read_row(tablet_data &tablet, std::string_view rowkey);
+void update_row(tablet_data &tablet, std::string_view rowkey,
+                const std::function<void(tablet_row &)> &change);
+tablet_rows snapshot_rows(tablet_data &tablet);
+void scan_rows(tablet_data &tablet, const std::string &start, const std::string &end,
+               size_t limit,
+               const std::function<void(const std::string &, const tablet_row &)> &visit);
+void for_each_row(
+    const tablet_rows &rows, const checkpoint_file *base,
+    const std::function<void(const std::string &, const tablet_row &)> &visit);
+
+// Tablet locking helpers; release with
+// pthread_rwlock_unlock(&tablet.tablet_lock)
+void lock_tablet_for_write(tablet_data &tablet);
+void lock_tablet_exclusive(tablet_data &tablet);
 
-void log_message(const F_2_B_Message &f2b_message,
-                 std::string data_file_location, std::string tablet_name);
+// A tablet as it was when a recovering peer asked for it: its checkpoint,
+// the blob log that checkpoint names and the first log_size bytes of its
+// log, held open so later checkpoints cannot take them away. A descriptor
+// is -1 (and its size 0) if the tablet had no such file.
+struct tablet_snapshot
+{
+  int version = 0;
+  uint64_t last_lsn = 0; // Newest record within log_size
+  int checkpoint_fd = -1;
+  off_t checkpoint_size = 0;
+  int blob_fd = -1;
+  off_t blob_size = 0;
+  int log_fd = -1;
+  uint64_t log_size = 0; // Includes records still on their way to the file
+  ~tablet_snapshot();
+};
+std::shared_ptr<tablet_snapshot> pin_tablet_snapshot(tablet_data &tablet, const std::string &tablet_name,
+                                                     const std::string &data_file_location);
+
+// Row locking under a held tablet lock; release with
+// pthread_mutex_unlock(&stripe.lock)
+row_stripe &lock_row_for_write(tablet_data &tablet, std::string_view rowkey);
+std::vector<row_stripe *> lock_rows_for_write(tablet_data &tablet,
+                                              const std::vector<std::string> &rowkeys);
+
+std::string get_log_file_name(const std::string &filename);
+std::string get_blob_log_file_name(const std::string &tablet_name, uint32_t id);
+uint64_t log_message(const F_2_B_Message &f2b_message, tablet_data &tablet,
+                     const std::function<void(uint64_t lsn, const std::string &record)> &on_logged = nullptr);
+void replay_message(std::unordered_map<std::string, tablet_data> &cache, const F_2_B_Message &f2b_message,
+                    const std::string &tablet_name);
+bool checkpoint_due(tablet_data &tablet);
+size_t evict_rows(tablet_data &tablet, size_t bytes);
 void checkpoint_tablet(tablet_data &checkpoint_tablet_data,
                        std::string tablet_name, std::string data_file_location);
 
-void load_cache(std::unordered_map<std::string, tablet_data> &cache,
-                std::string data_file_location);
-
-void recover(std::unordered_map<std::string, tablet_data> &cache,
-             std::string &data_file_location,
-             std::vector<std::string> &server_tablet_ranges);
+void recover_tablets(std::unordered_map<std::string, tablet_data> &cache,
+                     const std::string &data_file_location);
+void reload_tablet(std::unordered_map<std::string, tablet_data> &cache, const std::string &tablet_name,
+                   const std::string &data_file_location);
 
 void update_server_tablet_ranges(
     std::vector<std::string> &server_tablet_ranges);
@@ -0,0 +1,255 @@
+#include "value_slab.h"
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+
+using namespace std;
+
+// Bytes at the start of a chunk reserved for its header
+#define SLAB_CHUNK_HEADER_SIZE 64
+
+/**
+ * @brief Header of a chunk, stored in its first SLAB_CHUNK_HEADER_SIZE bytes.
+ *
+ * Blocks are handed out from the free list first, then from the part of the
+ * chunk that was never used. Everything is protected by the class mutex.
+ */
+struct slab_chunk
+{
+  slab_chunk *prev;
+  slab_chunk *next;
+  void *free_list;
+  size_t block_size;
+  size_t capacity; // Blocks that fit in the chunk
+  size_t used;     // Blocks carved out so far
+  size_t live;     // Blocks currently allocated
+};
+
+static_assert(sizeof(slab_chunk) <= SLAB_CHUNK_HEADER_SIZE, "slab chunk header too large");
+
+value_slab::value_slab()
+{
+  for (slab_class &size_class : classes)
+  {
+    pthread_mutex_init(&size_class.mutex, NULL);
+  }
+}
+
+/**
+ * @brief Finds the size class of an allocation.
+ *
+ * Class 0 holds the smallest blocks; past it, each doubling of the size is
+ * split into VALUE_SLAB_STEPS evenly spaced classes.
+ *
+ * @return The class index, or -1 if the allocation is too large for a slab.
+ */
+static int class_of(size_t bytes)
+{
+  if (bytes <= (size_t(1) << VALUE_SLAB_MIN_SHIFT))
+  {
+    return 0;
+  }
+  // bytes lies in (2^shift, 2^(shift + 1)]
+  int shift = VALUE_SLAB_MIN_SHIFT;
+  while ((size_t(2) << shift) < bytes)
+  {
+    shift++;
+  }
+  if (shift >= VALUE_SLAB_MAX_SHIFT)
+  {
+    return -1;
+  }
+  size_t step = (size_t(1) << shift) / VALUE_SLAB_STEPS;
+  size_t over = (bytes - (size_t(1) << shift) + step - 1) / step;
+  return (shift - VALUE_SLAB_MIN_SHIFT) * VALUE_SLAB_STEPS + over;
+}
+
+static size_t block_size_of(int index)
+{
+  if (index == 0)
+  {
+    return size_t(1) << VALUE_SLAB_MIN_SHIFT;
+  }
+  int shift = VALUE_SLAB_MIN_SHIFT + (index - 1) / VALUE_SLAB_STEPS;
+  size_t step = (size_t(1) << shift) / VALUE_SLAB_STEPS;
+  return (size_t(1) << shift) + ((index - 1) % VALUE_SLAB_STEPS + 1) * step;
+}
+
+static void unlink_chunk(slab_class &size_class, slab_chunk *chunk)
+{
+  if (chunk->prev != nullptr)
+  {
+    chunk->prev->next = chunk->next;
+  }
+  else
+  {
+    size_class.partial = chunk->next;
+  }
+  if (chunk->next != nullptr)
+  {
+    chunk->next->prev = chunk->prev;
+  }
+}
+
+static void push_chunk(slab_class &size_class, slab_chunk *chunk)
+{
+  chunk->prev = nullptr;
+  chunk->next = size_class.partial;
+  if (size_class.partial != nullptr)
+  {
+    size_class.partial->prev = chunk;
+  }
+  size_class.partial = chunk;
+}
+
+/**
+ * @brief Maps a chunk aligned to its size.
+ *
+ * Twice the size is mapped and the unaligned ends unmapped again, so no
+ * address space is left reserved around the chunk.
+ */
+static slab_chunk *new_chunk(size_t block_size)
+{
+  void *memory = mmap(NULL, 2 * VALUE_SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+  {
+    throw bad_alloc();
+  }
+  uintptr_t start = reinterpret_cast<uintptr_t>(memory);
+  uintptr_t aligned = (start + VALUE_SLAB_CHUNK_SIZE - 1) & ~uintptr_t(VALUE_SLAB_CHUNK_SIZE - 1);
+  if (aligned > start)
+  {
+    munmap(memory, aligned - start);
+  }
+  uintptr_t end = start + 2 * VALUE_SLAB_CHUNK_SIZE;
+  if (end > aligned + VALUE_SLAB_CHUNK_SIZE)
+  {
+    munmap(reinterpret_cast<void *>(aligned + VALUE_SLAB_CHUNK_SIZE), end - aligned - VALUE_SLAB_CHUNK_SIZE);
+  }
+  slab_chunk *chunk = reinterpret_cast<slab_chunk *>(aligned);
+  chunk->free_list = nullptr;
+  chunk->block_size = block_size;
+  chunk->capacity = (VALUE_SLAB_CHUNK_SIZE - SLAB_CHUNK_HEADER_SIZE) / block_size;
+  chunk->used = 0;
+  chunk->live = 0;
+  return chunk;
+}
+
+void *value_slab_allocate(value_slab *slab, size_t bytes)
+{
+  int index = slab == nullptr ? -1 : class_of(bytes);
+  if (index < 0)
+  {
+    return ::operator new(bytes);
+  }
+
+  slab_class &size_class = slab->classes[index];
+  pthread_mutex_lock(&size_class.mutex);
+  slab_chunk *chunk = size_class.partial;
+  if (chunk == nullptr)
+  {
+    chunk = new_chunk(block_size_of(index));
+    push_chunk(size_class, chunk);
+    size_class.chunks++;
+  }
+  void *block = chunk->free_list;
+  if (block != nullptr)
+  {
+    chunk->free_list = *static_cast<void **>(block);
+  }
+  else
+  {
+    block = reinterpret_cast<char *>(chunk) + SLAB_CHUNK_HEADER_SIZE + chunk->used * chunk->block_size;
+    chunk->used++;
+  }
+  if (++chunk->live == chunk->capacity)
+  {
+    unlink_chunk(size_class, chunk);
+  }
+  pthread_mutex_unlock(&size_class.mutex);
+  return block;
+}
+
+void value_slab_free(value_slab *slab, void *block, size_t bytes)
+{
+  int index = slab == nullptr ? -1 : class_of(bytes);
+  if (index < 0)
+  {
+    ::operator delete(block);
+    return;
+  }
+
+  slab_class &size_class = slab->classes[index];
+  slab_chunk *chunk = reinterpret_cast<slab_chunk *>(reinterpret_cast<uintptr_t>(block) & ~uintptr_t(VALUE_SLAB_CHUNK_SIZE - 1));
+  pthread_mutex_lock(&size_class.mutex);
+  // A full chunk is off the partial list until this block frees up
+  if (chunk->live-- == chunk->capacity)
+  {
+    push_chunk(size_class, chunk);
+  }
+  *static_cast<void **>(block) = chunk->free_list;
+  chunk->free_list = block;
+  pthread_mutex_unlock(&size_class.mutex);
+}
+
+size_t value_slab_trim(value_slab &slab)
+{
+  size_t released = 0;
+  for (slab_class &size_class : slab.classes)
+  {
+    pthread_mutex_lock(&size_class.mutex);
+    slab_chunk *chunk = size_class.partial;
+    while (chunk != nullptr)
+    {
+      slab_chunk *next = chunk->next;
+      if (chunk->live == 0)
+      {
+        unlink_chunk(size_class, chunk);
+        munmap(chunk, VALUE_SLAB_CHUNK_SIZE);
+        size_class.chunks--;
+        released++;
+      }
+      chunk = next;
+    }
+    pthread_mutex_unlock(&size_class.mutex);
+  }
+  return released;
+}
+
+size_t value_slab_bytes(value_slab &slab)
+{
+  size_t chunks = 0;
+  for (slab_class &size_class : slab.classes)
+  {
+    pthread_mutex_lock(&size_class.mutex);
+    chunks += size_class.chunks;
+    pthread_mutex_unlock(&size_class.mutex);
+  }
+  return chunks * VALUE_SLAB_CHUNK_SIZE;
+}
+
+void cell_value::release()
+{
+  if (block != nullptr && block->refs.fetch_sub(1, memory_order_acq_rel) == 1)
+  {
+    value_slab_free(block->slab, block, block_size(block->size));
+  }
+}
+
+cell_value make_cell_value(value_slab *slab, string_view bytes)
+{
+  void *memory = value_slab_allocate(slab, cell_value::block_size(bytes.size()));
+  cell_block *block = new (memory) cell_block;
+  block->refs.store(1, memory_order_relaxed);
+  block->size = bytes.size();
+  block->slab = slab;
+  cell_value value;
+  value.block = block;
+  if (cell_location *location = value.location())
+  {
+    new (location) cell_location;
+  }
+  memcpy(const_cast<char *>((*value).data()), bytes.data(), bytes.size());
+  return value;
+}
@@ -0,0 +1,138 @@
+#ifndef VALUE_SLAB_H
+#define VALUE_SLAB_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>
+#include <string_view>
+#include <utility>
+
+// Bytes of one slab chunk; chunks are aligned to their size so a block finds
+// its chunk by masking its address
+#define VALUE_SLAB_CHUNK_SIZE (128 * 1024)
+// Smallest and largest block sizes, as powers of two; larger values go to
+// the general heap
+#define VALUE_SLAB_MIN_SHIFT 6
+#define VALUE_SLAB_MAX_SHIFT 14
+// Each doubling of the block size is split into this many classes, so a
+// block wastes at most a fifth of its size
+#define VALUE_SLAB_STEPS 4
+#define VALUE_SLAB_CLASSES ((VALUE_SLAB_MAX_SHIFT - VALUE_SLAB_MIN_SHIFT) * VALUE_SLAB_STEPS + 1)
+// Values of at least this many bytes are checkpointed to the tablet's blob
+// log rather than into the checkpoint itself (see blob_log.h)
+#define LARGE_VALUE_SIZE 4096
+
+struct slab_chunk;
+
+// Chunks of one block size. Only chunks with a free block are listed.
+struct slab_class
+{
+  pthread_mutex_t mutex;
+  slab_chunk *partial = nullptr;
+  size_t chunks = 0;
+};
+
+/**
+ * @brief Per-tablet allocator for cell values.
+ *
+ * Values are carved out of large chunks by size class, so a PUT allocates
+ * from its own tablet's slab instead of the process heap, and writers to
+ * different tablets never share an allocator lock. Blocks freed by replaced
+ * versions go back to their chunk; chunks left empty are returned to the
+ * system in one go by value_slab_trim, which runs after each checkpoint.
+ */
+struct value_slab
+{
+  slab_class classes[VALUE_SLAB_CLASSES];
+
+  value_slab();
+};
+
+// A null slab, or a block too large for one, means the general heap.
+void *value_slab_allocate(value_slab *slab, size_t bytes);
+void value_slab_free(value_slab *slab, void *block, size_t bytes);
+// Releases every empty chunk; returns the number released.
+size_t value_slab_trim(value_slab &slab);
+// Bytes held in chunks, free blocks included.
+size_t value_slab_bytes(value_slab &slab);
+
+// Header of a cell's block; the value's bytes follow it.
+struct cell_block
+{
+  std::atomic<uint32_t> refs;
+  uint32_t size;
+  value_slab *slab;
+};
+
+// Where a large value was last written out of line: the id of a blob log,
+// 0 if none, and its record's offset. Sits between the header and the bytes
+// of every value of at least LARGE_VALUE_SIZE bytes.
+struct cell_location
+{
+  uint32_t log = 0;
+  uint64_t offset = 0;
+};
+
+/**
+ * @brief A reference-counted, immutable cell value.
+ *
+ * The count, the length and the bytes share one slab block. Values are
+ * shared between versions of a row, so a write that builds a new version
+ * copies the column list, never the other values.
+ */
+struct cell_value
+{
+  cell_value() = default;
+  cell_value(std::nullptr_t) {}
+  cell_value(const cell_value &other) : block(other.block)
+  {
+    if (block != nullptr)
+    {
+      block->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  cell_value(cell_value &&other) noexcept : block(other.block) { other.block = nullptr; }
+  ~cell_value() { release(); }
+
+  cell_value &operator=(cell_value other) noexcept
+  {
+    std::swap(block, other.block);
+    return *this;
+  }
+
+  std::string_view operator*() const
+  {
+    const char *bytes = reinterpret_cast<const char *>(block + 1);
+    if (block->size >= LARGE_VALUE_SIZE)
+    {
+      bytes += sizeof(cell_location);
+    }
+    return std::string_view(bytes, block->size);
+  }
+  explicit operator bool() const { return block != nullptr; }
+
+  // The value's location in a blob log, or nullptr for a small value. It is
+  // not part of the value, so it may change in a published row; only the
+  // checkpoint thread reads or changes it after that.
+  cell_location *location() const
+  {
+    return block->size >= LARGE_VALUE_SIZE ? reinterpret_cast<cell_location *>(block + 1) : nullptr;
+  }
+
+private:
+  friend cell_value make_cell_value(value_slab *slab, std::string_view bytes);
+  void release();
+  // Bytes of the block holding a value of size bytes
+  static size_t block_size(size_t size)
+  {
+    return sizeof(cell_block) + (size >= LARGE_VALUE_SIZE ? sizeof(cell_location) : 0) + size;
+  }
+
+  cell_block *block = nullptr;
+};
+
+// Copies bytes into a new value in slab (the heap if slab is null).
+cell_value make_cell_value(value_slab *slab, std::string_view bytes);
+
+#endif // VALUE_SLAB_H
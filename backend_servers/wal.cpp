@@ -0,0 +1,458 @@
+#include "wal.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// Longest the group-commit thread sleeps when no writer wakes it
+#define WAL_IDLE_WAIT_SECONDS 1
+
+static wal_durability durability = WAL_DURABILITY_STRICT;
+
+// Every opened log; the group-commit thread visits each on every round
+static vector<wal_log *> logs;
+static pthread_mutex_t logs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static bool work_pending = false;
+
+// Group-commit metrics, protected by stats_mutex
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t commit_count = 0;
+static uint64_t record_count = 0;
+static uint64_t sync_count = 0;
+static uint64_t sync_total_us = 0;
+static uint64_t sync_max_us = 0;
+static uint64_t window_commits = 0;
+static chrono::steady_clock::time_point window_start = chrono::steady_clock::now();
+static double commits_per_sec = 0;
+
+wal_log::wal_log()
+{
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&durable_cond, NULL);
+  pthread_mutex_init(&io_mutex, NULL);
+}
+
+bool parse_wal_durability(const string &name, wal_durability &mode)
+{
+  if (name == "none")
+  {
+    mode = WAL_DURABILITY_NONE;
+  }
+  else if (name == "batch")
+  {
+    mode = WAL_DURABILITY_BATCH;
+  }
+  else if (name == "strict")
+  {
+    mode = WAL_DURABILITY_STRICT;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Writes the whole buffer, retrying short writes and EINTR.
+ *
+ * @return false if write() failed.
+ */
+static bool write_all(int fd, const string &data)
+{
+  size_t written = 0;
+  while (written < data.size())
+  {
+    ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n < 0)
+    {
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+/**
+ * @brief Folds one commit into the metrics and refreshes the commits/sec
+ * figure once a second.
+ */
+static void record_commit(uint64_t records, bool synced, uint64_t sync_us)
+{
+  pthread_mutex_lock(&stats_mutex);
+  if (records > 0)
+  {
+    commit_count++;
+    window_commits++;
+    record_count += records;
+  }
+  if (synced)
+  {
+    sync_count++;
+    sync_total_us += sync_us;
+    sync_max_us = max(sync_max_us, sync_us);
+  }
+  auto now = chrono::steady_clock::now();
+  double elapsed = chrono::duration<double>(now - window_start).count();
+  if (elapsed >= 1.0)
+  {
+    commits_per_sec = window_commits / elapsed;
+    window_commits = 0;
+    window_start = now;
+  }
+  pthread_mutex_unlock(&stats_mutex);
+}
+
+/**
+ * @brief Writes out the log's pending group and syncs it.
+ *
+ * Records appended while the write is in progress form the next group, so a
+ * busy tablet pays one fdatasync() per group rather than one per write.
+ *
+ * If the write or the sync fails, the file is cut back to where the group
+ * began, so torn bytes cannot hide records written after them, and the log
+ * is marked failed: the group's writers are told, and every later record is
+ * dropped unwritten until the log is reopened.
+ *
+ * @param log The log to commit; the caller holds its io_mutex.
+ */
+static void commit_log_locked(wal_log &log)
+{
+  pthread_mutex_lock(&log.mutex);
+  string group;
+  group.swap(log.pending);
+  uint64_t seq = log.appended_seq;
+  uint64_t records = seq > log.durable_seq ? seq - log.durable_seq : 0;
+  bool failed = log.failed;
+  pthread_mutex_unlock(&log.mutex);
+
+  if (group.empty() || failed)
+  {
+    record_commit(0, false, 0);
+    return;
+  }
+
+  struct stat st;
+  bool have_end = log.fd >= 0 && fstat(log.fd, &st) == 0;
+  bool ok = have_end && write_all(log.fd, group);
+  bool synced = false;
+  uint64_t sync_us = 0;
+  if (ok && durability != WAL_DURABILITY_NONE)
+  {
+    auto sync_start = chrono::steady_clock::now();
+    ok = fdatasync(log.fd) == 0;
+    sync_us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - sync_start).count();
+    synced = true;
+  }
+  if (!ok)
+  {
+    cerr << "Failed to commit log " << log.path << ": " << strerror(errno) << endl;
+    if (have_end && ftruncate(log.fd, st.st_size) != 0)
+    {
+      cerr << "Failed to drop the torn group from " << log.path << ": " << strerror(errno) << endl;
+    }
+  }
+
+  pthread_mutex_lock(&log.mutex);
+  if (ok)
+  {
+    log.durable_seq = max(log.durable_seq, seq);
+  }
+  else
+  {
+    log.failed = true;
+    log.size = have_end ? st.st_size : log.size - group.size() - log.pending.size();
+    log.pending.clear();
+  }
+  pthread_cond_broadcast(&log.durable_cond);
+  pthread_mutex_unlock(&log.mutex);
+
+  record_commit(records, synced, sync_us);
+}
+
+static void commit_log(wal_log &log)
+{
+  pthread_mutex_lock(&log.io_mutex);
+  commit_log_locked(log);
+  pthread_mutex_unlock(&log.io_mutex);
+}
+
+/**
+ * @brief Body of the group-commit thread: sleeps until a writer appends,
+ * then commits every log that has pending records.
+ */
+static void *group_commit_thread(void *)
+{
+  while (true)
+  {
+    pthread_mutex_lock(&logs_mutex);
+    if (!work_pending)
+    {
+      timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += WAL_IDLE_WAIT_SECONDS;
+      pthread_cond_timedwait(&work_cond, &logs_mutex, &deadline);
+    }
+    work_pending = false;
+    vector<wal_log *> snapshot = logs;
+    pthread_mutex_unlock(&logs_mutex);
+
+    for (wal_log *log : snapshot)
+    {
+      commit_log(*log);
+    }
+  }
+  return NULL;
+}
+
+void wal_start(wal_durability mode)
+{
+  durability = mode;
+  pthread_t thread;
+  pthread_create(&thread, NULL, group_commit_thread, NULL);
+  pthread_detach(thread);
+}
+
+/**
+ * @brief (Re)opens the log's file for appending and picks up its size.
+ *
+ * @param log The log; the caller holds its io_mutex.
+ */
+static void open_log_file(wal_log &log)
+{
+  if (log.fd >= 0)
+  {
+    close(log.fd);
+  }
+  log.fd = open(log.path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  struct stat st;
+  if (log.fd < 0 || fstat(log.fd, &st) != 0)
+  {
+    cerr << "Failed to open log file: " << log.path << ": " << strerror(errno) << endl;
+    st.st_size = 0;
+  }
+  pthread_mutex_lock(&log.mutex);
+  log.size = st.st_size + log.pending.size();
+  log.failed = log.fd < 0;
+  pthread_mutex_unlock(&log.mutex);
+}
+
+void wal_open(wal_log &log, const string &path)
+{
+  pthread_mutex_lock(&log.io_mutex);
+  log.path = path;
+  open_log_file(log);
+  pthread_mutex_unlock(&log.io_mutex);
+
+  pthread_mutex_lock(&logs_mutex);
+  if (find(logs.begin(), logs.end(), &log) == logs.end())
+  {
+    logs.push_back(&log);
+  }
+  pthread_mutex_unlock(&logs_mutex);
+}
+
+void wal_reopen(wal_log &log)
+{
+  pthread_mutex_lock(&log.io_mutex);
+  open_log_file(log);
+  pthread_mutex_unlock(&log.io_mutex);
+}
+
+uint64_t wal_append(wal_log &log, const string &record)
+{
+  pthread_mutex_lock(&log.mutex);
+  if (!log.failed)
+  {
+    log.pending += record;
+    log.size += record.size();
+  }
+  uint64_t ticket = ++log.appended_seq;
+  pthread_mutex_unlock(&log.mutex);
+
+  pthread_mutex_lock(&logs_mutex);
+  work_pending = true;
+  pthread_cond_signal(&work_cond);
+  pthread_mutex_unlock(&logs_mutex);
+  return ticket;
+}
+
+bool wal_wait_durable(wal_log &log, uint64_t ticket)
+{
+  pthread_mutex_lock(&log.mutex);
+  while (durability == WAL_DURABILITY_STRICT && log.durable_seq < ticket && !log.failed)
+  {
+    pthread_cond_wait(&log.durable_cond, &log.mutex);
+  }
+  bool ok = durability == WAL_DURABILITY_STRICT ? log.durable_seq >= ticket : !log.failed;
+  pthread_mutex_unlock(&log.mutex);
+  return ok;
+}
+
+bool wal_failed(wal_log &log)
+{
+  pthread_mutex_lock(&log.mutex);
+  bool failed = log.failed;
+  pthread_mutex_unlock(&log.mutex);
+  return failed;
+}
+
+void wal_flush(wal_log &log)
+{
+  commit_log(log);
+}
+
+uint64_t wal_size(wal_log &log)
+{
+  pthread_mutex_lock(&log.mutex);
+  uint64_t size = log.size;
+  pthread_mutex_unlock(&log.mutex);
+  return size;
+}
+
+/**
+ * @brief Appends the bytes of a file from offset to its end to another file.
+ *
+ * @return false if a read or write failed.
+ */
+static bool copy_file_from(int in_fd, off_t offset, int out_fd)
+{
+  char chunk[64 * 1024];
+  while (true)
+  {
+    ssize_t n = pread(in_fd, chunk, sizeof(chunk), offset);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      return n == 0;
+    }
+    if (!write_all(out_fd, string(chunk, n)))
+    {
+      return false;
+    }
+    offset += n;
+  }
+}
+
+/**
+ * @brief Gives up a tail copy, removing its file.
+ */
+static void abandon_tail(wal_log &log, wal_tail &tail)
+{
+  cerr << "Failed to drop checkpointed records from " << log.path << ": " << strerror(errno) << endl;
+  if (tail.fd >= 0)
+  {
+    close(tail.fd);
+    tail.fd = -1;
+  }
+  remove(tail.path.c_str());
+}
+
+int wal_open_reader(wal_log &log, uint64_t &size)
+{
+  // Truncation renames a new file over the path under io_mutex, and first
+  // commits every pending record to the file it replaces
+  pthread_mutex_lock(&log.io_mutex);
+  int fd = open(log.path.c_str(), O_RDONLY | O_CLOEXEC);
+  pthread_mutex_lock(&log.mutex);
+  size = log.size;
+  pthread_mutex_unlock(&log.mutex);
+  pthread_mutex_unlock(&log.io_mutex);
+  return fd;
+}
+
+bool wal_copy_tail(wal_log &log, uint64_t covered, wal_tail &tail)
+{
+  // Pending records are written first so the copy sees the whole log
+  pthread_mutex_lock(&log.io_mutex);
+  commit_log_locked(log);
+  struct stat st;
+  int in_fd = open(log.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in_fd >= 0 && fstat(in_fd, &st) != 0)
+  {
+    close(in_fd);
+    in_fd = -1;
+  }
+  pthread_mutex_unlock(&log.io_mutex);
+
+  tail.path = log.path + ".tail";
+  tail.fd = open(tail.path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  bool ok = in_fd >= 0 && tail.fd >= 0;
+  if (ok)
+  {
+    // Groups committed meanwhile are only ever appended past st_size
+    tail.covered = min<uint64_t>(covered, st.st_size);
+    tail.copied = st.st_size;
+    ok = copy_file_from(in_fd, tail.covered, tail.fd) && fdatasync(tail.fd) == 0;
+  }
+  if (in_fd >= 0)
+  {
+    close(in_fd);
+  }
+  if (!ok)
+  {
+    abandon_tail(log, tail);
+  }
+  return ok;
+}
+
+void wal_install_tail(wal_log &log, wal_tail &tail)
+{
+  pthread_mutex_lock(&log.io_mutex);
+  commit_log_locked(log);
+  int in_fd = open(log.path.c_str(), O_RDONLY | O_CLOEXEC);
+  // The new file is synced before it is renamed over the old one, so a
+  // crash leaves either the old log or the new one
+  bool ok = in_fd >= 0 && copy_file_from(in_fd, tail.copied, tail.fd) && fdatasync(tail.fd) == 0 &&
+            rename(tail.path.c_str(), log.path.c_str()) == 0;
+  if (in_fd >= 0)
+  {
+    close(in_fd);
+  }
+  if (ok)
+  {
+    close(log.fd);
+    log.fd = tail.fd;
+    tail.fd = -1;
+    pthread_mutex_lock(&log.mutex);
+    log.size -= min(tail.covered, log.size);
+    pthread_mutex_unlock(&log.mutex);
+  }
+  else
+  {
+    abandon_tail(log, tail);
+  }
+  pthread_mutex_unlock(&log.io_mutex);
+}
+
+string wal_stats()
+{
+  static const char *mode_names[] = {"none", "batch", "strict"};
+  pthread_mutex_lock(&stats_mutex);
+  ostringstream out;
+  out << "wal_mode=" << mode_names[durability]
+      << " wal_commits=" << commit_count
+      << " wal_records=" << record_count
+      << " wal_commits_per_sec=" << commits_per_sec
+      << " wal_fsyncs=" << sync_count
+      << " wal_fsync_avg_us=" << (sync_count ? sync_total_us / sync_count : 0)
+      << " wal_fsync_max_us=" << sync_max_us;
+  pthread_mutex_unlock(&stats_mutex);
+  return out.str();
+}
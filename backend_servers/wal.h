@@ -0,0 +1,99 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <cstdint>
+#include <pthread.h>
+#include <string>
+
+/**
+ * @brief How hard the write-ahead log works to make a write durable.
+ */
+enum wal_durability
+{
+  WAL_DURABILITY_NONE,  // Records are written in groups but never synced
+  WAL_DURABILITY_BATCH, // Groups are synced, writers do not wait for it
+  WAL_DURABILITY_STRICT // Writers are acked only once their group is synced
+};
+
+/**
+ * @brief One append-only tablet log with a persistent file descriptor.
+ *
+ * Writers append records to an in-memory group; the group-commit thread
+ * writes every pending group with a single write() and fdatasync(), then
+ * wakes the writers waiting for it. A group that fails to commit is cut from
+ * the file and fails the log until it is reopened.
+ */
+struct wal_log
+{
+  std::string path;
+  int fd = -1;
+  pthread_mutex_t mutex;       // Protects everything below
+  pthread_cond_t durable_cond; // Signalled after every commit of a group
+  pthread_mutex_t io_mutex;    // Serialises writes, syncs and truncation of fd
+  std::string pending;         // Appended records not yet written
+  uint64_t appended_seq = 0;   // Number of records appended so far
+  uint64_t durable_seq = 0;    // Records written (and synced, unless NONE)
+  uint64_t size = 0;           // Bytes in the file plus pending bytes
+  bool failed = false;         // A commit failed; new records are dropped
+
+  wal_log();
+};
+
+// Parses "none", "batch" or "strict"; returns false for anything else.
+bool parse_wal_durability(const std::string &name, wal_durability &mode);
+
+// Starts the group-commit thread. Call once before any log is opened.
+void wal_start(wal_durability mode);
+
+// Opens (creating if needed) the log file and registers it for group commit.
+void wal_open(wal_log &log, const std::string &path);
+
+// Closes and reopens the log file, e.g. after it was replaced on disk.
+void wal_reopen(wal_log &log);
+
+// Queues one record; returns a ticket for wal_wait_durable. Once the log has
+// failed the record is dropped, and waiting on its ticket reports so.
+uint64_t wal_append(wal_log &log, const std::string &record);
+
+// Blocks until the record behind ticket is durable; waits only when STRICT.
+// Returns false if the record was lost to a failed commit, or, in the other
+// modes, if the log has failed.
+bool wal_wait_durable(wal_log &log, uint64_t ticket);
+
+// True once a commit has failed and the log drops new records.
+bool wal_failed(wal_log &log);
+
+// Writes out everything appended so far before returning.
+void wal_flush(wal_log &log);
+
+// Current end of the log in bytes, pending records included.
+uint64_t wal_size(wal_log &log);
+
+// Opens the current log file for reading and takes wal_size with it; the
+// bytes up to size are all in that file once wal_flush has returned, even
+// if the log has been truncated meanwhile. Returns -1 on failure.
+int wal_open_reader(wal_log &log, uint64_t &size);
+
+// A new log file being filled with the tail of a log, while the log stays
+// in use, to drop the records a checkpoint holds.
+struct wal_tail
+{
+  std::string path;
+  int fd = -1;
+  uint64_t covered = 0; // Bytes at the start of the log left out
+  uint64_t copied = 0;  // End of the log bytes copied so far
+};
+
+// Copies the log after its first covered bytes to a new synced file, while
+// writers keep appending. Returns false, leaving nothing behind, on failure.
+bool wal_copy_tail(wal_log &log, uint64_t covered, wal_tail &tail);
+
+// Copies what was appended since wal_copy_tail and renames the new file over
+// the log, so descriptors from wal_open_reader keep the old one. The log must
+// not be reopened in between. On failure the log keeps every record.
+void wal_install_tail(wal_log &log, wal_tail &tail);
+
+// Group-commit metrics as "key=value" pairs separated by spaces.
+std::string wal_stats();
+
+#endif // WAL_H
@@ -0,0 +1,404 @@
+#include "wal_record.h"
+#include "../utils/read_buffer.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Bytes of a record payload before its fields: u64 lsn, u16 type
+#define WAL_RECORD_HEADER_SIZE 10
+// Reflected CRC32C (Castagnoli) polynomial
+#define CRC32C_POLYNOMIAL 0x82F63B78u
+
+/**
+ * @brief Lookup tables for slicing-by-8 CRC32C, built once at startup.
+ */
+struct crc32c_tables
+{
+  uint32_t table[8][256];
+
+  crc32c_tables()
+  {
+    for (uint32_t i = 0; i < 256; i++)
+    {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; bit++)
+      {
+        crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+      }
+      table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+      for (int slice = 1; slice < 8; slice++)
+      {
+        table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xff];
+      }
+    }
+  }
+};
+
+static const crc32c_tables crc_tables;
+
+/**
+ * @brief Computes CRC32C eight bytes at a time.
+ *
+ * @param crc The CRC of the preceding data, 0 to start.
+ * @param data The bytes to add.
+ * @param length Number of bytes.
+ * @return The updated CRC.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  const auto &t = crc_tables.table;
+  crc = ~crc;
+  while (length >= 8)
+  {
+    uint32_t low = crc ^ (uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24);
+    crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+          t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+    p += 8;
+    length -= 8;
+  }
+  while (length--)
+  {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+  }
+  return ~crc;
+}
+
+static void put_uint(string &out, uint64_t value, int width)
+{
+  for (int shift = (width - 1) * 8; shift >= 0; shift -= 8)
+  {
+    out.push_back(static_cast<char>((value >> shift) & 0xff));
+  }
+}
+
+static uint64_t get_uint(string_view data, size_t pos, int width)
+{
+  uint64_t value = 0;
+  for (int i = 0; i < width; i++)
+  {
+    value = (value << 8) | static_cast<unsigned char>(data[pos + i]);
+  }
+  return value;
+}
+
+static void put_field(string &out, const string &field)
+{
+  put_uint(out, field.size(), 4);
+  out += field;
+}
+
+/**
+ * @brief Reads one length-prefixed field of a record.
+ *
+ * @return false if the field runs past the end of the record.
+ */
+static bool get_field(string_view record, size_t &pos, string &field)
+{
+  if (record.size() - pos < 4)
+  {
+    return false;
+  }
+  uint64_t length = get_uint(record, pos, 4);
+  pos += 4;
+  if (record.size() - pos < length)
+  {
+    return false;
+  }
+  field.assign(record.data() + pos, length);
+  pos += length;
+  return true;
+}
+
+/**
+ * @brief Encodes a logged write as a checksummed binary record.
+ *
+ * @param lsn The record's log sequence number.
+ * @param message The write; status, origin and error text are not logged.
+ * @return The complete record, length prefix included.
+ */
+string encode_wal_record(uint64_t lsn, const F_2_B_Message &message)
+{
+  string record(WAL_RECORD_PREFIX_SIZE, '\0');
+  put_uint(record, lsn, 8);
+  put_uint(record, message.type, 2);
+  put_field(record, message.rowkey);
+  put_field(record, message.colkey);
+  put_field(record, message.value);
+  put_field(record, message.value2);
+
+  string prefix;
+  put_uint(prefix, record.size() - 4, 4);
+  put_uint(prefix, crc32c(0, record.data() + WAL_RECORD_PREFIX_SIZE, record.size() - WAL_RECORD_PREFIX_SIZE), 4);
+  record.replace(0, WAL_RECORD_PREFIX_SIZE, prefix);
+  return record;
+}
+
+/**
+ * @brief Validates and decodes a complete binary record.
+ *
+ * @param record The record, length prefix included.
+ * @param lsn Set to the record's log sequence number.
+ * @param message Set to the logged write.
+ * @return false if the lengths are inconsistent or the checksum fails.
+ */
+bool decode_wal_record(string_view record, uint64_t &lsn, F_2_B_Message &message)
+{
+  if (record.size() < WAL_RECORD_PREFIX_SIZE + WAL_RECORD_HEADER_SIZE ||
+      get_uint(record, 0, 4) != record.size() - 4)
+  {
+    return false;
+  }
+  string_view payload = record.substr(WAL_RECORD_PREFIX_SIZE);
+  if (get_uint(record, 4, 4) != crc32c(0, payload.data(), payload.size()))
+  {
+    return false;
+  }
+
+  lsn = get_uint(payload, 0, 8);
+  message = F_2_B_Message();
+  message.type = get_uint(payload, 8, 2);
+  size_t pos = WAL_RECORD_HEADER_SIZE;
+  return get_field(payload, pos, message.rowkey) &&
+         get_field(payload, pos, message.colkey) &&
+         get_field(payload, pos, message.value) &&
+         get_field(payload, pos, message.value2) &&
+         pos == payload.size();
+}
+
+/**
+ * @brief Splits a run of concatenated records, such as a slice of a log.
+ *
+ * Only the length prefix is looked at; decode_wal_record checks the rest.
+ *
+ * @param records The remaining records; the one returned is removed.
+ * @param record Set to the first record.
+ * @return false if records is empty or ends in a partial record.
+ */
+bool next_wal_record(string_view &records, string_view &record)
+{
+  if (records.size() < 4 || records.size() - 4 < get_uint(records, 0, 4))
+  {
+    return false;
+  }
+  record = records.substr(0, 4 + get_uint(records, 0, 4));
+  records.remove_prefix(record.size());
+  return true;
+}
+
+/**
+ * @brief Tells a text log from a binary one by its first byte.
+ *
+ * Text records start with their numeric type, binary records with a
+ * big-endian length whose top byte is at most MAX_FRAME_SIZE >> 24.
+ *
+ * @param path The log file.
+ * @return true if the file starts with an ASCII digit.
+ */
+static bool is_text_log(const string &path)
+{
+  ifstream in(path, ios::binary);
+  char first;
+  return in.get(first) && isdigit(static_cast<unsigned char>(first));
+}
+
+/**
+ * @brief Rewrites a text log as binary records.
+ *
+ * Lines are numbered from LSN 1. A torn final line, one without its newline
+ * or one that fails to parse, ends the conversion. The binary log is written
+ * next to the original, synced, and renamed over it.
+ *
+ * @param path The log file.
+ * @return true if the log was converted.
+ */
+bool convert_text_log(const string &path)
+{
+  if (!is_text_log(path))
+  {
+    return false;
+  }
+  ifstream in(path, ios::binary);
+  string converted;
+  string line;
+  uint64_t lsn = 0;
+  while (getline(in, line) && !in.eof())
+  {
+    if (line.empty())
+    {
+      continue;
+    }
+    try
+    {
+      F_2_B_Message message = decode_message(line);
+      converted += encode_wal_record(++lsn, message);
+    }
+    catch (const exception &e)
+    {
+      cerr << "Dropping unreadable text log line " << lsn + 1 << " of " << path << endl;
+      break;
+    }
+  }
+  in.close();
+
+  string temp_path = path + ".convert";
+  int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+  {
+    cerr << "Failed to create " << temp_path << ": " << strerror(errno) << endl;
+    return false;
+  }
+  bool ok = write(fd, converted.data(), converted.size()) == static_cast<ssize_t>(converted.size()) &&
+            fsync(fd) == 0;
+  close(fd);
+  if (!ok || rename(temp_path.c_str(), path.c_str()) != 0)
+  {
+    cerr << "Failed to convert text log " << path << endl;
+    remove(temp_path.c_str());
+    return false;
+  }
+  cout << "Converted text log " << path << " to " << lsn << " binary records" << endl;
+  return true;
+}
+
+/**
+ * @brief Replays a binary log in one sequential pass.
+ *
+ * The file is read in large chunks through a read_buffer in binary mode, so
+ * records are framed by their length prefix without per-line parsing. The
+ * first record that is incomplete or fails its checksum is treated as a torn
+ * write: it and everything after it are cut off so new records are appended
+ * right after the last good one.
+ *
+ * @param path The log file.
+ * @param handler Called for every valid record, in order.
+ * @return The number of records replayed.
+ */
+size_t read_wal_file(const string &path, const wal_record_handler &handler)
+{
+  int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0)
+  {
+    cerr << "Failed to open log file: " << path << endl;
+    return 0;
+  }
+
+  read_buffer buf;
+  buf.binary = true;
+  size_t records = 0;
+  off_t valid_end = 0;
+  bool eof = false;
+  while (true)
+  {
+    string_view frame;
+    if (!read_buffer_peek_frame(buf, frame))
+    {
+      if (eof || read_buffer_overflowed(buf))
+      {
+        break;
+      }
+      ssize_t n = read_buffer_fill(buf, fd);
+      if (n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      eof = n <= 0;
+      continue;
+    }
+
+    uint64_t lsn;
+    F_2_B_Message message;
+    if (!decode_wal_record(frame, lsn, message))
+    {
+      break;
+    }
+    handler(lsn, message);
+    records++;
+    valid_end += frame.size();
+    read_buffer_consume(buf, frame.size());
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > valid_end)
+  {
+    cerr << "Truncating " << st.st_size - valid_end << " torn bytes from " << path << endl;
+    if (ftruncate(fd, valid_end) != 0)
+    {
+      cerr << "Failed to truncate log file: " << path << endl;
+    }
+  }
+  close(fd);
+  return records;
+}
+
+/**
+ * @brief Copies the records of a log that follow a given LSN.
+ *
+ * Records are copied verbatim, in one sequential pass like read_wal_file,
+ * starting with the one numbered after_lsn + 1. A checkpoint truncates the
+ * log, so that record may no longer be in it; the caller then has to fall
+ * back to the checkpoint itself.
+ *
+ * @param path The log file.
+ * @param after_lsn The last LSN the reader already has.
+ * @param records Receives the records after it.
+ * @return false if the log does not hold the record numbered after_lsn + 1.
+ */
+bool read_wal_suffix(const string &path, uint64_t after_lsn, string &records)
+{
+  records.clear();
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    cerr << "Failed to open log file: " << path << endl;
+    return false;
+  }
+
+  read_buffer buf;
+  buf.binary = true;
+  bool found = false;
+  bool eof = false;
+  while (true)
+  {
+    string_view frame;
+    if (!read_buffer_peek_frame(buf, frame))
+    {
+      if (eof || read_buffer_overflowed(buf))
+      {
+        break;
+      }
+      ssize_t n = read_buffer_fill(buf, fd);
+      if (n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      eof = n <= 0;
+      continue;
+    }
+
+    uint64_t lsn;
+    F_2_B_Message message;
+    if (!decode_wal_record(frame, lsn, message) || (!found && lsn > after_lsn + 1))
+    {
+      break;
+    }
+    found = found || lsn == after_lsn + 1;
+    if (found)
+    {
+      records.append(frame);
+    }
+    read_buffer_consume(buf, frame.size());
+  }
+  close(fd);
+  return found;
+}
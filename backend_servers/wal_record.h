@@ -0,0 +1,54 @@
+#ifndef WAL_RECORD_H
+#define WAL_RECORD_H
+
+#include "../utils/utils.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+// Bytes before the checksummed part of a record: u32 length, u32 CRC32C
+#define WAL_RECORD_PREFIX_SIZE 8
+
+/**
+ * Binary write-ahead log record, all integers big-endian:
+ *
+ *   u32 length   Bytes that follow this field (CRC included)
+ *   u32 crc32c   CRC32C of everything after this field
+ *   u64 lsn      Log sequence number, increasing within a tablet
+ *   u16 type     F_2_B_Message type of the logged write
+ *   4 fields     rowkey, colkey, value, value2, each a u32 length + bytes
+ *
+ * A record is only replayed if it is complete and its checksum matches; the
+ * first record that is not ends the log.
+ */
+
+// Callback receiving each valid record in log order
+typedef std::function<void(uint64_t lsn, const F_2_B_Message &message)> wal_record_handler;
+
+// CRC32C (Castagnoli) of data, continuing from crc.
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+// Encodes one write as a complete record.
+std::string encode_wal_record(uint64_t lsn, const F_2_B_Message &message);
+
+// Parses a complete record; false if it is malformed or fails its checksum.
+bool decode_wal_record(std::string_view record, uint64_t &lsn, F_2_B_Message &message);
+
+// Takes the next complete record, length prefix included, off the front of
+// records; false once none is left or the next one is cut short.
+bool next_wal_record(std::string_view &records, std::string_view &record);
+
+// Rewrites a log of encode_message text lines as binary records. Returns
+// false if path is not a text log or could not be rewritten.
+bool convert_text_log(const std::string &path);
+
+// Streams every valid record of the log at path to handler and truncates the
+// file after the last one. Returns the number of records replayed.
+size_t read_wal_file(const std::string &path, const wal_record_handler &handler);
+
+// Copies every record of the log at path numbered after after_lsn, exactly as
+// stored. Returns false if the log no longer reaches back to after_lsn + 1.
+bool read_wal_suffix(const std::string &path, uint64_t after_lsn, std::string &records);
+
+#endif // WAL_RECORD_H
@@ -2,6 +2,10 @@
 using namespace std;
 
 #define HEARTBEAT_TIME 1
+// How long a backend may trust a primary map it was sent. Every heartbeat
+// renews it, so a backend only loses it if it stops hearing from us. A
+// primary that goes down is only replaced once its lease has run out.
+#define PRIMARY_LEASE_MS 3000
 
 string config_file_location;
 bool verbose;
@@ -11,6 +15,9 @@ int listen_fd;
 unordered_map<string, vector<server_info *>> range_to_server_map;
 unordered_map<string, server_info *> range_to_primary_map;
 pthread_mutex_t map_and_list_mutex;
+// Bumped whenever a primary changes, so backends can drop older maps. It
+// starts from the clock so it keeps increasing across coordinator restarts.
+uint64_t primary_epoch;
 
 // Vector containing one struct per server in the config file.
 vector<server_info *> list_of_all_servers;
@@ -39,6 +46,59 @@ string list_servers_status() {
   return server_list + "\r\n";
 }
 
+/**
+ * Describes the primary of every range.
+ *
+ * @return std::string "<epoch> <lease_ms> <range>=<ip:port> ...", with "-"
+ * for a range whose primary is down.
+ *
+ * Backends cache this map for PRIMARY_LEASE_MS instead of asking for the
+ * primary of every request.
+ */
+string primary_map_entries() {
+  pthread_mutex_lock(&map_and_list_mutex);
+  string entries =
+      to_string(primary_epoch) + " " + to_string(PRIMARY_LEASE_MS);
+  for (const auto &[range, primary] : range_to_primary_map) {
+    entries += " " + range + "=" +
+               (primary != nullptr && primary->is_active
+                    ? primary->ip + ":" + to_string(primary->port)
+                    : "-");
+  }
+  pthread_mutex_unlock(&map_and_list_mutex);
+  return entries;
+}
+
+/**
+ * Pushes the primary map to a backend.
+ *
+ * @param server The backend.
+ * @param entries The map, as returned by primary_map_entries.
+ *
+ * The backend installs the map and renews its lease. Failures are ignored:
+ * a backend that misses pushes asks for the map itself with PMAP.
+ */
+void push_primary_map(server_info *server, const string &entries) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    return;
+  }
+  struct sockaddr_in server_addr;
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(server->port);
+  server_addr.sin_addr.s_addr = inet_addr(server->ip.c_str());
+  read_buffer push_buf;
+  string_view frame;
+  if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) ==
+          0 &&
+      read_frame(sock, push_buf, frame)) {
+    string message = "PMAP " + entries + "\r\nquit\r\n";
+    send(sock, message.c_str(), message.length(), MSG_NOSIGNAL);
+    read_frame(sock, push_buf, frame);
+  }
+  close(sock);
+}
+
 /**
  * Handles the heartbeat mechanism for checking server availability.
  *
@@ -73,19 +133,29 @@ void *handle_heartbeat(void *arg) {
         server->is_active = false;
       } else {
         // Connection successful, send heartbeat message
-        char welcome_buffer[1024] = {0};
-        read(sock, welcome_buffer, 1024);
+        read_buffer heartbeat_buf;
+        bool alive = negotiate_protocol_v2(sock, heartbeat_buf);
 
         F_2_B_Message message;
         message.type = 1;
         message.rowkey = "test_row";
         message.colkey = "test_col";
-        std::string serialized_message = encode_message(message);
-        send(sock, serialized_message.c_str(), serialized_message.length(), 0);
-        char response_buffer[1024] = {0};
-        read(sock, response_buffer, 1024);
-        std::string response_str(response_buffer);
-        F_2_B_Message response = decode_message(response_str);
+        message.status = 0;
+        message.isFromPrimary = 0;
+        std::string serialized_message = heartbeat_buf.binary
+                                             ? encode_message_v2(message)
+                                             : encode_message(message);
+        if (alive) {
+          alive = send(sock, serialized_message.c_str(),
+                       serialized_message.length(), MSG_NOSIGNAL) > 0;
+        }
+        string_view frame;
+        F_2_B_Message response;
+        response.status = 2;
+        if (alive && read_frame(sock, heartbeat_buf, frame)) {
+          response = heartbeat_buf.binary ? decode_message_v2(frame)
+                                          : decode_message(string(frame));
+        }
         if (response.status == 2) {
           // Server response indicates it is down
           cout << "Server " << server->ip << ":" << server->port << " is down."
@@ -101,9 +171,25 @@ void *handle_heartbeat(void *arg) {
       }
     }
     // Update primary servers and print their details
-    update_primary(range_to_primary_map, range_to_server_map,
-                   map_and_list_mutex);
+    if (update_primary(range_to_primary_map, range_to_server_map,
+                       map_and_list_mutex)) {
+      pthread_mutex_lock(&map_and_list_mutex);
+      primary_epoch++;
+      pthread_mutex_unlock(&map_and_list_mutex);
+    }
     print_primaries(range_to_primary_map);
+
+    // Renew every live backend's lease, and tell it of any failover. A push
+    // returns once the backend has replied or is gone, so its lease ends
+    // no later than PRIMARY_LEASE_MS from then.
+    string entries = primary_map_entries();
+    for (server_info *server : list_of_all_servers) {
+      if (server->is_active) {
+        push_primary_map(server, entries);
+        server->lease_until = chrono::steady_clock::now() +
+                              chrono::milliseconds(PRIMARY_LEASE_MS);
+      }
+    }
     // Wait for 2 seconds before next check
     sleep(HEARTBEAT_TIME);
   }
@@ -194,6 +280,7 @@ int main(int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
   pthread_mutex_init(&map_and_list_mutex, NULL);
+  primary_epoch = time(NULL);
   populate_list_of_servers(config_file_location, list_of_all_servers,
                            range_to_server_map);
   initialize_primaries(range_to_primary_map, range_to_server_map,
@@ -210,7 +297,6 @@ int main(int argc, char *argv[]) {
   // Make a while loop that listens to new requests from the frontend servers
   // and calls a thread for each connection.
 
-  char buffer[MAX_BUFFER_SIZE];
   while (true) {
     sockaddr_in client_sockaddr;
     socklen_t client_socklen = sizeof(client_sockaddr);
@@ -229,8 +315,14 @@ int main(int argc, char *argv[]) {
       cout << "[" << client_fd << "] New connection\n";
     }
 
-    bzero(&buffer, sizeof(buffer));
-    do_read(client_fd, buffer);
+    // Each connection carries a single request line
+    read_buffer client_buf;
+    string_view frame;
+    string request;
+    if (read_frame(client_fd, client_buf, frame)) {
+      request = string(frame);
+    }
+    const char *buffer = request.c_str();
 
     if (strncmp(buffer, "GET ", 4) == 0) {
       char row_key[MAX_BUFFER_SIZE];
@@ -308,6 +400,13 @@ int main(int argc, char *argv[]) {
           break;
         }
       }
+    } else if (strncmp(buffer, "PMAP\r\n", 6) == 0) {
+      string response = "+OK " + primary_map_entries() + "\r\n";
+      size_t n = send(client_fd, response.c_str(), response.length(), 0);
+      if (n < 0) {
+        cerr << "[" << client_fd << "] Error in send(). Exiting" << endl;
+        break;
+      }
     } else if (strncmp(buffer, "LIST\r\n", 6) == 0) {
       string response = list_servers_status();
       size_t n = send(client_fd, response.c_str(), response.length(), 0);
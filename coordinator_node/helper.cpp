@@ -1,51 +1,6 @@
 #include "helper.h"
 using namespace std;
 
-/**
- * Reads data from the client socket until a specific sequence is encountered.
- *
- * @param client_fd The file descriptor of the client socket.
- * @param client_buf The buffer to store the read data.
- * @return bool Returns true if successful reading, false otherwise.
- */
-bool do_read(int client_fd, char *client_buf) {
-  size_t n = MAX_BUFFER_SIZE;
-  size_t bytes_left = n;
-  bool r_arrived = false;
-
-  while (bytes_left > 0) {
-    ssize_t result = read(client_fd, client_buf + n - bytes_left, 1);
-
-    if (result == -1) {
-      // Handle read errors
-      if ((errno == EINTR) || (errno == EAGAIN)) {
-        continue; // Retry if interrupted or non-blocking operation
-      }
-      return false; // Return false for other errors
-    } else if (result == 0) {
-      return false; // Return false if connection closed by client
-    }
-
-    // Check if \r\n sequence has arrived
-    if (r_arrived && client_buf[n - bytes_left] == '\n') {
-      client_buf[n - bytes_left + 1] = '\0'; // Null-terminate the string
-      break;                                 // Exit the loop
-    } else {
-      r_arrived = false;
-    }
-
-    // Check if \r has arrived
-    if (client_buf[n - bytes_left] == '\r') {
-      r_arrived = true;
-    }
-
-    bytes_left -= result; // Update bytes_left counter
-  }
-
-  client_buf[MAX_BUFFER_SIZE - 1] = '\0'; // Null-terminate the string
-  return true; // Return true indicating successful reading
-}
-
 /**
  * Retrieves the range associated with the given rowname from a range-to-server
  * mapping.
@@ -251,6 +206,9 @@ void populate_list_of_servers(
   }
 
   while (std::getline(config_file, line)) {
+    // Replication policy lines are only read by the backend servers
+    if (line.rfind("replication ", 0) == 0)
+      continue;
     std::stringstream ss(line);
     std::string server_details, dummy, range;
     getline(ss, server_details,
@@ -319,26 +277,31 @@ void print_primaries(
  * @param range_to_primary_map The mapping of range to primary server information.
  * @param range_to_server_map The mapping of range to server information.
  * @param map_and_list_mutex The mutex to ensure thread safety while updating maps and lists.
- * @return void
+ * @return bool true if the primary of any range changed.
  *
  * This function updates the primary server for each range if the current primary server is inactive.
+ * An inactive primary may still be serving writes on the last map it was sent, so it is only
+ * replaced once its lease has run out; until then the range has no primary.
  * It acquires a mutex lock to ensure thread safety while accessing and modifying the maps and lists.
  * If an active server is found for a range, it updates the primary server and prints the update message.
  * If no active server is available for a range, it prints an error message.
  */
-void update_primary(
+bool update_primary(
     unordered_map<string, server_info *> &range_to_primary_map,
     unordered_map<string, vector<server_info *>> range_to_server_map,
     pthread_mutex_t &map_and_list_mutex) {
+  bool changed = false;
+  auto now = chrono::steady_clock::now();
   pthread_mutex_lock(&map_and_list_mutex);
   for (auto &entry : range_to_primary_map) {
     const string &range = entry.first;
     server_info *current_primary = entry.second;
 
-    if (!current_primary->is_active) {
+    if (!current_primary->is_active && now >= current_primary->lease_until) {
       server_info *new_primary =
           get_random_server_for_range(range, range_to_server_map);
       if (new_primary) {
+        changed = changed || new_primary != current_primary;
         entry.second = new_primary;
         cout << "Updated primary for range " << range << " to server "
              << new_primary->ip << ":" << new_primary->port << endl;
@@ -348,6 +311,7 @@ void update_primary(
     }
   }
   pthread_mutex_unlock(&map_and_list_mutex);
+  return changed;
 }
 
 /**
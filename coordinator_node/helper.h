@@ -1,5 +1,7 @@
+#include "../utils/read_buffer.h"
 #include "../utils/utils.h"
 #include <arpa/inet.h>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <pthread.h>
@@ -22,9 +24,11 @@ struct server_info {
   std::string ip;
   int port;
   bool is_active;
+  // Until when the server may still trust the last primary map it was sent;
+  // it is only replaced as a primary once this has passed
+  std::chrono::steady_clock::time_point lease_until;
 };
 
-bool do_read(int client_fd, char *client_buf);
 std::string get_range_from_rowname(
     const std::string &rowname,
     const std::unordered_map<std::string, std::vector<server_info *>>
@@ -46,7 +50,7 @@ void populate_list_of_servers(
         &range_to_server_map);
 void print_primaries(
     std::unordered_map<std::string, server_info *> &range_to_primary_map);
-void update_primary(
+bool update_primary(
     std::unordered_map<std::string, server_info *> &range_to_primary_map,
     std::unordered_map<std::string, std::vector<server_info *>>
         range_to_server_map,
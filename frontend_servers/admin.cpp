@@ -10,10 +10,13 @@
 #include <map>
 
 #include "admin.h"
+#include "../utils/read_buffer.h"
 #include "../utils/utils.h"
 using namespace std;
 
 #define MAX_BUFFER_SIZE 1024
+// Rows asked for per LIST request when fetching a server's data
+#define LIST_PAGE_ROWS 500
 
 /**
  * @brief Retrieves a list of backend servers from the coordinator.
@@ -236,9 +239,10 @@ string get_admin_html_from_vector(const vector<server_info> &frontend_servers, c
 /**
  * @brief Fetches data from a server.
  *
- * This function connects to a server at the given IP and port,
- * sends a request to list data, and parses the response to
- * extract key-value pairs of data.
+ * This function connects to a server at the given IP and port and lists
+ * its data page by page, each LIST request carrying the cursor returned
+ * with the previous page, until the server reports there is no more. The
+ * server holds no lock while it sends a page.
  *
  * @param ip The IP address of the server.
  * @param port The port number of the server.
@@ -258,67 +262,55 @@ map<string, map<string, string>> fetch_data_from_server(const string &ip, int po
     addr.sin_port = htons(port);
     inet_pton(AF_INET, ip.c_str(), &addr.sin_addr);
 
-    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    // Binary frames keep values containing "\r\n" intact
+    read_buffer buf;
+    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || !negotiate_protocol_v2(sockfd, buf))
     {
         cerr << "Connection failed." << endl;
         close(sockfd);
         return {};
     }
-    char welcome_buffer[MAX_BUFFER_SIZE] = {0};
-    read(sockfd, welcome_buffer, MAX_BUFFER_SIZE);
-    // cout << "Ignored message: " << welcome_buffer << endl; // Optionally log the ignored message
-
-    F_2_B_Message request_msg;
-    request_msg.type = 10;
-    request_msg.rowkey = "list";
-    request_msg.colkey = "list";
-    request_msg.value = "";
-    request_msg.value2 = "";
-    request_msg.status = 0;
-    request_msg.isFromPrimary = 0;
-    request_msg.errorMessage = "";
-
-    string serialized = encode_message(request_msg);
-    send(sockfd, serialized.c_str(), serialized.length(), 0);
 
     map<string, map<string, string>> data;
-    string total_data;
-    bool breakingFlag = false;
-
-    while (true)
+    string cursor;
+    do
     {
-        if (breakingFlag)
-            break;
-
-        char buffer[MAX_BUFFER_SIZE] = {0};
-        int bytes_received = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-        if (bytes_received <= 0)
-            break;
-
-        total_data += string(buffer, bytes_received);
-        // cout << total_data << endl;
-
-        size_t pos = 0;
-        while ((pos = total_data.find("\r\n")) != string::npos)
+        F_2_B_Message request_msg;
+        request_msg.type = F2B_TYPE_LIST;
+        request_msg.rowkey = "";
+        request_msg.colkey = "";
+        request_msg.value = cursor;
+        request_msg.value2 = to_string(LIST_PAGE_ROWS);
+        request_msg.status = 0;
+        request_msg.isFromPrimary = 0;
+        request_msg.errorMessage = "";
+
+        string serialized = buf.binary ? encode_message_v2(request_msg) : encode_message(request_msg);
+        send(sockfd, serialized.c_str(), serialized.length(), 0);
+
+        // Cells stream in until the closing "terminate" message
+        bool page_done = false;
+        string_view frame;
+        while (!page_done && read_frame(sockfd, buf, frame))
         {
-            string message = total_data.substr(0, pos);
-            total_data.erase(0, pos + 2);
-
-            F_2_B_Message response = decode_message(message);
-            if (response.status == 2)
+            F_2_B_Message response = buf.binary ? decode_message_v2(frame) : decode_message(string(frame));
+            if (response.status != 0)
             {
-                breakingFlag = true;
                 break;
             }
             if (response.rowkey == "terminate" && response.colkey == "terminate")
             {
-                breakingFlag = true;
+                cursor = response.value;
+                page_done = true;
                 break;
             }
-
             data[response.rowkey][response.colkey] = response.value;
         }
-    }
+        if (!page_done)
+        {
+            break;
+        }
+    } while (!cursor.empty());
 
     close(sockfd);
     return data;
@@ -69,47 +69,29 @@ F_2_B_Message send_and_receive_msg(int fd, const string &addr_str, F_2_B_Message
     msg_to_return.status = 2;
     return msg_to_return;
   }
-  string to_send = encode_message(msg);
+  // Ask for binary frames so values need no escaping; an older backend
+  // keeps talking text
+  read_buffer backend_buf;
+  if (!negotiate_protocol_v2(new_fd, backend_buf))
+  {
+    cerr << "Handshake with Backend failed." << endl;
+    close(new_fd);
+    msg_to_return.status = 2;
+    return msg_to_return;
+  }
+  string to_send = backend_buf.binary ? encode_message_v2(msg) : encode_message(msg);
 
   send_message(new_fd, to_send);
   // Receive response from the server
-  string buffer;
-  while (true)
+  string_view frame;
+  if (read_frame(new_fd, backend_buf, frame))
   {
-    const unsigned int BUFFER_SIZE = 1024;
-    char temp_buffer[BUFFER_SIZE];
-    memset(temp_buffer, 0, BUFFER_SIZE);
-    ssize_t bytes_received = recv(new_fd, temp_buffer, BUFFER_SIZE - 1, 0);
-
-    if (bytes_received == -1)
-    {
-      cerr << "Receiving message failed.\n";
-      continue;
-    }
-    else if (bytes_received == 0)
-    {
-      cout << "Server closed the connection.\n";
-      break;
-    }
-    else
-    {
-      temp_buffer[bytes_received] = '\0';
-      buffer += string(temp_buffer);
-    }
-
-    size_t pos;
-    while ((pos = buffer.find("\r\n")) != string::npos)
-    {
-      string line = buffer.substr(0, pos);
-      buffer.erase(0, pos + 2);
-
-      if (!line.empty() && line != "WELCOME TO THE SERVER")
-      {
-        msg_to_return = decode_message(line);
-        close(new_fd);
-        return msg_to_return;
-      }
-    }
+    msg_to_return = backend_buf.binary ? decode_message_v2(frame) : decode_message(string(frame));
+  }
+  else
+  {
+    cout << "Server closed the connection.\n";
+    msg_to_return.status = 2;
   }
   close(new_fd);
   return msg_to_return;
@@ -249,4 +231,200 @@ int send_msg_to_backend(int fd, F_2_B_Message msg_to_send, string &value, int &s
   }
 
   return 0;
-}
\ No newline at end of file
+}
+
+int send_batch_to_backend(int fd, const vector<F_2_B_Message> &ops, vector<F_2_B_Message> &results,
+                          const string &rowkey, map<string, string> &g_map_rowkey_to_server,
+                          sockaddr_in g_coordinator_addr, const string &type)
+{
+  results.clear();
+  if (ops.empty())
+  {
+    return 0;
+  }
+  string backend_serveraddr_str = get_backend_server_addr(fd, rowkey, ops.front().colkey, g_map_rowkey_to_server,
+                                                          g_coordinator_addr, type);
+  if (backend_serveraddr_str.empty())
+  {
+    return 1;
+  }
+  g_map_rowkey_to_server[rowkey] = backend_serveraddr_str;
+
+  F_2_B_Message batch = construct_msg(F2B_TYPE_BATCH, rowkey, "", encode_batch(ops), "", "", 0);
+  try
+  {
+    F_2_B_Message response_msg = send_and_receive_msg(fd, backend_serveraddr_str, batch);
+    if (response_msg.status != 0 || response_msg.type != F2B_TYPE_BATCH)
+    {
+      return 2;
+    }
+    results = decode_batch(response_msg.value);
+  }
+  catch (const std::exception &e)
+  {
+    cerr << "ERROR: " << e.what() << endl;
+    return 2;
+  }
+  if (results.size() != ops.size())
+  {
+    results.clear();
+    return 2;
+  }
+  return 0;
+}
+
+/**
+ * Builds the reply handed to callers whose request was lost with the connection.
+ */
+static F_2_B_Message connection_lost_msg()
+{
+  F_2_B_Message msg = construct_msg(0, "", "", "", "", "Connection to Backend lost", 2);
+  return msg;
+}
+
+/**
+ * Reader thread of a pipeline: routes every reply to the promise of its request until the connection
+ * closes, then fails whatever is still pending.
+ */
+static void *pipeline_reader(void *arg)
+{
+  backend_pipeline *pipeline = static_cast<backend_pipeline *>(arg);
+  string_view frame;
+  while (read_frame(pipeline->fd, pipeline->buf, frame))
+  {
+    F_2_B_Message reply;
+    try
+    {
+      reply = decode_message_v2(frame);
+    }
+    catch (const std::exception &e)
+    {
+      cerr << "Malformed reply from Backend: " << e.what() << endl;
+      break;
+    }
+
+    pthread_mutex_lock(&pipeline->pending_mutex);
+    auto it = pipeline->pending.find(reply.requestId);
+    if (it != pipeline->pending.end())
+    {
+      it->second.set_value(std::move(reply));
+      pipeline->pending.erase(it);
+    }
+    pthread_mutex_unlock(&pipeline->pending_mutex);
+  }
+
+  pthread_mutex_lock(&pipeline->pending_mutex);
+  pipeline->broken = true;
+  for (auto &entry : pipeline->pending)
+  {
+    entry.second.set_value(connection_lost_msg());
+  }
+  pipeline->pending.clear();
+  pthread_mutex_unlock(&pipeline->pending_mutex);
+  return nullptr;
+}
+
+bool open_pipeline(backend_pipeline &pipeline, const string &addr_str)
+{
+  sockaddr_in addr = get_socket_address(addr_str);
+  pipeline.fd = create_socket();
+  if (connect(pipeline.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    cerr << "Connection to Backend failed." << endl;
+    close(pipeline.fd);
+    pipeline.fd = -1;
+    return false;
+  }
+  if (!negotiate_protocol_v2(pipeline.fd, pipeline.buf) || !pipeline.buf.binary)
+  {
+    close(pipeline.fd);
+    pipeline.fd = -1;
+    return false;
+  }
+  if (pthread_create(&pipeline.reader, nullptr, pipeline_reader, &pipeline) != 0)
+  {
+    cerr << "Failed to start pipeline reader." << endl;
+    close(pipeline.fd);
+    pipeline.fd = -1;
+    return false;
+  }
+  return true;
+}
+
+std::future<F_2_B_Message> submit_request(backend_pipeline &pipeline, F_2_B_Message msg)
+{
+  std::promise<F_2_B_Message> promise;
+  std::future<F_2_B_Message> future = promise.get_future();
+
+  // Register the request before sending it, so its reply always finds it
+  pthread_mutex_lock(&pipeline.pending_mutex);
+  if (pipeline.broken)
+  {
+    pthread_mutex_unlock(&pipeline.pending_mutex);
+    promise.set_value(connection_lost_msg());
+    return future;
+  }
+  msg.requestId = pipeline.next_request_id++;
+  pipeline.pending.emplace(msg.requestId, std::move(promise));
+  pthread_mutex_unlock(&pipeline.pending_mutex);
+
+  string to_send = encode_message_v2(msg);
+  pthread_mutex_lock(&pipeline.send_mutex);
+  size_t sent = 0;
+  while (sent < to_send.size())
+  {
+    ssize_t n = send(pipeline.fd, to_send.data() + sent, to_send.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0)
+    {
+      cerr << "Sending message failed.\n";
+      // Wakes the reader, which fails every pending request
+      shutdown(pipeline.fd, SHUT_RDWR);
+      break;
+    }
+    sent += n;
+  }
+  pthread_mutex_unlock(&pipeline.send_mutex);
+  return future;
+}
+
+void close_pipeline(backend_pipeline &pipeline)
+{
+  if (pipeline.fd < 0)
+  {
+    return;
+  }
+  shutdown(pipeline.fd, SHUT_RDWR);
+  pthread_join(pipeline.reader, nullptr);
+  close(pipeline.fd);
+  pipeline.fd = -1;
+}
+
+vector<F_2_B_Message> send_pipelined(const string &addr_str, const vector<F_2_B_Message> &msgs)
+{
+  vector<F_2_B_Message> replies;
+  replies.reserve(msgs.size());
+
+  backend_pipeline pipeline;
+  if (!open_pipeline(pipeline, addr_str))
+  {
+    // Older backends only understand one request per connection
+    for (const F_2_B_Message &msg : msgs)
+    {
+      replies.push_back(send_and_receive_msg(-1, addr_str, msg));
+    }
+    return replies;
+  }
+
+  vector<std::future<F_2_B_Message>> futures;
+  futures.reserve(msgs.size());
+  for (const F_2_B_Message &msg : msgs)
+  {
+    futures.push_back(submit_request(pipeline, msg));
+  }
+  for (std::future<F_2_B_Message> &future : futures)
+  {
+    replies.push_back(future.get());
+  }
+  close_pipeline(pipeline);
+  return replies;
+}
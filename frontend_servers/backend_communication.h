@@ -4,9 +4,13 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <future>
+#include <pthread.h>
+#include <unordered_map>
 #include <cstdlib> // for EXIT_FAILURE
 #include <sys/socket.h> // for socket() and related constants
 #include <netinet/in.h>
+#include "../utils/read_buffer.h"
 #include "../utils/utils.h"
 
 
@@ -131,4 +135,80 @@ int send_msg_to_backend(int fd, F_2_B_Message msg_to_send, std::string &value, i
                         std::map<std::string, std::string> &g_map_rowkey_to_server, sockaddr_in g_coordinator_addr,
                         const std::string &type);
 
+/**
+ * A single connection to a backend server that carries many requests at once. Every request is tagged
+ * with a request id and the backend may answer in any order; a reader thread matches each reply to its
+ * request and fulfils the future handed out by submit_request. Requires a backend that accepts the binary
+ * protocol, since text replies carry no request id.
+ */
+struct backend_pipeline
+{
+  int fd = -1;
+  read_buffer buf;
+  uint32_t next_request_id = 1;
+  std::unordered_map<uint32_t, std::promise<F_2_B_Message>> pending; // Requests awaiting a reply
+  bool broken = false;                                                // The connection has failed
+  pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_t reader;
+};
+
+/**
+ * Connects to a backend server, negotiates the binary protocol and starts the reader thread of a pipeline.
+ *
+ * @param pipeline The pipeline to open. It must not be moved while open.
+ * @param addr_str The IP address and port of the backend server.
+ * @return true if the pipeline is ready for requests, false if the server could not be reached or does not
+ *         support pipelining.
+ */
+bool open_pipeline(backend_pipeline &pipeline, const std::string &addr_str);
+
+/**
+ * Sends a request over an open pipeline without waiting for its reply. Many requests may be submitted
+ * back to back; the returned future becomes ready once the backend answers this particular request. If the
+ * connection fails, the future holds a message with status 2.
+ *
+ * @param pipeline The open pipeline to send on.
+ * @param msg The message to send. Its request id is assigned by the pipeline.
+ * @return A future holding the backend's reply.
+ */
+std::future<F_2_B_Message> submit_request(backend_pipeline &pipeline, F_2_B_Message msg);
+
+/**
+ * Closes the connection of a pipeline and stops its reader thread. Requests still waiting for a reply
+ * complete with status 2.
+ *
+ * @param pipeline The pipeline to close.
+ */
+void close_pipeline(backend_pipeline &pipeline);
+
+/**
+ * Sends a list of messages to one backend server over a single pipelined connection and collects all the
+ * replies. Falls back to one connection per message when the server does not support pipelining.
+ *
+ * @param addr_str The IP address and port of the backend server.
+ * @param msgs The messages to send.
+ * @return The replies, in the same order as msgs.
+ */
+std::vector<F_2_B_Message> send_pipelined(const std::string &addr_str, const std::vector<F_2_B_Message> &msgs);
+
+/**
+ * Sends several GET/PUT/DELETE/CPUT operations to the backend as one batch message. The backend applies
+ * the operations of each tablet under a single lock and log record and answers with one result per
+ * operation, so the whole batch costs a single round trip. All operations should target the given rowkey,
+ * which decides the backend server the batch is routed to.
+ *
+ * @param fd The file descriptor for network communication.
+ * @param ops The operations to perform, built with construct_msg.
+ * @param results Receives one reply per operation, in the same order as ops.
+ * @param rowkey The rowkey used to pick the backend server.
+ * @param g_map_rowkey_to_server A reference to a map storing backend server addresses.
+ * @param g_coordinator_addr The network address configuration of the coordinator.
+ * @param type The type of operation to be performed, influencing server selection.
+ * @return 0 on success, 1 if the coordinator could not be reached, 2 if the backend failed.
+ */
+int send_batch_to_backend(int fd, const std::vector<F_2_B_Message> &ops, std::vector<F_2_B_Message> &results,
+                          const std::string &rowkey, std::map<std::string, std::string> &g_map_rowkey_to_server,
+                          sockaddr_in g_coordinator_addr, const std::string &type);
+
 #endif // BACKEND_COMMUNICATION_H
@@ -7,79 +7,37 @@ using namespace std;
 
 BulletinMsg retrieve_bulletin_msg(int fd, const string &uid, map<string, string> &g_map_rowkey_to_server, sockaddr_in g_coordinator_addr)
 {
-    string response_value, response_error_msg;
-    string rowkey, colkey, type;
-    int response_status, response_code;
-    F_2_B_Message msg_to_send;
+    string rowkey, type;
+    int response_code;
     BulletinMsg msg;
 
     msg.uid = uid;
 
     rowkey = "bulletin/" + uid;
     type = "get";
-    // get owner
-    colkey = "owner";
-    msg_to_send = construct_msg(1, rowkey, colkey, "", "", "", 0);
-    response_code = send_msg_to_backend(fd, msg_to_send, response_value, response_status,
-                                        response_error_msg, rowkey, colkey, g_map_rowkey_to_server,
-                                        g_coordinator_addr, type);
-    if (response_code == 1)
-    {
-        cerr << "ERROR in communicating with coordinator" << endl;
-    }
-    else if (response_code == 2)
-    {
-        cerr << "ERROR in communicating with backend" << endl;
-    }
-    msg.owner = base64_decode(response_value);
-
-    // get timestamp
-    colkey = "timestamp";
-    msg_to_send = construct_msg(1, rowkey, colkey, "", "", "", 0);
-    response_code = send_msg_to_backend(fd, msg_to_send, response_value, response_status,
-                                        response_error_msg, rowkey, colkey, g_map_rowkey_to_server,
-                                        g_coordinator_addr, type);
-    if (response_code == 1)
-    {
-        cerr << "ERROR in communicating with coordinator" << endl;
-    }
-    else if (response_code == 2)
-    {
-        cerr << "ERROR in communicating with backend" << endl;
-    }
-    msg.timestamp = base64_decode(response_value);
-
-    // get title
-    colkey = "title";
-    msg_to_send = construct_msg(1, rowkey, colkey, "", "", "", 0);
-    response_code = send_msg_to_backend(fd, msg_to_send, response_value, response_status,
-                                        response_error_msg, rowkey, colkey, g_map_rowkey_to_server,
-                                        g_coordinator_addr, type);
-    if (response_code == 1)
-    {
-        cerr << "ERROR in communicating with coordinator" << endl;
-    }
-    else if (response_code == 2)
-    {
-        cerr << "ERROR in communicating with backend" << endl;
-    }
-    msg.title = base64_decode(response_value);
-
-    // get message
-    colkey = "message";
-    msg_to_send = construct_msg(1, rowkey, colkey, "", "", "", 0);
-    response_code = send_msg_to_backend(fd, msg_to_send, response_value, response_status,
-                                        response_error_msg, rowkey, colkey, g_map_rowkey_to_server,
-                                        g_coordinator_addr, type);
+    // get owner, timestamp, title and message in one batch
+    vector<F_2_B_Message> ops = {
+        construct_msg(1, rowkey, "owner", "", "", "", 0),
+        construct_msg(1, rowkey, "timestamp", "", "", "", 0),
+        construct_msg(1, rowkey, "title", "", "", "", 0),
+        construct_msg(1, rowkey, "message", "", "", "", 0)};
+    vector<F_2_B_Message> results;
+    response_code = send_batch_to_backend(fd, ops, results, rowkey, g_map_rowkey_to_server,
+                                          g_coordinator_addr, type);
     if (response_code == 1)
     {
         cerr << "ERROR in communicating with coordinator" << endl;
+        return msg;
     }
     else if (response_code == 2)
     {
         cerr << "ERROR in communicating with backend" << endl;
+        return msg;
     }
-    msg.message = base64_decode(response_value);
+    msg.owner = base64_decode(results[0].value);
+    msg.timestamp = base64_decode(results[1].value);
+    msg.title = base64_decode(results[2].value);
+    msg.message = base64_decode(results[3].value);
 
     return msg;
 }
@@ -48,20 +48,6 @@ int delete_file_chunks(int fd, const std::string &rowkey, std::map<std::string,
     try
     {
         no_chunks = std::stoi(value);
-
-        // Delete the number of chunks entry
-        F_2_B_Message delete_msg;
-        delete_msg.type = 3; // DELETE request
-        delete_msg.rowkey = rowkey;
-        delete_msg.colkey = "no_chunks";
-        delete_msg.isFromPrimary = 0;
-
-        result = send_msg_to_backend(fd, delete_msg, value, status, error_msg, rowkey, "no_chunks", g_map_rowkey_to_server, g_coordinator_addr, "delete");
-        if (result != 0 || status != 0)
-        {
-            std::cerr << "Failed to delete chunk entry";
-            return 1; // Stop and return failure
-        }
     }
     catch (const std::invalid_argument &e)
     {
@@ -76,22 +62,26 @@ int delete_file_chunks(int fd, const std::string &rowkey, std::map<std::string,
 
     cout << "Number of chunks: " << no_chunks << endl;
 
-    // Step 2: Delete each chunk
+    // Step 2: Delete the number of chunks entry and every chunk in one batch
+    vector<F_2_B_Message> ops = {construct_msg(3, rowkey, "no_chunks", "", "", "", 0)};
     for (int i = 1; i <= no_chunks; ++i)
     {
-        F_2_B_Message delete_msg;
-        delete_msg.type = 3; // DELETE request
-        delete_msg.rowkey = rowkey;
-        delete_msg.colkey = "content_" + std::to_string(i);
-        delete_msg.isFromPrimary = 0;
-
-        result = send_msg_to_backend(fd, delete_msg, value, status, error_msg, rowkey, "content_" + std::to_string(i), g_map_rowkey_to_server, g_coordinator_addr, "delete");
-        if (result != 0 || status != 0)
+        ops.push_back(construct_msg(3, rowkey, "content_" + std::to_string(i), "", "", "", 0));
+    }
+    vector<F_2_B_Message> results;
+    result = send_batch_to_backend(fd, ops, results, rowkey, g_map_rowkey_to_server, g_coordinator_addr, "delete");
+    if (result != 0)
+    {
+        std::cerr << "Failed to delete chunks" << std::endl;
+        return 1;
+    }
+    for (const F_2_B_Message &op_result : results)
+    {
+        if (op_result.status != 0)
         {
-            std::cerr << "Failed to delete chunk " << i << ": " << error_msg << std::endl;
-            return 1; // Stop and return failure if any deletion fails
+            std::cerr << "Failed to delete " << op_result.colkey << ": " << op_result.errorMessage << std::endl;
+            return 1; // Return failure if any deletion fails
         }
-        usleep(1000);
     }
 
     std::cout << "All chunks deleted successfully." << std::endl;
@@ -154,66 +144,63 @@ int copyChunks(int fd, const std::string &old_row_key, const std::string &new_ro
                                             put_response_error_msg, rowkey, colkey, g_map_rowkey_to_server,
                                             g_coordinator_addr, type);
 
-        // Copy each chunk
+        if (no_chunks == 0)
+        {
+            cout << "All chunks copied successfully." << endl;
+            return 0;
+        }
+
+        // Fetch every chunk of the old row over one pipelined connection
+        string get_addr = get_backend_server_addr(fd, old_row_key, "content_1", g_map_rowkey_to_server, g_coordinator_addr, "get");
+        if (get_addr.empty())
+        {
+            cerr << "ERROR in communicating with coordinator" << endl;
+            return 1;
+        }
+        vector<F_2_B_Message> chunk_gets;
         for (int i = 1; i <= no_chunks; ++i)
         {
-            string get_response_value, get_response_error_msg;
-            int get_response_status;
-            type = "get";
-            rowkey = old_row_key;
-            colkey = "content_" + std::to_string(i);
-
-            // Get chunk content from old row
-            msg_to_send_get = construct_msg(1, rowkey, colkey, "", "", "", 0);
-            response_code = send_msg_to_backend(fd, msg_to_send_get, get_response_value, get_response_status,
-                                                get_response_error_msg, rowkey, colkey, g_map_rowkey_to_server,
-                                                g_coordinator_addr, type);
-            if (response_code == 1)
-            {
-                cerr << "ERROR in communicating with coordinator" << endl;
-                return 1;
-            }
-            else if (response_code == 2)
+            chunk_gets.push_back(construct_msg(1, old_row_key, "content_" + std::to_string(i), "", "", "", 0));
+        }
+        vector<F_2_B_Message> chunks = send_pipelined(get_addr, chunk_gets);
+        for (const F_2_B_Message &chunk : chunks)
+        {
+            if (chunk.status == 2)
             {
                 cerr << "ERROR in communicating with backend" << endl;
                 return 2;
             }
+            if (chunk.status != 0)
+            {
+                // Error handling
+                return chunk.status;
+            }
+        }
 
-            if (get_response_status == 0)
+        // Write them to the new row the same way
+        string put_addr = get_backend_server_addr(fd, new_row_key, "content_1", g_map_rowkey_to_server, g_coordinator_addr, "put");
+        if (put_addr.empty())
+        {
+            cerr << "ERROR in communicating with coordinator" << endl;
+            return 1;
+        }
+        vector<F_2_B_Message> chunk_puts;
+        for (const F_2_B_Message &chunk : chunks)
+        {
+            chunk_puts.push_back(construct_msg(2, new_row_key, chunk.colkey, chunk.value, "", "", 0));
+        }
+        for (const F_2_B_Message &put_response : send_pipelined(put_addr, chunk_puts))
+        {
+            if (put_response.status == 2)
             {
-                // Put chunk content to new row
-                string put_response_value, put_response_error_msg;
-                int put_response_status;
-                type = "put";
-                rowkey = new_row_key;
-                F_2_B_Message msg_to_send_put = construct_msg(2, new_row_key, colkey, get_response_value, "", "", 0);
-                response_code = send_msg_to_backend(fd, msg_to_send_put, put_response_value, put_response_status,
-                                                    put_response_error_msg, rowkey, colkey, g_map_rowkey_to_server,
-                                                    g_coordinator_addr, type);
-
-                if (response_code == 1)
-                {
-                    cerr << "ERROR in communicating with coordinator" << endl;
-                    return 1;
-                }
-                else if (response_code == 2)
-                {
-                    cerr << "ERROR in communicating with backend" << endl;
-                    return 2;
-                }
-
-                if (put_response_status != 0)
-                {
-                    // Error handling
-                    return put_response_status;
-                }
+                cerr << "ERROR in communicating with backend" << endl;
+                return 2;
             }
-            else
+            if (put_response.status != 0)
             {
                 // Error handling
-                return get_response_status;
+                return put_response.status;
             }
-            usleep(1000);
         }
         cout << "All chunks copied successfully." << endl;
         return 0;
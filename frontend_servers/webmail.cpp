@@ -446,103 +446,20 @@ int put_email_to_backend(const string &uid, const string &encoded_from, const st
                          map<string, string> &g_map_rowkey_to_server, sockaddr_in g_coordinator_addr)
 {
     int fd = create_socket();
-    string response_value, response_error_msg;
-    F_2_B_Message msg_to_send;
-    int response_status, response_code;
     string type = "put";
     string rowkey = "email/" + uid;
 
-    // put from
-    string colkey = "from";
-    msg_to_send = construct_msg(2, rowkey, colkey, encoded_from, "", "", 0);
-    response_code = send_msg_to_backend(fd, msg_to_send, response_value, response_status,
-                                        response_error_msg, rowkey, colkey, g_map_rowkey_to_server,
-                                        g_coordinator_addr, type);
-    if (response_code == 1)
-    {
-        cerr << "ERROR in communicating with coordinator" << endl;
-        return 1;
-    }
-    else if (response_code == 2)
-    {
-        cerr << "ERROR in communicating with backend" << endl;
-        return 2;
-    }
-
-    // put to
-    colkey = "to";
-    msg_to_send = construct_msg(2, rowkey, colkey, encoded_to, "", "", 0);
-    response_code = send_msg_to_backend(fd, msg_to_send, response_value, response_status,
-                                        response_error_msg, rowkey, colkey, g_map_rowkey_to_server,
-                                        g_coordinator_addr, type);
-    if (response_code == 1)
-    {
-        cerr << "ERROR in communicating with coordinator" << endl;
-        return 1;
-    }
-    else if (response_code == 2)
-    {
-        cerr << "ERROR in communicating with backend" << endl;
-        return 2;
-    }
-
-    // put ts
-    colkey = "timestamp";
-    msg_to_send = construct_msg(2, rowkey, colkey, encoded_ts, "", "", 0);
-    response_code = send_msg_to_backend(fd, msg_to_send, response_value, response_status,
-                                        response_error_msg, rowkey, colkey, g_map_rowkey_to_server,
-                                        g_coordinator_addr, type);
-    if (response_code == 1)
-    {
-        cerr << "ERROR in communicating with coordinator" << endl;
-        return 1;
-    }
-    else if (response_code == 2)
-    {
-        cerr << "ERROR in communicating with backend" << endl;
-        return 2;
-    }
-
-    // put subject
-    colkey = "subject";
-    msg_to_send = construct_msg(2, rowkey, colkey, encoded_subject, "", "", 0);
-    response_code = send_msg_to_backend(fd, msg_to_send, response_value, response_status,
-                                        response_error_msg, rowkey, colkey, g_map_rowkey_to_server,
-                                        g_coordinator_addr, type);
-    if (response_code == 1)
-    {
-        cerr << "ERROR in communicating with coordinator" << endl;
-        return 1;
-    }
-    else if (response_code == 2)
-    {
-        cerr << "ERROR in communicating with backend" << endl;
-        return 2;
-    }
-
-    // put body
-    colkey = "body";
-    msg_to_send = construct_msg(2, rowkey, colkey, encoded_body, "", "", 0);
-    response_code = send_msg_to_backend(fd, msg_to_send, response_value, response_status,
-                                        response_error_msg, rowkey, colkey, g_map_rowkey_to_server,
-                                        g_coordinator_addr, type);
-    if (response_code == 1)
-    {
-        cerr << "ERROR in communicating with coordinator" << endl;
-        return 1;
-    }
-    else if (response_code == 2)
-    {
-        cerr << "ERROR in communicating with backend" << endl;
-        return 2;
-    }
-
-    // put display
-    colkey = "display";
-    msg_to_send = construct_msg(2, rowkey, colkey, encoded_display, "", "", 0);
-    response_code = send_msg_to_backend(fd, msg_to_send, response_value, response_status,
-                                        response_error_msg, rowkey, colkey, g_map_rowkey_to_server,
-                                        g_coordinator_addr, type);
+    // Write every field of the email in one batch
+    vector<F_2_B_Message> ops = {
+        construct_msg(2, rowkey, "from", encoded_from, "", "", 0),
+        construct_msg(2, rowkey, "to", encoded_to, "", "", 0),
+        construct_msg(2, rowkey, "timestamp", encoded_ts, "", "", 0),
+        construct_msg(2, rowkey, "subject", encoded_subject, "", "", 0),
+        construct_msg(2, rowkey, "body", encoded_body, "", "", 0),
+        construct_msg(2, rowkey, "display", encoded_display, "", "", 0)};
+    vector<F_2_B_Message> results;
+    int response_code = send_batch_to_backend(fd, ops, results, rowkey, g_map_rowkey_to_server,
+                                              g_coordinator_addr, type);
     if (response_code == 1)
     {
         cerr << "ERROR in communicating with coordinator" << endl;
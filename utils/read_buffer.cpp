@@ -0,0 +1,223 @@
+#include "read_buffer.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+/**
+ * @brief Makes room for at least READ_CHUNK_SIZE more bytes.
+ *
+ * Consumed bytes at the front are reclaimed first; the buffer only grows when
+ * a single frame is larger than the space already allocated.
+ *
+ * @param buf The buffer to prepare for the next read.
+ */
+static void reserve_tail(read_buffer &buf)
+{
+  if (buf.data.size() - buf.end >= READ_CHUNK_SIZE)
+  {
+    return;
+  }
+  if (buf.start > 0)
+  {
+    memmove(buf.data.data(), buf.data.data() + buf.start, buf.end - buf.start);
+    buf.end -= buf.start;
+    buf.scan_from -= buf.start;
+    buf.start = 0;
+  }
+  if (buf.data.size() - buf.end < READ_CHUNK_SIZE)
+  {
+    buf.data.resize(max(buf.data.size() * 2, buf.end + READ_CHUNK_SIZE));
+  }
+}
+
+/**
+ * @brief Reads whatever is available on fd into the buffer.
+ *
+ * @param buf The buffer to append to.
+ * @param fd The file descriptor to read from.
+ * @return The result of read(): bytes read, 0 on EOF or -1 on error.
+ */
+ssize_t read_buffer_fill(read_buffer &buf, int fd)
+{
+  reserve_tail(buf);
+  ssize_t n = read(fd, buf.data.data() + buf.end, buf.data.size() - buf.end);
+  if (n > 0)
+  {
+    buf.end += n;
+  }
+  return n;
+}
+
+/**
+ * @brief Reads the body length of the binary frame at the head of the buffer.
+ *
+ * @param buf The buffer in binary mode.
+ * @param body_length Set to the length announced by the frame header.
+ * @return false if the 4-byte header has not fully arrived yet.
+ */
+static bool peek_body_length(const read_buffer &buf, size_t &body_length)
+{
+  if (buf.end - buf.start < 4)
+  {
+    return false;
+  }
+  const unsigned char *header = reinterpret_cast<const unsigned char *>(buf.data.data() + buf.start);
+  body_length = (size_t(header[0]) << 24) | (size_t(header[1]) << 16) |
+                (size_t(header[2]) << 8) | size_t(header[3]);
+  return true;
+}
+
+/**
+ * @brief Looks for the next complete frame.
+ *
+ * Text frames end with "\r\n"; scanning resumes where the previous call
+ * stopped, so a frame that trickles in over many reads is only scanned once.
+ * Binary frames are complete once their announced length has arrived.
+ *
+ * @param buf The buffer to scan.
+ * @param frame Set to a view of the frame, terminator included, on success.
+ * @return true if a complete frame is available.
+ */
+bool read_buffer_peek_frame(read_buffer &buf, string_view &frame)
+{
+  if (buf.binary)
+  {
+    size_t body_length;
+    if (!peek_body_length(buf, body_length) || buf.end - buf.start - 4 < body_length)
+    {
+      return false;
+    }
+    frame = string_view(buf.data.data() + buf.start, 4 + body_length);
+    return true;
+  }
+
+  const char *base = buf.data.data();
+  size_t pos = max(buf.scan_from, buf.start);
+  while (pos < buf.end)
+  {
+    const char *cr = static_cast<const char *>(memchr(base + pos, '\r', buf.end - pos));
+    if (cr == nullptr)
+    {
+      pos = buf.end;
+      break;
+    }
+    size_t cr_pos = cr - base;
+    if (cr_pos + 1 == buf.end)
+    {
+      // The '\n' may still be on its way
+      pos = cr_pos;
+      break;
+    }
+    if (base[cr_pos + 1] == '\n')
+    {
+      buf.scan_from = cr_pos;
+      frame = string_view(base + buf.start, cr_pos + 2 - buf.start);
+      return true;
+    }
+    pos = cr_pos + 1;
+  }
+  buf.scan_from = pos;
+  return false;
+}
+
+/**
+ * @brief Marks the first n unconsumed bytes as processed.
+ *
+ * @param buf The buffer to consume from.
+ * @param n Number of bytes to drop.
+ */
+void read_buffer_consume(read_buffer &buf, size_t n)
+{
+  buf.start += n;
+  if (buf.start >= buf.end)
+  {
+    buf.start = buf.end = buf.scan_from = 0;
+    return;
+  }
+  buf.scan_from = max(buf.scan_from, buf.start);
+}
+
+/**
+ * @brief Reports whether the peer has sent an oversized frame.
+ *
+ * @param buf The buffer to check.
+ * @return true if more than MAX_FRAME_SIZE bytes are pending with no
+ * terminator, or a binary frame announces a body larger than that.
+ */
+bool read_buffer_overflowed(read_buffer &buf)
+{
+  size_t body_length;
+  if (buf.binary)
+  {
+    return peek_body_length(buf, body_length) && body_length > MAX_FRAME_SIZE;
+  }
+  string_view frame;
+  return buf.end - buf.start > MAX_FRAME_SIZE && !read_buffer_peek_frame(buf, frame);
+}
+
+/**
+ * @brief Reads from a blocking socket until one frame is complete.
+ *
+ * The returned view remains valid until the buffer is used again.
+ *
+ * @param fd The file descriptor to read from.
+ * @param buf The connection's receive buffer, reused across calls.
+ * @param frame Set to the frame, terminator included.
+ * @return false if the peer closed the connection, an error occurred or the
+ * frame exceeded MAX_FRAME_SIZE.
+ */
+bool read_frame(int fd, read_buffer &buf, string_view &frame)
+{
+  while (!read_buffer_peek_frame(buf, frame))
+  {
+    if (read_buffer_overflowed(buf))
+    {
+      return false;
+    }
+    ssize_t n = read_buffer_fill(buf, fd);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      return false;
+    }
+  }
+  read_buffer_consume(buf, frame.size());
+  return true;
+}
+
+/**
+ * @brief Negotiates the binary protocol on a freshly connected socket.
+ *
+ * Sends PROTO_V2_REQUEST without waiting for the server's welcome line, then
+ * reads the welcome and the answer, which arrive back to back, and switches
+ * the buffer to binary framing if the server accepts. A server reads the
+ * request only after sending its welcome, so the handshake costs a single
+ * round trip. An older server rejects the request with a text error, in
+ * which case the connection keeps using text.
+ *
+ * @param fd The connected, blocking socket.
+ * @param buf The receive buffer that will be used for the connection.
+ * @return false if the server closed the connection or an I/O error occurred.
+ */
+bool negotiate_protocol_v2(int fd, read_buffer &buf)
+{
+  const string_view request = PROTO_V2_REQUEST;
+  if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size()))
+  {
+    return false;
+  }
+  string_view frame;
+  if (!read_frame(fd, buf, frame) || !read_frame(fd, buf, frame))
+  {
+    return false;
+  }
+  buf.binary = frame == PROTO_V2_ACCEPTED;
+  return true;
+}
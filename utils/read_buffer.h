@@ -0,0 +1,59 @@
+#ifndef READ_BUFFER_H
+#define READ_BUFFER_H
+
+#include <string_view>
+#include <sys/types.h>
+#include <vector>
+
+// Largest frame a peer may send before the connection is treated as broken
+#define MAX_FRAME_SIZE (64 * 1024 * 1024)
+// Minimum free space offered to each read() call
+#define READ_CHUNK_SIZE (64 * 1024)
+
+// Sent by a client after the welcome line to switch the connection to binary
+// length-prefixed frames; servers that do not know it answer with an error
+// and the connection stays on the text protocol.
+#define PROTO_V2_REQUEST "PROTO 2\r\n"
+#define PROTO_V2_ACCEPTED "+OK PROTO 2\r\n"
+
+/**
+ * @brief Per-connection receive buffer that splits the byte stream into
+ * "\r\n" terminated frames, or into length-prefixed frames once the
+ * connection has switched to the binary protocol.
+ *
+ * Bytes are pulled from the socket in large read() calls and scanned with
+ * memchr, so one syscall can deliver many frames and a frame of any size is
+ * received whole. Frames are exposed as views into the buffer; a view stays
+ * valid until the next fill of the same buffer.
+ */
+struct read_buffer
+{
+  std::vector<char> data;
+  size_t start = 0;     // First byte not yet consumed
+  size_t end = 0;       // One past the last byte received
+  size_t scan_from = 0; // Bytes before this offset hold no frame terminator
+  bool binary = false;  // Frames start with a 4-byte big-endian body length
+};
+
+// Performs one read() into the buffer; returns what read() returned.
+ssize_t read_buffer_fill(read_buffer &buf, int fd);
+
+// Finds the next complete frame (terminator or length prefix included)
+// without consuming it.
+bool read_buffer_peek_frame(read_buffer &buf, std::string_view &frame);
+
+// Drops the first n bytes, normally the length of a peeked frame.
+void read_buffer_consume(read_buffer &buf, size_t n);
+
+// True once a pending frame is known to exceed MAX_FRAME_SIZE.
+bool read_buffer_overflowed(read_buffer &buf);
+
+// Blocks until a whole frame has arrived on fd, then consumes and returns it.
+bool read_frame(int fd, read_buffer &buf, std::string_view &frame);
+
+// Client side of the handshake: asks for binary frames and skips the welcome
+// line, in one round trip. Returns false if the connection failed;
+// buf.binary tells which protocol the server agreed to.
+bool negotiate_protocol_v2(int fd, read_buffer &buf);
+
+#endif // READ_BUFFER_H
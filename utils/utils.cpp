@@ -53,7 +53,8 @@ bool fd_is_open(int fd)
  * appropriate types.
  *
  * @param serialized The serialized string representing an F_2_B_Message.
- * @return An F_2_B_Message structure with the parsed data.
+ * @return An F_2_B_Message structure with the parsed data. The packed ops
+ * of a batch message are base64-decoded.
  */
 F_2_B_Message decode_message(const string &serialized)
 {
@@ -79,6 +80,10 @@ F_2_B_Message decode_message(const string &serialized)
   // we use the remainder of the string.
   getline(iss, message.errorMessage);
 
+  if (message.type == F2B_TYPE_BATCH)
+  {
+    message.value = base64_decode(message.value);
+  }
   return message;
 }
 
@@ -93,6 +98,11 @@ F_2_B_Message decode_message(const string &serialized)
  */
 string encode_message(F_2_B_Message f2b_message)
 {
+  // Packed batch ops are binary and may contain '|' or "\r\n"
+  if (f2b_message.type == F2B_TYPE_BATCH)
+  {
+    f2b_message.value = base64_encode(f2b_message.value);
+  }
   ostringstream oss;
   oss << f2b_message.type << "|" << f2b_message.rowkey << "|"
       << f2b_message.colkey << "|" << f2b_message.value << "|"
@@ -102,6 +112,171 @@ string encode_message(F_2_B_Message f2b_message)
   return serialized;
 }
 
+/**
+ * @brief Appends a big-endian integer of the given width to a buffer.
+ *
+ * @param out The buffer to append to.
+ * @param value The value to append.
+ * @param width Number of bytes to write.
+ */
+static void put_uint(string &out, uint32_t value, int width)
+{
+  for (int shift = (width - 1) * 8; shift >= 0; shift -= 8)
+  {
+    out.push_back(static_cast<char>((value >> shift) & 0xff));
+  }
+}
+
+/**
+ * @brief Reads a big-endian integer of the given width from a frame.
+ *
+ * @param frame The frame being decoded.
+ * @param pos The read position, advanced past the integer.
+ * @param width Number of bytes to read.
+ * @return The decoded value.
+ * @throws std::runtime_error if the frame is too short.
+ */
+static uint32_t get_uint(string_view frame, size_t &pos, int width)
+{
+  if (frame.size() - pos < static_cast<size_t>(width))
+  {
+    throw runtime_error("Truncated binary message");
+  }
+  uint32_t value = 0;
+  for (int i = 0; i < width; i++)
+  {
+    value = (value << 8) | static_cast<unsigned char>(frame[pos++]);
+  }
+  return value;
+}
+
+/**
+ * @brief Reads a length-prefixed field from a frame.
+ *
+ * @param frame The frame being decoded.
+ * @param pos The read position, advanced past the field.
+ * @return The field contents.
+ * @throws std::runtime_error if the field runs past the end of the frame.
+ */
+static string get_field(string_view frame, size_t &pos)
+{
+  uint32_t length = get_uint(frame, pos, 4);
+  if (frame.size() - pos < length)
+  {
+    throw runtime_error("Truncated binary message");
+  }
+  string field(frame.substr(pos, length));
+  pos += length;
+  return field;
+}
+
+/**
+ * @brief Decodes a binary (v2) frame into an F_2_B_Message structure.
+ *
+ * Fields are length-prefixed, so keys and values may contain any byte,
+ * including '|' and "\r\n".
+ *
+ * @param frame The complete frame, including its 4-byte length prefix.
+ * @return An F_2_B_Message structure with the parsed data.
+ * @throws std::runtime_error if the frame is malformed.
+ */
+F_2_B_Message decode_message_v2(string_view frame)
+{
+  F_2_B_Message message;
+  size_t pos = 0;
+  uint32_t body_length = get_uint(frame, pos, 4);
+  if (body_length != frame.size() - pos)
+  {
+    throw runtime_error("Binary message length mismatch");
+  }
+
+  message.requestId = get_uint(frame, pos, 4);
+  message.type = get_uint(frame, pos, 2);
+  message.status = static_cast<int16_t>(get_uint(frame, pos, 2));
+  uint32_t flags = get_uint(frame, pos, 1);
+  message.isFromPrimary = (flags & F2B_V2_FLAG_FROM_PRIMARY) ? 1 : 0;
+
+  message.rowkey = get_field(frame, pos);
+  message.colkey = get_field(frame, pos);
+  message.value = get_field(frame, pos);
+  message.value2 = get_field(frame, pos);
+  message.errorMessage = get_field(frame, pos);
+  return message;
+}
+
+/**
+ * @brief Encodes an F_2_B_Message structure into a binary (v2) frame.
+ *
+ * @param f2b_message The F_2_B_Message structure to be encoded.
+ * @return The frame, starting with its 4-byte length prefix.
+ */
+string encode_message_v2(const F_2_B_Message &f2b_message)
+{
+  const string *fields[] = {&f2b_message.rowkey, &f2b_message.colkey,
+                            &f2b_message.value, &f2b_message.value2,
+                            &f2b_message.errorMessage};
+  size_t body_length = F2B_V2_HEADER_SIZE - 4;
+  for (const string *field : fields)
+  {
+    body_length += 4 + field->size();
+  }
+
+  string frame;
+  frame.reserve(4 + body_length);
+  put_uint(frame, body_length, 4);
+  put_uint(frame, f2b_message.requestId, 4);
+  put_uint(frame, f2b_message.type, 2);
+  put_uint(frame, static_cast<uint16_t>(f2b_message.status), 2);
+  put_uint(frame, f2b_message.isFromPrimary == 1 ? F2B_V2_FLAG_FROM_PRIMARY : 0, 1);
+  for (const string *field : fields)
+  {
+    put_uint(frame, field->size(), 4);
+    frame += *field;
+  }
+  return frame;
+}
+
+/**
+ * @brief Packs several messages into the value of a batch message.
+ *
+ * @param ops The operations (or their results) to pack.
+ * @return The ops as concatenated binary (v2) frames.
+ */
+string encode_batch(const vector<F_2_B_Message> &ops)
+{
+  string payload;
+  for (const F_2_B_Message &op : ops)
+  {
+    payload += encode_message_v2(op);
+  }
+  return payload;
+}
+
+/**
+ * @brief Unpacks the messages carried in the value of a batch message.
+ *
+ * @param payload The value produced by encode_batch.
+ * @return The packed messages, in order.
+ * @throws std::runtime_error if the payload is malformed.
+ */
+vector<F_2_B_Message> decode_batch(string_view payload)
+{
+  vector<F_2_B_Message> ops;
+  size_t pos = 0;
+  while (pos < payload.size())
+  {
+    size_t header_pos = pos;
+    size_t frame_length = 4 + get_uint(payload, header_pos, 4);
+    if (payload.size() - pos < frame_length)
+    {
+      throw runtime_error("Truncated batch message");
+    }
+    ops.push_back(decode_message_v2(payload.substr(pos, frame_length)));
+    pos += frame_length;
+  }
+  return ops;
+}
+
 /**
  * @brief Prints the details of an F_2_B_Message structure to the console.
  *
@@ -2,7 +2,9 @@
 #define UTILS_H
 
 #include <cctype>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <map>
 #include <unordered_map>
 #include <vector>
@@ -26,6 +28,41 @@
 #include <openssl/err.h>
 #include <openssl/bio.h>
 
+// Binary (v2) F_2_B frame: u32 body length, u32 request id, u16 type,
+// i16 status, u8 flags, then rowkey, colkey, value, value2 and errorMessage,
+// each as a u32 length followed by the raw bytes. Integers are big-endian.
+#define F2B_V2_HEADER_SIZE 13
+#define F2B_V2_FLAG_FROM_PRIMARY 0x01
+
+// Paginated listing of every cell the receiving node holds, whatever the
+// primary, tablet after tablet in range order. rowkey, if set, keeps only
+// rows starting with it; colkey, if set, names the one tablet to list;
+// value2 is the most rows to return. The reply is one message per cell, then
+// a "terminate" message whose value is the cursor to send as value for the
+// next page, or empty once everything has been listed.
+#define F2B_TYPE_LIST 10
+
+// Message type whose value packs several GET/PUT/DELETE/CPUT ops as
+// concatenated binary frames (see encode_batch). The text protocol carries
+// that value base64-encoded.
+#define F2B_TYPE_BATCH 11
+
+// Range read of the tablet holding rowkey, from rowkey up to (not including)
+// value, or to the end of the tablet if value is empty. value2 is the most
+// rows to return. The reply is one message per cell, as for LIST, then a
+// "terminate" message whose value is the row to continue from, or empty
+// once the range is exhausted.
+#define F2B_TYPE_SCAN 12
+// Range read of every row starting with rowkey, resuming at value if it is
+// set; paginated like F2B_TYPE_SCAN.
+#define F2B_TYPE_PREFIX 13
+
+// Sent by a tablet's primary to its replicas only, over the binary protocol:
+// value holds runs of the primary's own log records, which replicas append
+// to their logs verbatim and apply (see encode_log_shipment). A run without
+// records tells a replica to resync its tablet from a snapshot.
+#define F2B_TYPE_LOG_RECORDS 14
+
 struct F_2_B_Message
 {
     int type;
@@ -36,6 +73,7 @@ struct F_2_B_Message
     int status;
     int isFromPrimary;
     std::string errorMessage;
+    uint32_t requestId = 0; // Only carried by the binary protocol
 };
 
 bool filepath_is_valid(std::string filepath);
@@ -46,6 +84,14 @@ F_2_B_Message decode_message(const std::string &serialized);
 
 std::string encode_message(F_2_B_Message f2b_message);
 
+F_2_B_Message decode_message_v2(std::string_view frame);
+
+std::string encode_message_v2(const F_2_B_Message &f2b_message);
+
+std::string encode_batch(const std::vector<F_2_B_Message> &ops);
+
+std::vector<F_2_B_Message> decode_batch(std::string_view payload);
+
 void print_message(const F_2_B_Message &message);
 
 std::vector<std::string> split(const std::string &s, const std::string &delimiter = " ");